@@ -34,568 +34,5703 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <unistd.h>
 #include <signal.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <string.h>
+#include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <elf.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+
+#include "interval-tree/rbtree.h"
+#include "interval-tree/interval_tree_generic.h"
 
 #define DEFAULT_REDZONE_SIZE 128
+#define MAX_CONTEXT_FRAMES 256
+
+static uint32_t current_tid(void) {
+
+  static __thread uint32_t tid;
+  if (!tid) tid = (uint32_t)syscall(SYS_gettid);
+  return tid;
+
+}
 
 // ------------------------------------------------------------------------- //
-// Alloc
+// Internal allocator
 // ------------------------------------------------------------------------- //
 
-#include "interval-tree/rbtree.h"
-#include "interval-tree/interval_tree_generic.h"
+// Reports can be raised from a signal handler or with the host heap in an
+// inconsistent state, so what runs on the report path (symbolizer, module map,
+// unwinder) never calls malloc. Memory comes straight from mmap, small blocks
+// are bumped out of shared chunks and never reused, big blocks are mapped on
+// their own. Blocks are always zeroed.
 
-// TODO use a mutex for locking insert/delete
+#define INTERNAL_CHUNK_SIZE (4 << 20)
+#define INTERNAL_LARGE (64 * 1024)
+#define INTERNAL_HDR 16  // keeps the block size, preserves the alignment
 
-struct alloc_tree_node {
+struct internal_chunk {
 
-  struct rb_node    rb;
-  struct chunk_info ckinfo;
-  target_ulong      __subtree_last;
+  size_t used;
+  size_t size;
 
 };
 
-#define START(node) ((node)->ckinfo.start)
-#define LAST(node) ((node)->ckinfo.end)
-
-INTERVAL_TREE_DEFINE(struct alloc_tree_node, rb, target_ulong, __subtree_last,
-                     START, LAST, static, alloc_tree)
+static struct internal_chunk* internal_chunk;
 
-static struct rb_root root = RB_ROOT;
+// set while the thread renders a report
+static __thread int report_active;
 
-struct chunk_info* asan_giovese_alloc_search(target_ulong query) {
+static void* internal_map(size_t size) {
 
-  struct alloc_tree_node* node = alloc_tree_iter_first(&root, query, query);
-  if (node) return &node->ckinfo;
-  return NULL;
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
 
 }
 
-void asan_giovese_alloc_insert(target_ulong start, target_ulong end,
-                               struct call_context* alloc_ctx) {
+static void* internal_alloc(size_t size) {
 
-  struct alloc_tree_node* prev_node = alloc_tree_iter_first(&root, start, end);
-  while (prev_node) {
+  size_t need = (size + INTERNAL_HDR + 15) & ~(size_t)15;
+  char*  p;
 
-    struct alloc_tree_node* n = alloc_tree_iter_next(prev_node, start, end);
-    free(prev_node->ckinfo.alloc_ctx);
-    free(prev_node->ckinfo.free_ctx);
-    alloc_tree_remove(prev_node, &root);
-    prev_node = n;
+  if (need >= INTERNAL_LARGE) {
+
+    need = (need + 4095) & ~(size_t)4095;
+    if (!(p = internal_map(need))) return NULL;
+    *(size_t*)p = size;
+    return p + INTERNAL_HDR;
 
   }
 
-  struct alloc_tree_node* node = calloc(sizeof(struct alloc_tree_node), 1);
-  node->ckinfo.start = start;
-  node->ckinfo.end = end;
-  node->ckinfo.alloc_ctx = alloc_ctx;
-  alloc_tree_insert(node, &root);
+  while (1) {
 
-}
+    struct internal_chunk* c =
+        __atomic_load_n(&internal_chunk, __ATOMIC_ACQUIRE);
+    if (c) {
 
-// ------------------------------------------------------------------------- //
-// Init
-// ------------------------------------------------------------------------- //
+      size_t off = __atomic_fetch_add(&c->used, need, __ATOMIC_RELAXED);
+      if (off + need <= c->size) {
 
-void* __ag_high_shadow = HIGH_SHADOW_ADDR;
-void* __ag_low_shadow = LOW_SHADOW_ADDR;
+        p = (char*)c + off;
+        *(size_t*)p = size;
+        return p + INTERNAL_HDR;
 
-void asan_giovese_init(void) {
+      }
 
-  assert(mmap(__ag_high_shadow, HIGH_SHADOW_SIZE, PROT_READ | PROT_WRITE,
-              MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE | MAP_ANON, -1,
-              0) != MAP_FAILED);
+    }
 
-  assert(mmap(__ag_low_shadow, LOW_SHADOW_SIZE, PROT_READ | PROT_WRITE,
-              MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE | MAP_ANON, -1,
-              0) != MAP_FAILED);
+    struct internal_chunk* n = internal_map(INTERNAL_CHUNK_SIZE);
+    if (!n) return NULL;
+    n->used = INTERNAL_HDR;
+    n->size = INTERNAL_CHUNK_SIZE;
+    if (!__atomic_compare_exchange_n(&internal_chunk, &c, n, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      munmap(n, INTERNAL_CHUNK_SIZE);
 
-  assert(mmap(GAP_SHADOW_ADDR, GAP_SHADOW_SIZE, PROT_NONE,
-              MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE | MAP_ANON, -1,
-              0) != MAP_FAILED);
+  }
 
 }
 
-// ------------------------------------------------------------------------- //
-// Checks
-// ------------------------------------------------------------------------- //
+static void internal_free(void* p) {
 
-int asan_giovese_load1(void* ptr) {
+  if (!p) return;
 
-  uintptr_t h = (uintptr_t)ptr;
-  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-  int8_t    k = *shadow_addr;
-  return k != 0 && (intptr_t)((h & 7) + 1) > k;
+  char*  hdr = (char*)p - INTERNAL_HDR;
+  size_t size = *(size_t*)hdr;
+  size_t need = (size + INTERNAL_HDR + 15) & ~(size_t)15;
 
-}
+  // small blocks stay in their chunk
+  if (need >= INTERNAL_LARGE) munmap(hdr, (need + 4095) & ~(size_t)4095);
 
-int asan_giovese_load2(void* ptr) {
+}
 
-  uintptr_t h = (uintptr_t)ptr;
-  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-  int8_t    k = *shadow_addr;
-  return k != 0 && (intptr_t)((h & 7) + 2) > k;
+static void* internal_realloc(void* p, size_t size) {
 
-}
+  if (!p) return internal_alloc(size);
 
-int asan_giovese_load4(void* ptr) {
+  size_t old = *(size_t*)((char*)p - INTERNAL_HDR);
+  if (size <= old) return p;
 
-  uintptr_t h = (uintptr_t)ptr;
-  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-  int8_t    k = *shadow_addr;
-  return k != 0 && (intptr_t)((h & 7) + 4) > k;
+  void* q = internal_alloc(size);
+  if (!q) return NULL;
+  memcpy(q, p, old);
+  internal_free(p);
+  return q;
 
 }
 
-int asan_giovese_load8(void* ptr) {
-
-  uintptr_t h = (uintptr_t)ptr;
-  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-  return (*shadow_addr);
+static void internal_swap(char* x, char* y, size_t size) {
 
-}
+  while (size--) {
 
-int asan_giovese_store1(void* ptr) {
+    char t = *x;
+    *x++ = *y;
+    *y++ = t;
 
-  uintptr_t h = (uintptr_t)ptr;
-  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-  int8_t    k = *shadow_addr;
-  return k != 0 && (intptr_t)((h & 7) + 1) > k;
+  }
 
 }
 
-int asan_giovese_store2(void* ptr) {
+static void internal_sift(char* a, size_t root, size_t n, size_t size,
+                          int (*cmp)(const void*, const void*)) {
 
-  uintptr_t h = (uintptr_t)ptr;
-  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-  int8_t    k = *shadow_addr;
-  return k != 0 && (intptr_t)((h & 7) + 2) > k;
+  size_t child;
+  while ((child = 2 * root + 1) < n) {
+
+    if (child + 1 < n && cmp(a + child * size, a + (child + 1) * size) < 0)
+      ++child;
+    if (cmp(a + root * size, a + child * size) >= 0) break;
+    internal_swap(a + root * size, a + child * size, size);
+    root = child;
+
+  }
 
 }
 
-int asan_giovese_store4(void* ptr) {
+// heapsort, glibc qsort may allocate its scratch space with malloc
+static void internal_sort(void* base, size_t n, size_t size,
+                          int (*cmp)(const void*, const void*)) {
 
-  uintptr_t h = (uintptr_t)ptr;
-  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-  int8_t    k = *shadow_addr;
-  return k != 0 && (intptr_t)((h & 7) + 4) > k;
+  char*  a = base;
+  size_t i;
 
-}
+  for (i = n / 2; i-- > 0;)
+    internal_sift(a, i, n, size, cmp);
 
-int asan_giovese_store8(void* ptr) {
+  while (n > 1) {
 
-  uintptr_t h = (uintptr_t)ptr;
-  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-  return (*shadow_addr);
+    --n;
+    internal_swap(a, a + n * size, size);
+    internal_sift(a, 0, n, size, cmp);
+
+  }
 
 }
 
-int asan_giovese_loadN(void* ptr, size_t n) {
+// ------------------------------------------------------------------------- //
+// Shadow call stack
+// ------------------------------------------------------------------------- //
 
-  if (!n) return 0;
+// Every stack prefix is a node of a trie shared by all threads, a node holds
+// the innermost return address and the id of the prefix without it. A thread
+// keeps the node ids of its prefixes, so a whole stack is identified by the
+// id on the top and the frames are recovered walking the parents.
 
-  uintptr_t start = (uintptr_t)ptr;
-  uintptr_t end = start + n;
-  uintptr_t last_8 = end & ~7;
+#define STACK_TRIE_NODES (1 << 22)
+#define STACK_TRIE_BUCKETS (1 << 23)
+#define SHADOW_STACK_MAX 1024
 
-  if (start & 0x7) {
+struct stack_node {
 
-    uintptr_t next_8 = (start & ~7) + 8;
-    size_t       first_size = next_8 - start;
+  target_ulong pc;
+  uint32_t     parent;
 
-    if (n <= first_size) {
+};
 
-      uintptr_t h = start;
-      int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-      int8_t    k = *shadow_addr;
-      return k != 0 && ((intptr_t)((h & 7) + n) > k);
+static struct stack_node* stack_trie_nodes;
+static uint32_t*          stack_trie_buckets;
+static uint32_t           stack_trie_count = 1;  // id 0 is the empty stack
 
-    }
+static __thread uint32_t shadow_stack_depth;
+static __thread uint32_t shadow_stack[SHADOW_STACK_MAX];
 
-    uintptr_t h = start;
-    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-    int8_t    k = *shadow_addr;
-    if (k != 0 && ((intptr_t)((h & 7) + first_size) > k)) return 1;
+static void shadow_stack_init(void) {
 
-    start = next_8;
+  void* p = mmap(NULL, STACK_TRIE_NODES * sizeof(struct stack_node),
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE | MAP_ANON,
+                 -1, 0);
+  assert(p != MAP_FAILED);
+  stack_trie_nodes = p;
 
-  }
+  p = mmap(NULL, STACK_TRIE_BUCKETS * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_NORESERVE | MAP_ANON, -1, 0);
+  assert(p != MAP_FAILED);
+  stack_trie_buckets = p;
 
-  while (start < last_8) {
+}
 
-    uintptr_t h = start;
-    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-    if (*shadow_addr) return 1;
-    start += 8;
+// a new node, 0 once the trie is full, the count never goes past the end
+static uint32_t stack_trie_new(uint32_t parent, target_ulong pc) {
 
-  }
+  uint32_t id = __atomic_load_n(&stack_trie_count, __ATOMIC_RELAXED);
 
-  if (last_8 != end) {
+  do {
 
-    uintptr_t h = start;
-    size_t    last_size = end - last_8;
-    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-    int8_t    k = *shadow_addr;
-    return k != 0 && ((intptr_t)((h & 7) + last_size) > k);
+    if (id >= STACK_TRIE_NODES) return 0;
 
-  }
+  } while (!__atomic_compare_exchange_n(&stack_trie_count, &id, id + 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-  return 0;
+  stack_trie_nodes[id].pc = pc;
+  stack_trie_nodes[id].parent = parent;
+  return id;
 
 }
 
-int asan_giovese_storeN(void* ptr, size_t n) {
+static uint32_t stack_trie_child(uint32_t parent, target_ulong pc) {
 
-  if (!n) return 0;
+  uint64_t h = (uint64_t)pc ^ ((uint64_t)parent << 32);
+  uint32_t b = (uint32_t)((h * 0x9E3779B97F4A7C15ULL) >> 41);
+  uint32_t new_id = 0;
+  uint32_t i;
 
-  uintptr_t start = (uintptr_t)ptr;
-  uintptr_t end = start + n;
-  uintptr_t last_8 = end & ~7;
+  for (i = 0; i < STACK_TRIE_BUCKETS; ++i) {
 
-  if (start & 0x7) {
+    uint32_t* bucket = &stack_trie_buckets[(b + i) & (STACK_TRIE_BUCKETS - 1)];
+    uint32_t  id = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
 
-    uintptr_t next_8 = (start & ~7) + 8;
-    size_t       first_size = next_8 - start;
+    if (!id) {
 
-    if (n <= first_size) {
+      // a node taken for a lost bucket is kept for the next free one
+      if (!new_id && !(new_id = stack_trie_new(parent, pc)))
+        return parent;  // trie is full
 
-      uintptr_t h = start;
-      int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-      int8_t    k = *shadow_addr;
-      return k != 0 && ((intptr_t)((h & 7) + n) > k);
+      if (__atomic_compare_exchange_n(bucket, &id, new_id, 0, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_ACQUIRE))
+        return new_id;
 
     }
 
-    uintptr_t h = start;
-    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-    int8_t    k = *shadow_addr;
-    if (k != 0 && ((intptr_t)((h & 7) + first_size) > k)) return 1;
-
-    start = next_8;
+    if (stack_trie_nodes[id].pc == pc && stack_trie_nodes[id].parent == parent)
+      return id;
 
   }
 
-  while (start < last_8) {
-
-    uintptr_t h = start;
-    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-    if (*shadow_addr) return 1;
-    start += 8;
-
-  }
+  return parent;
 
-  if (last_8 != end) {
+}
 
-    uintptr_t h = start;
-    size_t    last_size = end - last_8;
-    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-    int8_t    k = *shadow_addr;
-    return k != 0 && ((intptr_t)((h & 7) + last_size) > k);
+void asan_giovese_shadow_push(target_ulong ret_addr) {
 
-  }
+  uint32_t depth = shadow_stack_depth++;
+  if (depth >= SHADOW_STACK_MAX) return;
 
-  return 0;
+  uint32_t parent = depth ? shadow_stack[depth - 1] : 0;
+  shadow_stack[depth] = stack_trie_child(parent, ret_addr);
 
 }
 
-int asan_giovese_guest_loadN(target_ulong addr, size_t n) {
+void asan_giovese_shadow_pop(void) {
 
-  if (!n) return 0;
+  if (shadow_stack_depth) --shadow_stack_depth;
 
-  target_ulong start = addr;
-  target_ulong end = start + n;
-  target_ulong last_8 = end & ~7;
+}
 
-  if (start & 0x7) {
+void asan_giovese_shadow_context(struct call_context* ctx, target_ulong pc) {
 
-    target_ulong next_8 = (start & ~7) + 8;
-    size_t       first_size = next_8 - start;
+  uint32_t depth = shadow_stack_depth;
+  if (depth > SHADOW_STACK_MAX) depth = SHADOW_STACK_MAX;
 
-    if (n <= first_size) {
+  ctx->addresses = NULL;
+  ctx->size = 0;
+  ctx->tid = current_tid();
+  ctx->stack_id = stack_trie_child(depth ? shadow_stack[depth - 1] : 0, pc);
 
-      uintptr_t h = (uintptr_t)g2h(start);
-      int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-      int8_t    k = *shadow_addr;
-      return k != 0 && ((intptr_t)((h & 7) + n) > k);
+}
 
-    }
+// frames of the stack id, innermost first
+static size_t stack_trie_frames(uint32_t id, target_ulong* frames, size_t max) {
 
-    uintptr_t h = (uintptr_t)g2h(start);
-    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-    int8_t    k = *shadow_addr;
-    if (k != 0 && ((intptr_t)((h & 7) + first_size) > k)) return 1;
+  size_t n = 0;
+  while (id && n < max) {
 
-    start = next_8;
+    frames[n++] = stack_trie_nodes[id].pc;
+    id = stack_trie_nodes[id].parent;
 
   }
 
-  while (start < last_8) {
+  return n;
 
-    uintptr_t h = (uintptr_t)g2h(start);
-    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-    if (*shadow_addr) return 1;
-    start += 8;
+}
 
-  }
+// ------------------------------------------------------------------------- //
+// Context
+// ------------------------------------------------------------------------- //
 
-  if (last_8 != end) {
+// Frames are stored as the zigzag varint of the delta from the previous frame.
+// A frame in the module of the previous one takes 2-4 bytes, the first frame
+// and a jump to another module take 7-9 bytes on a 64-bit address space. The
+// deltas need no module table, so a stack stays decodable after its modules
+// are unmapped.
 
-    uintptr_t h = (uintptr_t)g2h(start);
-    size_t    last_size = end - last_8;
-    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-    int8_t    k = *shadow_addr;
-    return k != 0 && ((intptr_t)((h & 7) + last_size) > k);
+static size_t context_put_varint(uint8_t* buf, uint64_t v) {
+
+  size_t len = 0;
+  while (v >= 0x80) {
+
+    buf[len++] = (uint8_t)(v | 0x80);
+    v >>= 7;
 
   }
 
-  return 0;
+  buf[len++] = (uint8_t)v;
+  return len;
 
 }
 
-int asan_giovese_guest_storeN(target_ulong addr, size_t n) {
+void asan_giovese_pack_context(struct call_context* ctx) {
 
-  if (!n) return 0;
+  if (!ctx || (ctx->flags & ASAN_CTX_PACKED) || !ctx->addresses) return;
 
-  target_ulong start = addr;
-  target_ulong end = start + n;
-  target_ulong last_8 = end & ~7;
+  uint8_t  buf[MAX_CONTEXT_FRAMES * 10];
+  size_t   len = 0;
+  uint64_t prev = 0;
+  uint32_t i;
 
-  if (start & 0x7) {
+  if (ctx->size > MAX_CONTEXT_FRAMES) ctx->size = MAX_CONTEXT_FRAMES;
 
-    target_ulong next_8 = (start & ~7) + 8;
-    size_t       first_size = next_8 - start;
+  for (i = 0; i < ctx->size; ++i) {
 
-    if (n <= first_size) {
+    uint64_t d = (uint64_t)ctx->addresses[i] - prev;
+    len +=
+        context_put_varint(&buf[len], (d << 1) ^ (uint64_t)((int64_t)d >> 63));
+    prev = (uint64_t)ctx->addresses[i];
 
-      uintptr_t h = (uintptr_t)g2h(start);
-      int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-      int8_t    k = *shadow_addr;
-      return k != 0 && ((intptr_t)((h & 7) + n) > k);
+  }
 
-    }
+  // without memory the frames stay unpacked
+  uint8_t* packed = malloc(len);
+  if (!packed) return;
+  memcpy(packed, buf, len);
 
-    uintptr_t h = (uintptr_t)g2h(start);
-    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-    int8_t    k = *shadow_addr;
-    if (k != 0 && ((intptr_t)((h & 7) + first_size) > k)) return 1;
+  free(ctx->addresses);
+  ctx->packed = packed;
+  ctx->packed_size = len;
+  ctx->flags |= ASAN_CTX_PACKED;
 
-    start = next_8;
+}
 
-  }
+// decode the frames of ctx in frames, returns the number of frames
+static size_t context_frames(struct call_context* ctx, target_ulong* frames,
+                             size_t max) {
 
-  while (start < last_8) {
+  size_t n = ctx->size < max ? ctx->size : max;
+  size_t i;
 
-    uintptr_t h = (uintptr_t)g2h(start);
-    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-    if (*shadow_addr) return 1;
-    start += 8;
+  if (!(ctx->flags & ASAN_CTX_PACKED)) {
 
-  }
+    for (i = 0; i < n; ++i)
+      frames[i] = ctx->addresses[i];
 
-  if (last_8 != end) {
+  } else {
 
-    uintptr_t h = (uintptr_t)g2h(start);
-    size_t    last_size = end - last_8;
-    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
-    int8_t    k = *shadow_addr;
-    return k != 0 && ((intptr_t)((h & 7) + last_size) > k);
+    uint64_t prev = 0;
+    size_t   pos = 0;
+    for (i = 0; i < n && pos < ctx->packed_size; ++i) {
 
-  }
+      uint64_t z = 0;
+      int      shift = 0;
+      while (pos < ctx->packed_size) {
 
-  return 0;
+        uint8_t b = ctx->packed[pos++];
+        z |= (uint64_t)(b & 0x7f) << shift;
+        shift += 7;
+        if (!(b & 0x80)) break;
 
-}
+      }
 
-// ------------------------------------------------------------------------- //
-// Poison
-// ------------------------------------------------------------------------- //
+      prev += (z >> 1) ^ -(z & 1);
+      frames[i] = (target_ulong)prev;
 
-int asan_giovese_poison_region(void* ptr, size_t n,
-                               uint8_t poison_byte) {
+    }
 
-  if (!n) return 0;
+  }
 
-  uintptr_t start = (uintptr_t)ptr;
-  uintptr_t end = start + n;
-  uintptr_t last_8 = end & ~7;
+  return i + stack_trie_frames(ctx->stack_id, &frames[i], max - i);
 
-  if (start & 0x7) {
+}
 
-    target_ulong next_8 = (start & ~7) + 8;
-    size_t       first_size = next_8 - start;
+static void free_context(struct call_context* ctx) {
 
-    if (n < first_size) return 0;
+  if (!ctx) return;
+  free(ctx->addresses);
+  free(ctx);
 
-    uintptr_t h = start;
-    uint8_t*  shadow_addr = (uint8_t*)(h >> 3) + SHADOW_OFFSET;
-    *shadow_addr = 8 - first_size;
+}
 
-    start = next_8;
+// an unpacked copy of the frames of ctx, that outlives its chunk
+static struct call_context* context_copy(struct call_context* ctx) {
+
+  struct call_context* copy = calloc(sizeof(struct call_context), 1);
+  target_ulong         frames[MAX_CONTEXT_FRAMES];
+  size_t               n = 0;
+
+  if (ctx) {
+
+    n = context_frames(ctx, frames, MAX_CONTEXT_FRAMES);
+    copy->tid = ctx->tid;
+    copy->flags = ctx->flags & ASAN_CTX_SAMPLED;
 
   }
 
-  while (start < last_8) {
+  copy->addresses = malloc((n ? n : 1) * sizeof(target_ulong));
+  memcpy(copy->addresses, frames, n * sizeof(target_ulong));
+  copy->size = n;
+  return copy;
 
-    uintptr_t h = start;
-    uint8_t*  shadow_addr = (uint8_t*)(h >> 3) + SHADOW_OFFSET;
-    *shadow_addr = poison_byte;
-    start += 8;
+}
+
+// ------------------------------------------------------------------------- //
+// Modules
+// ------------------------------------------------------------------------- //
+
+// A report may have interrupted the thread that holds one of these locks, so
+// on the report path the lock is only tried for a while and the lookup is
+// skipped if it stays busy.
+
+#define REPORT_LOCK_TRIES 1000
+
+static int internal_lock(pthread_mutex_t* m) {
+
+  int i;
+
+  if (!report_active) return !pthread_mutex_lock(m);
+
+  for (i = 0; i < REPORT_LOCK_TRIES; ++i) {
+
+    if (!pthread_mutex_trylock(m)) return 1;
+    sched_yield();
 
   }
 
-  return 1;
+  return 0;
 
 }
 
-int asan_giovese_user_poison_region(void* ptr, size_t n) {
+// /proc/self/maps is read in a buffer that is reused across rebuilds and the
+// lines are parsed in place, the paths are terminated in the buffer and the
+// records point to them, so a rebuild allocates nothing per mapping.
 
-  return asan_giovese_poison_region(ptr, n, ASAN_USER);
+struct module_range {
+
+  uintptr_t start;
+  uintptr_t end;
+  uintptr_t base;  // start of the first mapping of the same file
+  uint32_t  path;  // offset in module_maps_buf, empty for anonymous mappings
+  uint32_t  prot;
+
+};
+
+static uint32_t             maps_generation;
+static uint32_t             module_map_generation = UINT32_MAX;
+static pthread_mutex_t      module_map_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct module_range* module_ranges;
+static size_t               module_ranges_count;
+static size_t               module_ranges_cap;
+static char*                module_maps_buf;
+static size_t               module_maps_buf_size;
+
+void asan_giovese_maps_changed(void) {
+
+  __atomic_add_fetch(&maps_generation, 1, __ATOMIC_RELEASE);
 
 }
 
-int asan_giovese_unpoison_region(void* ptr, size_t n) {
+static ssize_t module_map_read(void) {
 
-  target_ulong start = (uintptr_t)ptr;
-  target_ulong end = start + n;
+  int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
 
-  while (start < end) {
+  size_t len = 0;
+  while (1) {
 
-    uintptr_t h = start;
-    uint8_t*  shadow_addr = (uint8_t*)(h >> 3) + SHADOW_OFFSET;
-    *shadow_addr = 0;
-    start += 8;
+    if (module_maps_buf_size - len < 4096) {
+
+      module_maps_buf_size = module_maps_buf_size ? module_maps_buf_size * 2
+                                                  : 64 * 1024;
+      module_maps_buf =
+          internal_realloc(module_maps_buf, module_maps_buf_size);
+
+    }
+
+    // leave room for the terminator
+    ssize_t r = read(fd, &module_maps_buf[len], module_maps_buf_size - len - 1);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    len += r;
 
   }
 
-  return 1;
+  close(fd);
+  module_maps_buf[len] = 0;
+  return len;
 
 }
 
-int asan_giovese_poison_guest_region(target_ulong addr, size_t n,
-                                     uint8_t poison_byte) {
+static uintptr_t module_map_hex(char** p) {
 
-  if (!n) return 0;
-  
-  target_ulong start = addr;
-  target_ulong end = start + n;
-  target_ulong last_8 = end & ~7;
-  
-  if (start & 0x7) {
+  uintptr_t v = 0;
+  while (1) {
 
-    target_ulong next_8 = (start & ~7) + 8;
-    size_t       first_size = next_8 - start;
+    char c = **p;
+    if (c >= '0' && c <= '9')
+      v = (v << 4) | (c - '0');
+    else if (c >= 'a' && c <= 'f')
+      v = (v << 4) | (c - 'a' + 10);
+    else
+      break;
+    ++*p;
 
-    if (n < first_size) return 0;
+  }
 
-    uintptr_t h = (uintptr_t)g2h(start);
-    uint8_t*  shadow_addr = (uint8_t*)(h >> 3) + SHADOW_OFFSET;
-    *shadow_addr = 8 - first_size;
+  return v;
 
-    start = next_8;
+}
+
+static void module_map_skip_field(char** p) {
+
+  while (**p && **p != ' ' && **p != '\n')
+    ++*p;
+  while (**p == ' ')
+    ++*p;
+
+}
+
+static void module_map_build(void) {
+
+  ssize_t len = module_map_read();
+  if (len < 0) return;
+
+  char* p = module_maps_buf;
+  char* end = module_maps_buf + len;
+
+  module_ranges_count = 0;
+
+  while (p < end) {
+
+    struct module_range r;
+    r.start = module_map_hex(&p);
+    if (*p++ != '-') break;
+    r.end = module_map_hex(&p);
+    while (*p == ' ')
+      ++p;
+
+    r.prot = (p[0] == 'r' ? PROT_READ : 0) | (p[1] == 'w' ? PROT_WRITE : 0) |
+             (p[2] == 'x' ? PROT_EXEC : 0);
+    module_map_skip_field(&p);
+    uintptr_t offset = module_map_hex(&p);
+    while (*p == ' ')
+      ++p;
+    module_map_skip_field(&p);  // dev
+    module_map_skip_field(&p);  // inode
+
+    char* path = p;
+    while (*p && *p != '\n')
+      ++p;
+    if (*p) *p++ = 0;
+    r.path = path - module_maps_buf;
+    r.base = r.start;
+
+    // mappings of the same file are contiguous, share the base
+    struct module_range* prev =
+        module_ranges_count ? &module_ranges[module_ranges_count - 1] : NULL;
+    if (prev && offset && *path &&
+        !strcmp(&module_maps_buf[prev->path], path))
+      r.base = prev->base;
+
+    if (module_ranges_count == module_ranges_cap) {
+
+      module_ranges_cap = module_ranges_cap ? module_ranges_cap * 2 : 1024;
+      module_ranges = internal_realloc(
+          module_ranges, module_ranges_cap * sizeof(struct module_range));
+
+    }
+
+    module_ranges[module_ranges_count++] = r;
 
   }
 
-  while (start < last_8) {
+}
 
-    uintptr_t h = (uintptr_t)g2h(start);
-    uint8_t*  shadow_addr = (uint8_t*)(h >> 3) + SHADOW_OFFSET;
-    *shadow_addr = poison_byte;
-    start += 8;
+// the range containing addr, called with module_map_lock held
+static struct module_range* module_map_find(target_ulong addr) {
+
+  uintptr_t a = (uintptr_t)g2h(addr);
+
+  uint32_t gen = __atomic_load_n(&maps_generation, __ATOMIC_ACQUIRE);
+  if (module_map_generation != gen) {
+
+    module_map_build();
+    module_map_generation = gen;
 
   }
 
-  return 1;
+  size_t lo = 0, hi = module_ranges_count;
+  while (lo < hi) {
+
+    size_t mid = lo + (hi - lo) / 2;
+    if (module_ranges[mid].end <= a)
+      lo = mid + 1;
+    else
+      hi = mid;
+
+  }
+
+  if (lo < module_ranges_count && module_ranges[lo].start <= a)
+    return &module_ranges[lo];
+  return NULL;
 
 }
 
-int asan_giovese_user_poison_guest_region(target_ulong addr, size_t n) {
+// the buffer is rewritten or moved by a rebuild, the path is copied under
+// the lock
+int asan_giovese_module_lookup(target_ulong addr, char* path, size_t path_size,
+                               target_ulong* offset) {
 
-  return asan_giovese_poison_guest_region(addr, n, ASAN_USER);
+  int found = 0;
+
+  if (!internal_lock(&module_map_lock)) return 0;
+
+  struct module_range* r = module_map_find(addr);
+  if (r && module_maps_buf[r->path]) {
+
+    if (path_size) snprintf(path, path_size, "%s", &module_maps_buf[r->path]);
+    if (offset) *offset = (uintptr_t)g2h(addr) - r->base;
+    found = 1;
+
+  }
+
+  pthread_mutex_unlock(&module_map_lock);
+  return found;
 
 }
 
-int asan_giovese_unpoison_guest_region(target_ulong addr, size_t n) {
+int asan_giovese_maps_region(target_ulong addr, target_ulong* start,
+                             target_ulong* end, int* prot) {
 
-  target_ulong start = addr;
-  target_ulong end = start + n;
+  if (!internal_lock(&module_map_lock)) return 0;
 
-  while (start < end) {
+  struct module_range* r = module_map_find(addr);
+  if (r) {
 
-    uintptr_t h = (uintptr_t)g2h(start);
-    uint8_t*  shadow_addr = (uint8_t*)(h >> 3) + SHADOW_OFFSET;
-    *shadow_addr = 0;
-    start += 8;
+    if (start) *start = addr - ((uintptr_t)g2h(addr) - r->start);
+    if (end) *end = addr + (r->end - (uintptr_t)g2h(addr));
+    if (prot) *prot = r->prot;
 
   }
 
-  return 1;
+  pthread_mutex_unlock(&module_map_lock);
+  return r != NULL;
+
+}
+
+struct guest_module {
+
+  target_ulong base;
+  target_ulong end;
+  target_ulong load_bias;
+  char         path[];
+
+};
+
+// immutable snapshot of the registry sorted by base, replaced on each change
+struct guest_modules {
+
+  size_t               count;
+  struct guest_module* mods[];
+
+};
+
+static struct guest_modules* guest_modules;
+static uint32_t              guest_modules_readers;
+static pthread_mutex_t       guest_modules_lock = PTHREAD_MUTEX_INITIALIZER;
+static void**                guest_modules_retired;
+static size_t                guest_modules_retired_count;
+static size_t                guest_modules_retired_cap;
+
+static void guest_modules_retire(void* p) {
+
+  if (guest_modules_retired_count == guest_modules_retired_cap) {
+
+    guest_modules_retired_cap =
+        guest_modules_retired_cap ? guest_modules_retired_cap * 2 : 16;
+    guest_modules_retired = realloc(
+        guest_modules_retired, guest_modules_retired_cap * sizeof(void*));
+
+  }
+
+  guest_modules_retired[guest_modules_retired_count++] = p;
+
+}
+
+// publish next under guest_modules_lock, the old snapshot and the removed
+// modules are freed once no reader is in a lookup
+static void guest_modules_publish(struct guest_modules* next) {
+
+  struct guest_modules* prev =
+      __atomic_exchange_n(&guest_modules, next, __ATOMIC_SEQ_CST);
+  if (prev) guest_modules_retire(prev);
+
+  if (__atomic_load_n(&guest_modules_readers, __ATOMIC_SEQ_CST)) return;
+
+  size_t i;
+  for (i = 0; i < guest_modules_retired_count; ++i)
+    free(guest_modules_retired[i]);
+  guest_modules_retired_count = 0;
+
+}
+
+void asan_giovese_module_register(target_ulong base, target_ulong size,
+                                  const char* path, target_ulong load_bias) {
+
+  size_t               len = strlen(path);
+  struct guest_module* mod = malloc(sizeof(struct guest_module) + len + 1);
+  mod->base = base;
+  mod->end = base + size;
+  mod->load_bias = load_bias;
+  memcpy(mod->path, path, len + 1);
+
+  pthread_mutex_lock(&guest_modules_lock);
+
+  struct guest_modules* prev = guest_modules;
+  size_t                count = prev ? prev->count : 0;
+  struct guest_modules* next = malloc(sizeof(struct guest_modules) +
+                                      (count + 1) * sizeof(void*));
+  size_t                i, n = 0;
+  int                   inserted = 0;
+
+  for (i = 0; i < count; ++i) {
+
+    struct guest_module* m = prev->mods[i];
+    if (m->base < mod->end && mod->base < m->end) {
+
+      guest_modules_retire(m);
+      continue;
+
+    }
+
+    if (!inserted && m->base > mod->base) {
+
+      next->mods[n++] = mod;
+      inserted = 1;
+
+    }
+
+    next->mods[n++] = m;
+
+  }
+
+  if (!inserted) next->mods[n++] = mod;
+  next->count = n;
+  guest_modules_publish(next);
+
+  pthread_mutex_unlock(&guest_modules_lock);
+
+}
+
+void asan_giovese_module_unregister(target_ulong base) {
+
+  pthread_mutex_lock(&guest_modules_lock);
+
+  struct guest_modules* prev = guest_modules;
+  size_t                count = prev ? prev->count : 0;
+  struct guest_modules* next =
+      malloc(sizeof(struct guest_modules) + count * sizeof(void*));
+  size_t                i, n = 0;
+
+  for (i = 0; i < count; ++i) {
+
+    if (prev->mods[i]->base == base)
+      guest_modules_retire(prev->mods[i]);
+    else
+      next->mods[n++] = prev->mods[i];
+
+  }
+
+  next->count = n;
+  guest_modules_publish(next);
+
+  pthread_mutex_unlock(&guest_modules_lock);
 
 }
 
+int asan_giovese_guest_module_lookup(target_ulong addr, char* path,
+                                     size_t path_size, target_ulong* offset) {
+
+  int found = 0;
+
+  __atomic_add_fetch(&guest_modules_readers, 1, __ATOMIC_SEQ_CST);
+
+  struct guest_modules* mods =
+      __atomic_load_n(&guest_modules, __ATOMIC_SEQ_CST);
+  if (mods) {
+
+    size_t lo = 0, hi = mods->count;
+    while (lo < hi) {
+
+      size_t mid = lo + (hi - lo) / 2;
+      if (mods->mods[mid]->end <= addr)
+        lo = mid + 1;
+      else
+        hi = mid;
+
+    }
+
+    if (lo < mods->count && mods->mods[lo]->base <= addr) {
+
+      struct guest_module* m = mods->mods[lo];
+      if (path_size) {
+
+        strncpy(path, m->path, path_size - 1);
+        path[path_size - 1] = 0;
+
+      }
+
+      if (offset) *offset = addr - m->load_bias;
+      found = 1;
+
+    }
+
+  }
+
+  __atomic_sub_fetch(&guest_modules_readers, 1, __ATOMIC_RELEASE);
+  return found;
+
+}
 
 // ------------------------------------------------------------------------- //
-// Report
+// Symbolizer
 // ------------------------------------------------------------------------- //
 
-// from https://gist.github.com/RabaDabaDoba/145049536f815903c79944599c6f952a
+#define SYMBOL_NAME_MAX 512
+#define SYMBOL_GAP_MAX 4096  // bytes an unsized symbol may cover
 
-// Regular text
-#define ANSI_COLOR_BLK "\e[0;30m"
-#define ANSI_COLOR_RED "\e[0;31m"
-#define ANSI_COLOR_GRN "\e[0;32m"
-#define ANSI_COLOR_YEL "\e[0;33m"
-#define ANSI_COLOR_BLU "\e[0;34m"
-#define ANSI_COLOR_MAG "\e[0;35m"
-#define ANSI_COLOR_CYN "\e[0;36m"
-#define ANSI_COLOR_WHT "\e[0;37m"
+struct elf_file {
 
-// High intensty text
-#define ANSI_COLOR_HBLK "\e[0;90m"
-#define ANSI_COLOR_HRED "\e[0;91m"
-#define ANSI_COLOR_HGRN "\e[0;92m"
-#define ANSI_COLOR_HYEL "\e[0;93m"
-#define ANSI_COLOR_HBLU "\e[0;94m"
-#define ANSI_COLOR_HMAG "\e[0;95m"
-#define ANSI_COLOR_HCYN "\e[0;96m"
-#define ANSI_COLOR_HWHT "\e[0;97m"
+  const uint8_t* data;
+  size_t         size;
+  int            is64;
+  int            swap;  // endianness differs from the host
 
-// Reset
-#define ANSI_COLOR_RESET "\e[0m"
+};
 
-static const char* shadow_color_map[] = {
+struct elf_symbol {
 
-    "" /* 0x0 */,
-    "" /* 0x1 */,
-    "" /* 0x2 */,
-    "" /* 0x3 */,
-    "" /* 0x4 */,
-    "" /* 0x5 */,
-    "" /* 0x6 */,
-    "" /* 0x7 */,
-    "" /* 0x8 */,
-    "" /* 0x9 */,
-    "" /* 0xa */,
-    "" /* 0xb */,
-    "" /* 0xc */,
-    "" /* 0xd */,
-    "" /* 0xe */,
-    "" /* 0xf */,
-    "" /* 0x10 */,
-    "" /* 0x11 */,
-    "" /* 0x12 */,
-    "" /* 0x13 */,
-    "" /* 0x14 */,
-    "" /* 0x15 */,
-    "" /* 0x16 */,
-    "" /* 0x17 */,
-    "" /* 0x18 */,
-    "" /* 0x19 */,
-    "" /* 0x1a */,
-    "" /* 0x1b */,
-    "" /* 0x1c */,
-    "" /* 0x1d */,
-    "" /* 0x1e */,
-    "" /* 0x1f */,
+  uint64_t    value;
+  uint64_t    size;
+  const char* name;  // in the mapped file
+
+};
+
+struct elf_symbols {
+
+  struct elf_symbols* next;
+  struct elf_file     elf;
+  uint64_t            min_vaddr;  // vaddr mapped at the module start
+  struct elf_symbol*  syms;
+  size_t              count;
+  struct dwarf_lines* lines;  // decoded lazily
+  char                path[];
+
+};
+
+static struct elf_symbols* elf_symbols_cache;
+static pthread_mutex_t     elf_symbols_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t elf_read(const struct elf_file* e, uint64_t off, size_t n) {
+
+  uint64_t v = 0;
+  size_t   i;
+
+  if (off + n > e->size || off + n < off) return 0;
+
+  for (i = 0; i < n; ++i) {
+
+    int j = e->swap ? i : n - 1 - i;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    j = n - 1 - j;
+#endif
+    v = (v << 8) | e->data[off + j];
+
+  }
+
+  return v;
+
+}
+
+#define ELF_FIELD(e, off, type, field)                                   \
+  elf_read((e),                                                          \
+           (off) + ((e)->is64 ? offsetof(Elf64_##type, field)            \
+                              : offsetof(Elf32_##type, field)),          \
+           (e)->is64 ? sizeof(((Elf64_##type*)0)->field)                 \
+                     : sizeof(((Elf32_##type*)0)->field))
+
+// lowest PT_LOAD vaddr, page aligned, of the program headers at phoff in e
+static uint64_t elf_min_vaddr(const struct elf_file* e, uint64_t phoff,
+                              uint64_t phentsize, uint64_t phnum) {
+
+  uint64_t min = UINT64_MAX;
+  uint64_t i;
+
+  for (i = 0; i < phnum; ++i) {
+
+    uint64_t ph = phoff + i * phentsize;
+    if (ELF_FIELD(e, ph, Phdr, p_type) != PT_LOAD) continue;
+    uint64_t vaddr = ELF_FIELD(e, ph, Phdr, p_vaddr) & ~(uint64_t)0xfff;
+    if (vaddr < min) min = vaddr;
+
+  }
+
+  return min;
+
+}
+
+static int elf_symbol_cmp(const void* a, const void* b) {
+
+  const struct elf_symbol* x = a;
+  const struct elf_symbol* y = b;
+  if (x->value != y->value) return x->value < y->value ? -1 : 1;
+  return (x->size < y->size) - (x->size > y->size);  // sized first
+
+}
+
+static void elf_symbols_load(struct elf_symbols* es) {
+
+  int fd = open(es->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < EI_NIDENT) {
+
+    close(fd);
+    return;
+
+  }
+
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return;
+
+  struct elf_file* e = &es->elf;
+  e->data = data;
+  e->size = st.st_size;
+  e->is64 = e->data[EI_CLASS] == ELFCLASS64;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  e->swap = e->data[EI_DATA] != ELFDATA2MSB;
+#else
+  e->swap = e->data[EI_DATA] != ELFDATA2LSB;
+#endif
+
+  if (memcmp(e->data, ELFMAG, SELFMAG)) {
+
+    munmap(data, st.st_size);
+    memset(e, 0, sizeof(struct elf_file));
+    return;
+
+  }
+
+  uint64_t phoff = ELF_FIELD(e, 0, Ehdr, e_phoff);
+  uint64_t phentsize = ELF_FIELD(e, 0, Ehdr, e_phentsize);
+  uint64_t phnum = ELF_FIELD(e, 0, Ehdr, e_phnum);
+  uint64_t shoff = ELF_FIELD(e, 0, Ehdr, e_shoff);
+  uint64_t shentsize = ELF_FIELD(e, 0, Ehdr, e_shentsize);
+  uint64_t shnum = ELF_FIELD(e, 0, Ehdr, e_shnum);
+  uint64_t i, j;
+
+  es->min_vaddr = elf_min_vaddr(e, phoff, phentsize, phnum);
+  if (es->min_vaddr == UINT64_MAX) es->min_vaddr = 0;
+
+  // prefer .symtab, .dynsym is a subset of it
+  int want = SHT_SYMTAB;
+  for (j = 0; j < 2 && !es->count; ++j, want = SHT_DYNSYM) {
+
+    for (i = 0; i < shnum; ++i) {
+
+      uint64_t sh = shoff + i * shentsize;
+      if (ELF_FIELD(e, sh, Shdr, sh_type) != (uint64_t)want) continue;
+
+      uint64_t off = ELF_FIELD(e, sh, Shdr, sh_offset);
+      uint64_t size = ELF_FIELD(e, sh, Shdr, sh_size);
+      uint64_t entsize = ELF_FIELD(e, sh, Shdr, sh_entsize);
+      uint64_t strsh = shoff + ELF_FIELD(e, sh, Shdr, sh_link) * shentsize;
+      uint64_t stroff = ELF_FIELD(e, strsh, Shdr, sh_offset);
+      uint64_t strsize = ELF_FIELD(e, strsh, Shdr, sh_size);
+      uint64_t k, n;
+
+      if (!entsize || off + size > e->size || stroff + strsize > e->size)
+        continue;
+
+      n = size / entsize;
+      es->syms = internal_realloc(
+          es->syms, (es->count + n) * sizeof(struct elf_symbol));
+
+      for (k = 0; k < n; ++k) {
+
+        uint64_t sym = off + k * entsize;
+        uint8_t  info = ELF_FIELD(e, sym, Sym, st_info);
+        uint64_t name = ELF_FIELD(e, sym, Sym, st_name);
+        uint64_t value = ELF_FIELD(e, sym, Sym, st_value);
+
+        if (ELF_FIELD(e, sym, Sym, st_shndx) == SHN_UNDEF || !value ||
+            name >= strsize)
+          continue;
+        if (ELF64_ST_TYPE(info) != STT_FUNC &&
+            ELF64_ST_TYPE(info) != STT_GNU_IFUNC)
+          continue;
+
+        struct elf_symbol* s = &es->syms[es->count++];
+        s->value = value;
+        s->size = ELF_FIELD(e, sym, Sym, st_size);
+        s->name = (const char*)&e->data[stroff + name];
+
+      }
+
+    }
+
+  }
+
+  if (es->count)
+    internal_sort(es->syms, es->count, sizeof(struct elf_symbol),
+                  elf_symbol_cmp);
+
+}
+
+static struct elf_symbols* elf_symbols_get(const char* path) {
+
+  struct elf_symbols* es;
+
+  if (!internal_lock(&elf_symbols_lock)) return NULL;
+
+  for (es = elf_symbols_cache; es; es = es->next)
+    if (!strcmp(es->path, path)) break;
+
+  if (!es) {
+
+    size_t len = strlen(path);
+    es = internal_alloc(sizeof(struct elf_symbols) + len + 1);
+    memcpy(es->path, path, len + 1);
+    elf_symbols_load(es);
+    es->next = elf_symbols_cache;
+    elf_symbols_cache = es;
+
+  }
+
+  pthread_mutex_unlock(&elf_symbols_lock);
+  return es;
+
+}
+
+static const struct elf_symbol* elf_symbols_find(struct elf_symbols* es,
+                                                 uint64_t            vaddr) {
+
+  size_t lo = 0, hi = es->count;
+  while (lo < hi) {
+
+    size_t mid = lo + (hi - lo) / 2;
+    if (es->syms[mid].value <= vaddr)
+      lo = mid + 1;
+    else
+      hi = mid;
+
+  }
+
+  if (!lo) return NULL;
+
+  // aliases at the same address sort sized first, the largest one wins
+  while (lo > 1 && es->syms[lo - 2].value == es->syms[lo - 1].value)
+    --lo;
+
+  const struct elf_symbol* s = &es->syms[lo - 1];
+  if (s->size ? vaddr >= s->value + s->size
+              : vaddr - s->value >= SYMBOL_GAP_MAX)
+    return NULL;
+  return s;
+
+}
+
+#ifndef ASAN_GIOVESE_NO_DWARF
+
+// ------------------------------------------------------------------------- //
+// DWARF
+// ------------------------------------------------------------------------- //
+
+// The line programs of .debug_line are decoded only when an address inside
+// them is symbolized for the first time. The program of an address is found
+// through .debug_aranges and the DWARF_AT_stmt_list of its compilation unit.
+// Only a module without aranges has its programs decoded in order, otherwise
+// an address outside every range has no line info.
+
+// the subset of the DWARF constants used here, dwarf.h is not standard
+enum {
+
+  DWARF_FORM_addr = 0x01,
+  DWARF_FORM_block2 = 0x03,
+  DWARF_FORM_block4 = 0x04,
+  DWARF_FORM_data2 = 0x05,
+  DWARF_FORM_data4 = 0x06,
+  DWARF_FORM_data8 = 0x07,
+  DWARF_FORM_string = 0x08,
+  DWARF_FORM_block = 0x09,
+  DWARF_FORM_block1 = 0x0a,
+  DWARF_FORM_data1 = 0x0b,
+  DWARF_FORM_flag = 0x0c,
+  DWARF_FORM_sdata = 0x0d,
+  DWARF_FORM_strp = 0x0e,
+  DWARF_FORM_udata = 0x0f,
+  DWARF_FORM_ref_addr = 0x10,
+  DWARF_FORM_ref1 = 0x11,
+  DWARF_FORM_ref2 = 0x12,
+  DWARF_FORM_ref4 = 0x13,
+  DWARF_FORM_ref8 = 0x14,
+  DWARF_FORM_ref_udata = 0x15,
+  DWARF_FORM_indirect = 0x16,
+  DWARF_FORM_sec_offset = 0x17,
+  DWARF_FORM_exprloc = 0x18,
+  DWARF_FORM_flag_present = 0x19,
+  DWARF_FORM_strx = 0x1a,
+  DWARF_FORM_addrx = 0x1b,
+  DWARF_FORM_ref_sup4 = 0x1c,
+  DWARF_FORM_strp_sup = 0x1d,
+  DWARF_FORM_data16 = 0x1e,
+  DWARF_FORM_line_strp = 0x1f,
+  DWARF_FORM_ref_sig8 = 0x20,
+  DWARF_FORM_implicit_const = 0x21,
+  DWARF_FORM_loclistx = 0x22,
+  DWARF_FORM_rnglistx = 0x23,
+  DWARF_FORM_ref_sup8 = 0x24,
+  DWARF_FORM_strx1 = 0x25,
+  DWARF_FORM_strx2 = 0x26,
+  DWARF_FORM_strx3 = 0x27,
+  DWARF_FORM_strx4 = 0x28,
+  DWARF_FORM_addrx1 = 0x29,
+  DWARF_FORM_addrx2 = 0x2a,
+  DWARF_FORM_addrx3 = 0x2b,
+  DWARF_FORM_addrx4 = 0x2c,
+  DWARF_FORM_GNU_ref_alt = 0x1f20,
+  DWARF_FORM_GNU_strp_alt = 0x1f21,
+
+  DWARF_AT_stmt_list = 0x10,
+
+  DWARF_UT_skeleton = 0x04,
+  DWARF_UT_split_compile = 0x05,
+
+  DWARF_LNS_copy = 0x01,
+  DWARF_LNS_advance_pc = 0x02,
+  DWARF_LNS_advance_line = 0x03,
+  DWARF_LNS_set_file = 0x04,
+  DWARF_LNS_const_add_pc = 0x08,
+  DWARF_LNS_fixed_advance_pc = 0x09,
+
+  DWARF_LNE_end_sequence = 0x01,
+  DWARF_LNE_set_address = 0x02,
+
+  DWARF_LNCT_path = 0x1,
+  DWARF_LNCT_directory_index = 0x2,
+
+};
+
+struct line_row {
+
+  uint64_t addr;
+  uint32_t file;
+  uint32_t line;  // 0 for the end of a sequence
+
+};
+
+struct line_file {
+
+  const char* dir;
+  const char* name;
+
+};
+
+struct line_program {
+
+  uint64_t          offset;  // in .debug_line
+  int               decoded;
+  uint64_t          lo, hi;
+  struct line_row*  rows;
+  size_t            rows_count;
+  struct line_file* files;
+  size_t            files_count;
+  size_t            files_cap;
+
+};
+
+struct arange {
+
+  uint64_t lo, hi;
+  uint64_t info;  // unit offset in .debug_info
+
+};
+
+struct dwarf_section {
+
+  uint64_t off;
+  uint64_t size;
+
+};
+
+struct dwarf_lines {
+
+  struct dwarf_section line, line_str, str, info, abbrev;
+  struct line_program* progs;
+  size_t               progs_count;
+  size_t               progs_cap;
+  struct arange*       aranges;
+  size_t               aranges_count;
+  size_t               aranges_cap;
+
+};
+
+struct dwarf_cursor {
+
+  const struct elf_file* e;
+  uint64_t               pos;
+  uint64_t               end;
+
+};
+
+static uint64_t dw_read(struct dwarf_cursor* c, size_t n) {
+
+  if (c->pos + n > c->end) {
+
+    c->pos = c->end;
+    return 0;
+
+  }
+
+  uint64_t v = elf_read(c->e, c->pos, n);
+  c->pos += n;
+  return v;
+
+}
+
+static uint64_t dw_uleb(struct dwarf_cursor* c) {
+
+  uint64_t v = 0;
+  int      shift = 0;
+  while (c->pos < c->end) {
+
+    uint8_t b = c->e->data[c->pos++];
+    if (shift < 64) v |= (uint64_t)(b & 0x7f) << shift;
+    shift += 7;
+    if (!(b & 0x80)) break;
+
+  }
+
+  return v;
+
+}
+
+static int64_t dw_sleb(struct dwarf_cursor* c) {
+
+  int64_t v = 0;
+  int     shift = 0;
+  uint8_t b = 0;
+  while (c->pos < c->end) {
+
+    b = c->e->data[c->pos++];
+    if (shift < 64) v |= (int64_t)(b & 0x7f) << shift;
+    shift += 7;
+    if (!(b & 0x80)) break;
+
+  }
+
+  if (shift < 64 && (b & 0x40)) v |= -((int64_t)1 << shift);
+  return v;
+
+}
+
+static const char* dw_str(struct dwarf_cursor* c) {
+
+  const char* s = (const char*)&c->e->data[c->pos];
+  const void* nul = memchr(s, 0, c->end - c->pos);
+  if (!nul) {
+
+    c->pos = c->end;
+    return "";
+
+  }
+
+  c->pos += (const char*)nul - s + 1;
+  return s;
+
+}
+
+// unit_length, sets *offset_size to 4 or 8 and returns the end of the unit
+static uint64_t dw_unit(struct dwarf_cursor* c, int* offset_size) {
+
+  uint64_t len = dw_read(c, 4);
+  *offset_size = 4;
+  if (len == 0xffffffff) {
+
+    len = dw_read(c, 8);
+    *offset_size = 8;
+
+  }
+
+  if (len > c->end - c->pos) return c->end;
+  return c->pos + len;
+
+}
+
+static const char* dw_section_str(const struct elf_file*     e,
+                                  const struct dwarf_section* s, uint64_t off) {
+
+  if (!s->size || off >= s->size) return "";
+  const char* str = (const char*)&e->data[s->off + off];
+  if (!memchr(str, 0, s->size - off)) return "";
+  return str;
+
+}
+
+// value of an attribute of the given form, skipped if it is not a constant,
+// an offset or a string (returned in *str)
+static uint64_t dw_form(struct dwarf_cursor* c, struct dwarf_lines* dl,
+                        uint64_t form, int offset_size, int addr_size,
+                        const char** str) {
+
+  uint64_t v = 0;
+  switch (form) {
+
+    case DWARF_FORM_addr: return dw_read(c, addr_size);
+    case DWARF_FORM_data1:
+    case DWARF_FORM_ref1:
+    case DWARF_FORM_flag:
+    case DWARF_FORM_strx1:
+    case DWARF_FORM_addrx1: return dw_read(c, 1);
+    case DWARF_FORM_data2:
+    case DWARF_FORM_ref2:
+    case DWARF_FORM_strx2:
+    case DWARF_FORM_addrx2: return dw_read(c, 2);
+    case DWARF_FORM_strx3:
+    case DWARF_FORM_addrx3: return dw_read(c, 3);
+    case DWARF_FORM_data4:
+    case DWARF_FORM_ref4:
+    case DWARF_FORM_ref_sup4:
+    case DWARF_FORM_strx4:
+    case DWARF_FORM_addrx4: return dw_read(c, 4);
+    case DWARF_FORM_data8:
+    case DWARF_FORM_ref8:
+    case DWARF_FORM_ref_sig8:
+    case DWARF_FORM_ref_sup8: return dw_read(c, 8);
+    case DWARF_FORM_data16: c->pos += 16; break;
+    case DWARF_FORM_sdata: return dw_sleb(c);
+    case DWARF_FORM_udata:
+    case DWARF_FORM_ref_udata:
+    case DWARF_FORM_strx:
+    case DWARF_FORM_addrx:
+    case DWARF_FORM_loclistx:
+    case DWARF_FORM_rnglistx: return dw_uleb(c);
+    case DWARF_FORM_string: {
+
+      const char* s = dw_str(c);
+      if (str) *str = s;
+      break;
+
+    }
+
+    case DWARF_FORM_strp:
+      v = dw_read(c, offset_size);
+      if (str) *str = dw_section_str(c->e, &dl->str, v);
+      break;
+    case DWARF_FORM_line_strp:
+      v = dw_read(c, offset_size);
+      if (str) *str = dw_section_str(c->e, &dl->line_str, v);
+      break;
+    case DWARF_FORM_ref_addr:
+    case DWARF_FORM_sec_offset:
+    case DWARF_FORM_strp_sup:
+    case DWARF_FORM_GNU_ref_alt:
+    case DWARF_FORM_GNU_strp_alt: return dw_read(c, offset_size);
+    case DWARF_FORM_block1: c->pos += dw_read(c, 1); break;
+    case DWARF_FORM_block2: c->pos += dw_read(c, 2); break;
+    case DWARF_FORM_block4: c->pos += dw_read(c, 4); break;
+    case DWARF_FORM_block:
+    case DWARF_FORM_exprloc: c->pos += dw_uleb(c); break;
+    case DWARF_FORM_flag_present:
+    case DWARF_FORM_implicit_const: break;
+    case DWARF_FORM_indirect:
+      return dw_form(c, dl, dw_uleb(c), offset_size, addr_size, str);
+    default: c->pos = c->end; break;
+
+  }
+
+  if (c->pos > c->end) c->pos = c->end;
+  return v;
+
+}
+
+static int elf_section(const struct elf_file* e, const char* name,
+                       struct dwarf_section* s) {
+
+  uint64_t shoff = ELF_FIELD(e, 0, Ehdr, e_shoff);
+  uint64_t shentsize = ELF_FIELD(e, 0, Ehdr, e_shentsize);
+  uint64_t shnum = ELF_FIELD(e, 0, Ehdr, e_shnum);
+  uint64_t strsh = shoff + ELF_FIELD(e, 0, Ehdr, e_shstrndx) * shentsize;
+  struct dwarf_section names = {ELF_FIELD(e, strsh, Shdr, sh_offset),
+                                ELF_FIELD(e, strsh, Shdr, sh_size)};
+  uint64_t i;
+
+  for (i = 0; i < shnum; ++i) {
+
+    uint64_t sh = shoff + i * shentsize;
+    if (strcmp(dw_section_str(e, &names, ELF_FIELD(e, sh, Shdr, sh_name)),
+               name))
+      continue;
+
+    s->off = ELF_FIELD(e, sh, Shdr, sh_offset);
+    s->size = ELF_FIELD(e, sh, Shdr, sh_size);
+    if (ELF_FIELD(e, sh, Shdr, sh_type) == SHT_NOBITS ||
+        s->off + s->size > e->size) {
+
+      s->size = 0;
+      return 0;
+
+    }
+
+    return 1;
+
+  }
+
+  return 0;
+
+}
+
+static int arange_cmp(const void* a, const void* b) {
+
+  const struct arange* x = a;
+  const struct arange* y = b;
+  return (x->lo > y->lo) - (x->lo < y->lo);
+
+}
+
+static int line_row_cmp(const void* a, const void* b) {
+
+  const struct line_row* x = a;
+  const struct line_row* y = b;
+  if (x->addr != y->addr) return x->addr < y->addr ? -1 : 1;
+  return (x->line != 0) - (y->line != 0);  // ends before starts
+
+}
+
+static void dwarf_index(const struct elf_file* e, struct dwarf_lines* dl) {
+
+  struct dwarf_section aranges = {0, 0};
+  struct dwarf_cursor  c = {e, 0, 0};
+  int                  offset_size;
+
+  elf_section(e, ".debug_line", &dl->line);
+  elf_section(e, ".debug_line_str", &dl->line_str);
+  elf_section(e, ".debug_str", &dl->str);
+  elf_section(e, ".debug_info", &dl->info);
+  elf_section(e, ".debug_abbrev", &dl->abbrev);
+  elf_section(e, ".debug_aranges", &aranges);
+
+  c.pos = dl->line.off;
+  c.end = dl->line.off + dl->line.size;
+  while (c.pos < c.end) {
+
+    uint64_t start = c.pos;
+    uint64_t next = dw_unit(&c, &offset_size);
+    if (next <= start) break;
+
+    if (dl->progs_count == dl->progs_cap) {
+
+      dl->progs_cap = dl->progs_cap ? dl->progs_cap * 2 : 64;
+      dl->progs = internal_realloc(
+          dl->progs, dl->progs_cap * sizeof(struct line_program));
+
+    }
+
+    memset(&dl->progs[dl->progs_count], 0, sizeof(struct line_program));
+    dl->progs[dl->progs_count++].offset = start - dl->line.off;
+    c.pos = next;
+
+  }
+
+  c.pos = aranges.off;
+  c.end = aranges.off + aranges.size;
+  while (c.pos < c.end) {
+
+    uint64_t start = c.pos;
+    uint64_t next = dw_unit(&c, &offset_size);
+    if (next <= start) break;
+
+    struct dwarf_cursor u = {e, c.pos, next};
+    dw_read(&u, 2);  // version
+    uint64_t info = dw_read(&u, offset_size);
+    uint8_t  addr_size = dw_read(&u, 1);
+    dw_read(&u, 1);  // segment selector size
+
+    if (addr_size == 4 || addr_size == 8) {
+
+      // tuples are aligned to twice the address size from the unit start
+      uint64_t align = 2 * addr_size;
+      u.pos = start + ((u.pos - start + align - 1) / align) * align;
+
+      while (u.pos + 2 * addr_size <= u.end) {
+
+        uint64_t lo = dw_read(&u, addr_size);
+        uint64_t len = dw_read(&u, addr_size);
+        if (!lo && !len) break;
+
+        if (dl->aranges_count == dl->aranges_cap) {
+
+          dl->aranges_cap = dl->aranges_cap ? dl->aranges_cap * 2 : 64;
+          dl->aranges = internal_realloc(
+              dl->aranges, dl->aranges_cap * sizeof(struct arange));
+
+        }
+
+        struct arange* r = &dl->aranges[dl->aranges_count++];
+        r->lo = lo;
+        r->hi = lo + len;
+        r->info = info;
+
+      }
+
+    }
+
+    c.pos = next;
+
+  }
+
+  if (dl->aranges_count)
+    internal_sort(dl->aranges, dl->aranges_count, sizeof(struct arange),
+                  arange_cmp);
+
+}
+
+// DWARF_AT_stmt_list of the unit at info, or UINT64_MAX
+static uint64_t dwarf_unit_stmt_list(const struct elf_file* e,
+                                     struct dwarf_lines* dl, uint64_t info) {
+
+  if (info >= dl->info.size) return UINT64_MAX;
+
+  struct dwarf_cursor c = {e, dl->info.off + info, dl->info.off + dl->info.size};
+  int                 offset_size;
+  uint64_t            abbrev_off;
+  uint8_t             addr_size;
+
+  c.end = dw_unit(&c, &offset_size);
+
+  uint16_t version = dw_read(&c, 2);
+  if (version >= 5) {
+
+    uint8_t unit_type = dw_read(&c, 1);
+    addr_size = dw_read(&c, 1);
+    abbrev_off = dw_read(&c, offset_size);
+    if (unit_type == DWARF_UT_skeleton || unit_type == DWARF_UT_split_compile)
+      dw_read(&c, 8);  // dwo id
+
+  } else {
+
+    abbrev_off = dw_read(&c, offset_size);
+    addr_size = dw_read(&c, 1);
+
+  }
+
+  uint64_t code = dw_uleb(&c);
+  if (!code || abbrev_off >= dl->abbrev.size) return UINT64_MAX;
+
+  struct dwarf_cursor a = {e, dl->abbrev.off + abbrev_off,
+                           dl->abbrev.off + dl->abbrev.size};
+  while (a.pos < a.end) {
+
+    uint64_t acode = dw_uleb(&a);
+    if (!acode) return UINT64_MAX;
+    dw_uleb(&a);     // tag
+    dw_read(&a, 1);  // children
+
+    while (a.pos < a.end) {
+
+      uint64_t name = dw_uleb(&a);
+      uint64_t form = dw_uleb(&a);
+      if (form == DWARF_FORM_implicit_const) dw_sleb(&a);
+      if (!name && !form) break;
+      if (acode != code) continue;
+
+      uint64_t v = dw_form(&c, dl, form, offset_size, addr_size, NULL);
+      if (name == DWARF_AT_stmt_list) return v;
+
+    }
+
+    if (acode == code) break;
+
+  }
+
+  return UINT64_MAX;
+
+}
+
+static void line_file_push(struct line_program* lp, const char* dir,
+                           const char* name) {
+
+  if (lp->files_count == lp->files_cap) {
+
+    lp->files_cap = lp->files_cap ? lp->files_cap * 2 : 16;
+    lp->files =
+        internal_realloc(lp->files, lp->files_cap * sizeof(struct line_file));
+
+  }
+
+  lp->files[lp->files_count].dir = dir;
+  lp->files[lp->files_count++].name = name;
+
+}
+
+// v5 directory or file name table, without dirs the entries are directories
+static void dwarf_v5_entries(struct dwarf_cursor* c, struct dwarf_lines* dl,
+                             struct line_program* lp, int offset_size,
+                             int addr_size, const char** dirs,
+                             size_t dirs_count) {
+
+  uint8_t  formats_count = dw_read(c, 1);
+  uint64_t formats[2 * 256];
+  uint64_t i, j;
+
+  for (i = 0; i < formats_count; ++i) {
+
+    formats[2 * i] = dw_uleb(c);
+    formats[2 * i + 1] = dw_uleb(c);
+
+  }
+
+  uint64_t count = dw_uleb(c);
+  for (i = 0; i < count && c->pos < c->end; ++i) {
+
+    const char* name = "";
+    uint64_t    dir = 0;
+    for (j = 0; j < formats_count; ++j) {
+
+      const char* str = NULL;
+      uint64_t    v =
+          dw_form(c, dl, formats[2 * j + 1], offset_size, addr_size, &str);
+      if (formats[2 * j] == DWARF_LNCT_path && str) name = str;
+      if (formats[2 * j] == DWARF_LNCT_directory_index) dir = v;
+
+    }
+
+    line_file_push(lp, dir < dirs_count ? dirs[dir] : NULL, name);
+
+  }
+
+}
+
+static void line_row_push(struct line_program* lp, size_t* rows_cap,
+                          uint64_t addr, uint32_t file, uint32_t line) {
+
+  if (lp->rows_count == *rows_cap) {
+
+    *rows_cap = *rows_cap ? *rows_cap * 2 : 256;
+    lp->rows = internal_realloc(lp->rows, *rows_cap * sizeof(struct line_row));
+
+  }
+
+  lp->rows[lp->rows_count].addr = addr;
+  lp->rows[lp->rows_count].file = file;
+  lp->rows[lp->rows_count++].line = line;
+  if (addr < lp->lo) lp->lo = addr;
+  if (addr > lp->hi) lp->hi = addr;
+
+}
+
+static void dwarf_decode(const struct elf_file* e, struct dwarf_lines* dl,
+                         struct line_program* lp) {
+
+  struct dwarf_cursor c = {e, dl->line.off + lp->offset,
+                           dl->line.off + dl->line.size};
+  int                 offset_size;
+  uint8_t             addr_size = e->is64 ? 8 : 4;
+  uint64_t            i;
+
+  lp->decoded = 1;
+  lp->lo = UINT64_MAX;
+  c.end = dw_unit(&c, &offset_size);
+
+  uint16_t version = dw_read(&c, 2);
+  if (version < 2 || version > 5) return;
+  if (version >= 5) {
+
+    addr_size = dw_read(&c, 1);
+    dw_read(&c, 1);  // segment selector size
+
+  }
+
+  uint64_t header_length = dw_read(&c, offset_size);
+  uint64_t program = c.pos + header_length;
+  uint8_t  min_inst_len = dw_read(&c, 1);
+  if (version >= 4) dw_read(&c, 1);  // maximum operations per instruction
+  dw_read(&c, 1);                    // default_is_stmt
+  int8_t  line_base = dw_read(&c, 1);
+  uint8_t line_range = dw_read(&c, 1);
+  uint8_t opcode_base = dw_read(&c, 1);
+  uint8_t opcode_lengths[256];
+
+  if (!line_range || !opcode_base) return;
+  for (i = 1; i < opcode_base; ++i)
+    opcode_lengths[i] = dw_read(&c, 1);
+
+  if (version >= 5) {
+
+    dwarf_v5_entries(&c, dl, lp, offset_size, addr_size, NULL, 0);
+
+    size_t       dirs_count = lp->files_count;
+    const char** dirs = internal_alloc((dirs_count + 1) * sizeof(char*));
+    for (i = 0; i < dirs_count; ++i)
+      dirs[i] = lp->files[i].name;
+    lp->files_count = 0;
+
+    dwarf_v5_entries(&c, dl, lp, offset_size, addr_size, dirs, dirs_count);
+    internal_free(dirs);
+
+  } else {
+
+    size_t       dirs_cap = 16;
+    const char** dirs = internal_alloc(dirs_cap * sizeof(char*));
+    size_t       dirs_count = 1;
+    dirs[0] = NULL;  // the compilation directory
+    while (c.pos < program) {
+
+      const char* dir = dw_str(&c);
+      if (!*dir) break;
+      if (dirs_count == dirs_cap) {
+
+        dirs_cap *= 2;
+        dirs = internal_realloc(dirs, dirs_cap * sizeof(char*));
+
+      }
+
+      dirs[dirs_count++] = dir;
+
+    }
+
+    line_file_push(lp, NULL, NULL);  // file numbers start at 1
+    while (c.pos < program) {
+
+      const char* name = dw_str(&c);
+      if (!*name) break;
+      uint64_t dir = dw_uleb(&c);
+      dw_uleb(&c);  // mtime
+      dw_uleb(&c);  // length
+
+      line_file_push(lp, dir < dirs_count ? dirs[dir] : NULL, name);
+
+    }
+
+    internal_free(dirs);
+
+  }
+
+  // state machine
+  uint64_t addr = 0;
+  uint32_t file = 1, line = 1;
+  size_t   rows_cap = 0;
+  c.pos = program;
+
+  while (c.pos < c.end) {
+
+    uint8_t op = dw_read(&c, 1);
+
+    if (op >= opcode_base) {
+
+      uint8_t adjusted = op - opcode_base;
+      addr += (adjusted / line_range) * min_inst_len;
+      line += line_base + adjusted % line_range;
+      line_row_push(lp, &rows_cap, addr, file, line ? line : 1);
+      continue;
+
+    }
+
+    switch (op) {
+
+      case 0: {
+
+        uint64_t len = dw_uleb(&c);
+        uint64_t next = c.pos + len;
+        uint8_t  sub = len ? dw_read(&c, 1) : 0;
+        if (sub == DWARF_LNE_end_sequence) {
+
+          line_row_push(lp, &rows_cap, addr, file, 0);
+          addr = 0;
+          file = 1;
+          line = 1;
+
+        } else if (sub == DWARF_LNE_set_address)
+
+          addr = dw_read(&c, len - 1 <= 8 ? len - 1 : 8);
+
+        c.pos = next;
+        break;
+
+      }
+
+      case DWARF_LNS_copy:
+        line_row_push(lp, &rows_cap, addr, file, line ? line : 1);
+        break;
+      case DWARF_LNS_advance_pc: addr += dw_uleb(&c) * min_inst_len; break;
+      case DWARF_LNS_advance_line: line += dw_sleb(&c); break;
+      case DWARF_LNS_set_file: file = dw_uleb(&c); break;
+      case DWARF_LNS_const_add_pc:
+        addr += ((255 - opcode_base) / line_range) * min_inst_len;
+        break;
+      case DWARF_LNS_fixed_advance_pc: addr += dw_read(&c, 2); break;
+      default:
+        for (i = 0; i < opcode_lengths[op]; ++i)
+          dw_uleb(&c);
+        break;
+
+    }
+
+  }
+
+  if (lp->rows_count)
+    internal_sort(lp->rows, lp->rows_count, sizeof(struct line_row),
+                  line_row_cmp);
+
+}
+
+static const struct line_row* dwarf_program_find(struct line_program* lp,
+                                                  uint64_t vaddr) {
+
+  if (vaddr < lp->lo || vaddr >= lp->hi) return NULL;
+
+  size_t lo = 0, hi = lp->rows_count;
+  while (lo < hi) {
+
+    size_t mid = lo + (hi - lo) / 2;
+    if (lp->rows[mid].addr <= vaddr)
+      lo = mid + 1;
+    else
+      hi = mid;
+
+  }
+
+  if (!lo || !lp->rows[lo - 1].line) return NULL;
+  return &lp->rows[lo - 1];
+
+}
+
+static struct line_program* dwarf_program_at(struct dwarf_lines* dl,
+                                             uint64_t            offset) {
+
+  size_t lo = 0, hi = dl->progs_count;
+  while (lo < hi) {
+
+    size_t mid = lo + (hi - lo) / 2;
+    if (dl->progs[mid].offset < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+
+  }
+
+  if (lo < dl->progs_count && dl->progs[lo].offset == offset)
+    return &dl->progs[lo];
+  return NULL;
+
+}
+
+// file and line of vaddr, called with elf_symbols_lock held
+static int dwarf_lookup(struct elf_symbols* es, uint64_t vaddr,
+                        const char** dir, const char** name,
+                        uint32_t* line) {
+
+  struct dwarf_lines*    dl = es->lines;
+  const struct line_row* row = NULL;
+  struct line_program*   lp = NULL;
+  size_t                 i;
+
+  if (!es->elf.data) return 0;
+  if (!dl) {
+
+    dl = es->lines = internal_alloc(sizeof(struct dwarf_lines));
+    dwarf_index(&es->elf, dl);
+
+  }
+
+  size_t lo = 0, hi = dl->aranges_count;
+  while (lo < hi) {
+
+    size_t mid = lo + (hi - lo) / 2;
+    if (dl->aranges[mid].lo <= vaddr)
+      lo = mid + 1;
+    else
+      hi = mid;
+
+  }
+
+  if (lo && vaddr < dl->aranges[lo - 1].hi) {
+
+    lp = dwarf_program_at(
+        dl, dwarf_unit_stmt_list(&es->elf, dl, dl->aranges[lo - 1].info));
+    if (lp && !lp->decoded) dwarf_decode(&es->elf, dl, lp);
+    if (lp) row = dwarf_program_find(lp, vaddr);
+
+  }
+
+  // decoding every program for each miss is only worth it without aranges
+  for (i = 0; !dl->aranges_count && !row && i < dl->progs_count; ++i) {
+
+    lp = &dl->progs[i];
+    if (!lp->decoded) dwarf_decode(&es->elf, dl, lp);
+    row = dwarf_program_find(lp, vaddr);
+
+  }
+
+  if (!row || row->file >= lp->files_count || !lp->files[row->file].name)
+    return 0;
+
+  *dir = lp->files[row->file].dir;
+  *name = lp->files[row->file].name;
+  *line = row->line;
+  return 1;
+
+}
+
+#endif
+
+// path of the module containing addr, its offset from the start of the
+// module (module map) or from the load bias (registry) and the ELF vaddr
+static struct elf_symbols* module_resolve(target_ulong addr, char* path,
+                                          size_t path_size,
+                                          target_ulong* offset,
+                                          uint64_t*     vaddr) {
+
+  int base_relative = 0;
+
+  path[0] = 0;
+  if (!asan_giovese_guest_module_lookup(addr, path, path_size, offset)) {
+
+    if (!asan_giovese_module_lookup(addr, path, path_size, offset))
+      return NULL;
+    base_relative = 1;
+
+  }
+
+  *vaddr = *offset;
+
+  // pseudo paths like [vdso] are not files
+  if (path[0] != '/') return NULL;
+
+  struct elf_symbols* es = elf_symbols_get(path);
+  if (es && base_relative) *vaddr += es->min_vaddr;
+  return es;
+
+}
+
+int asan_giovese_symbolize(target_ulong addr, char* name, size_t name_size,
+                           target_ulong* offset) {
+
+  char                     path[PATH_MAX];
+  target_ulong             mod_offset;
+  uint64_t                 vaddr;
+  struct elf_symbols*      es;
+  const struct elf_symbol* s;
+
+  es = module_resolve(addr, path, sizeof(path), &mod_offset, &vaddr);
+  if (!es || !(s = elf_symbols_find(es, vaddr))) return 0;
+
+  snprintf(name, name_size, "%s", s->name);
+  if (offset) *offset = vaddr - s->value;
+  return 1;
+
+}
+
+int asan_giovese_symbolize_line(target_ulong addr, char* file,
+                                size_t file_size, uint32_t* line) {
+
+#ifndef ASAN_GIOVESE_NO_DWARF
+  char                path[PATH_MAX];
+  target_ulong        mod_offset;
+  uint64_t            vaddr;
+  struct elf_symbols* es;
+  const char *        dir, *name;
+  int                 found = 0;
+
+  es = module_resolve(addr, path, sizeof(path), &mod_offset, &vaddr);
+  if (!es || !internal_lock(&elf_symbols_lock)) return 0;
+
+  if (dwarf_lookup(es, vaddr, &dir, &name, line)) {
+
+    if (dir && name[0] != '/')
+      snprintf(file, file_size, "%s/%s", dir, name);
+    else
+      snprintf(file, file_size, "%s", name);
+    found = 1;
+
+  }
+
+  pthread_mutex_unlock(&elf_symbols_lock);
+  return found;
+#else
+  return 0;
+#endif
+
+}
+
+#ifndef ASAN_GIOVESE_NO_DEFAULT_PRINTADDR
+
+#define PRINTADDR_MAX 4096
+
+__attribute__((weak)) char* asan_giovese_printaddr(target_ulong addr) {
+
+  static __thread char buf[PRINTADDR_MAX];
+  char                 path[PATH_MAX];
+  char                 file[PRINTADDR_MAX / 4];
+  target_ulong         offset;
+  uint64_t             vaddr;
+  uint32_t             line;
+
+  struct elf_symbols* es =
+      module_resolve(addr, path, sizeof(path), &offset, &vaddr);
+  const struct elf_symbol* s = es ? elf_symbols_find(es, vaddr) : NULL;
+
+  if (!es && !path[0]) return NULL;
+
+  // the path is looked up whole but printed at most a quarter of the buffer
+  if (s && asan_giovese_symbolize_line(addr, file, sizeof(file), &line))
+    snprintf(buf, sizeof(buf), " in %.*s %s:%u (%.*s+0x%" PRIx64 ")",
+             SYMBOL_NAME_MAX, s->name, file, line, PRINTADDR_MAX / 4, path,
+             (uint64_t)offset);
+  else if (s)
+    snprintf(buf, sizeof(buf), " in %.*s+0x%" PRIx64 " (%.*s+0x%" PRIx64 ")",
+             SYMBOL_NAME_MAX, s->name, vaddr - s->value, PRINTADDR_MAX / 4,
+             path, (uint64_t)offset);
+  else
+    snprintf(buf, sizeof(buf), " (%.*s+0x%" PRIx64 ")", PRINTADDR_MAX / 4,
+             path, (uint64_t)offset);
+
+  return buf;
+
+}
+
+#endif
+
+// ------------------------------------------------------------------------- //
+// Unwind
+// ------------------------------------------------------------------------- //
+
+#define UNWIND_CACHE_SIZE 8
+#define UNWIND_PAGE_SIZE 4096
+#define UNWIND_MIPS_SCAN 256
+
+struct unwind_arch {
+
+  uint8_t word_size;
+  uint8_t big_endian;
+  int8_t  fp_off;     // saved frame pointer, relative to the frame pointer
+  int8_t  ra_off;     // return address, relative to the frame pointer
+  uint8_t addr_bits;  // significant bits of a user address, 0 if all
+
+};
+
+static const struct unwind_arch unwind_archs[] = {
+
+    [ASAN_ARCH_X86_64] = {8, 0, 0, 8, 47},
+    [ASAN_ARCH_I386] = {4, 0, 0, 4, 0},
+    [ASAN_ARCH_AARCH64] = {8, 0, 0, 8, 48},
+    [ASAN_ARCH_ARM] = {4, 0, -4, 0, 0},
+    [ASAN_ARCH_MIPS] = {4, 1, 0, 0, 0},
+    [ASAN_ARCH_MIPSEL] = {4, 0, 0, 0, 0},
+
+};
+
+static int                  unwind_arch_id = ASAN_ARCH_X86_64;
+static asan_giovese_read_fn unwind_read_fn;
+
+static __thread target_ulong unwind_stack_lo, unwind_stack_hi;
+static __thread target_ulong unwind_cache[UNWIND_CACHE_SIZE][2];
+static __thread uint32_t     unwind_cache_next;
+static __thread uint32_t     unwind_cache_gen;
+
+void asan_giovese_set_unwinder(int arch, asan_giovese_read_fn read_fn) {
+
+  unwind_arch_id = arch;
+  unwind_read_fn = read_fn;
+
+}
+
+void asan_giovese_set_stack_range(target_ulong lo, target_ulong hi) {
+
+  unwind_stack_lo = lo;
+  unwind_stack_hi = hi;
+
+}
+
+static int unwind_read(target_ulong addr, void* buf, size_t n) {
+
+  uint32_t gen = __atomic_load_n(&maps_generation, __ATOMIC_ACQUIRE);
+  uint32_t i;
+
+  if (unwind_cache_gen != gen) {
+
+    memset(unwind_cache, 0, sizeof(unwind_cache));
+    unwind_cache_gen = gen;
+
+  }
+
+  int valid = addr >= unwind_stack_lo && addr + n <= unwind_stack_hi;
+  for (i = 0; !valid && i < UNWIND_CACHE_SIZE; ++i)
+    valid = addr >= unwind_cache[i][0] && addr + n <= unwind_cache[i][1];
+
+  if (valid) {
+
+    memcpy(buf, (void*)(uintptr_t)g2h(addr), n);
+    return 1;
+
+  }
+
+  if (!unwind_read_fn || !unwind_read_fn(addr, buf, n)) return 0;
+
+  // a word never spans two pages, addr is aligned
+  i = unwind_cache_next++ % UNWIND_CACHE_SIZE;
+  unwind_cache[i][0] = addr & ~(target_ulong)(UNWIND_PAGE_SIZE - 1);
+  unwind_cache[i][1] = unwind_cache[i][0] + UNWIND_PAGE_SIZE;
+  return 1;
+
+}
+
+static int unwind_read_word(const struct unwind_arch* arch, target_ulong addr,
+                            target_ulong* word) {
+
+  uint8_t  b[8];
+  uint64_t v = 0;
+  int      i;
+
+  if (!unwind_read(addr, b, arch->word_size)) return 0;
+
+  for (i = 0; i < arch->word_size; ++i) {
+
+    int j = arch->big_endian ? i : arch->word_size - 1 - i;
+    v = (v << 8) | b[j];
+
+  }
+
+  *word = (target_ulong)v;
+  return 1;
+
+}
+
+static int unwind_frame_ok(const struct unwind_arch* arch, target_ulong fp) {
+
+  if (!fp || (fp & (arch->word_size - 1))) return 0;
+  if (arch->addr_bits && ((uint64_t)fp >> arch->addr_bits)) return 0;
+  if (unwind_stack_hi && (fp < unwind_stack_lo || fp >= unwind_stack_hi))
+    return 0;
+  return 1;
+
+}
+
+static size_t unwind_fp(const struct unwind_arch* arch, target_ulong fp,
+                        target_ulong* frames, size_t n, size_t max) {
+
+  while (n < max && unwind_frame_ok(arch, fp)) {
+
+    target_ulong ra, next_fp;
+    if (!unwind_read_word(arch, fp + arch->ra_off, &ra) || !ra) break;
+    if (!unwind_read_word(arch, fp + arch->fp_off, &next_fp)) break;
+
+    frames[n++] = ra;
+    if (next_fp <= fp) break;
+    fp = next_fp;
+
+  }
+
+  return n;
+
+}
+
+// look for addiu sp,sp,-size and sw ra,off(sp) before pc
+static size_t unwind_mips(const struct unwind_arch* arch, target_ulong pc,
+                          target_ulong sp, target_ulong* frames, size_t n,
+                          size_t max) {
+
+  while (n < max && unwind_frame_ok(arch, sp) && !(pc & 3)) {
+
+    target_ulong insn, ra;
+    int32_t      frame_size = 0, ra_off = -1;
+    int          i;
+
+    for (i = 0; i < UNWIND_MIPS_SCAN && !frame_size; ++i) {
+
+      if (!unwind_read_word(arch, pc - 4 * i, &insn)) return n;
+
+      if ((insn & 0xffff0000) == 0xafbf0000)
+        ra_off = (int16_t)(insn & 0xffff);
+      else if ((insn & 0xffff8000) == 0x27bd8000)
+        frame_size = -(int16_t)(insn & 0xffff);
+      else if (insn == 0x03e00008)  // jr ra, end of the previous function
+        break;
+
+    }
+
+    if (!frame_size || ra_off < 0) break;
+    if (!unwind_read_word(arch, sp + ra_off, &ra) || !ra) break;
+
+    frames[n++] = ra;
+    pc = ra - 8;  // back to the jal
+    sp += frame_size;
+
+  }
+
+  return n;
+
+}
+
+static __thread target_ulong report_frames[MAX_CONTEXT_FRAMES];
+
+void asan_giovese_unwind_context(struct call_context* ctx, target_ulong pc,
+                                 target_ulong bp, target_ulong sp) {
+
+  const struct unwind_arch* arch = &unwind_archs[unwind_arch_id];
+  target_ulong              frames[MAX_CONTEXT_FRAMES];
+  size_t                    n;
+
+  frames[0] = pc;
+  if (unwind_arch_id == ASAN_ARCH_MIPS || unwind_arch_id == ASAN_ARCH_MIPSEL)
+    n = unwind_mips(arch, pc, sp, frames, 1, MAX_CONTEXT_FRAMES);
+  else
+    n = unwind_fp(arch, bp, frames, 1, MAX_CONTEXT_FRAMES);
+
+  // the context of a report is dropped when the report ends, keep it in a
+  // per-thread buffer instead of the host heap
+  if (report_active)
+    ctx->addresses = report_frames;
+  else
+    ctx->addresses = malloc(n * sizeof(target_ulong));
+  if (!ctx->addresses) n = 0;
+  memcpy(ctx->addresses, frames, n * sizeof(target_ulong));
+  ctx->size = n;
+  ctx->tid = current_tid();
+
+}
+
+// ------------------------------------------------------------------------- //
+// Sampling
+// ------------------------------------------------------------------------- //
+
+#define SAMPLING_SITES 4096
+#define SAMPLING_PROBES 16  // a miss means the table is full
+#define SAMPLING_SIZE_CLASSES 64
+
+struct sampling_site {
+
+  target_ulong pc;
+  uint32_t     count;
+
+};
+
+static uint32_t             sampling_rate;
+static uint32_t             sampling_first_k;
+static uint32_t             sampling_class_rate[SAMPLING_SIZE_CLASSES];
+static struct sampling_site sampling_sites[SAMPLING_SITES];
+
+static __thread uint32_t sampling_countdown[SAMPLING_SIZE_CLASSES];
+
+void asan_giovese_set_alloc_sampling(uint32_t rate, uint32_t site_first_k) {
+
+  sampling_rate = rate;
+  sampling_first_k = site_first_k;
+
+}
+
+static int sampling_size_class(size_t size) {
+
+  return size ? 63 - __builtin_clzll((uint64_t)size) : 0;
+
+}
+
+void asan_giovese_set_size_class_sampling(size_t size, uint32_t rate) {
+
+  sampling_class_rate[sampling_size_class(size)] = rate;
+
+}
+
+// returns the number of allocations seen at pc, saturates when the probed
+// entries are taken so that new sites fall back to the rate
+static uint32_t sampling_site_hit(target_ulong pc) {
+
+  uint32_t h = (uint32_t)(((uint64_t)pc * 0x9E3779B97F4A7C15ULL) >> 40);
+  uint32_t i;
+
+  for (i = 0; i < SAMPLING_PROBES; ++i) {
+
+    struct sampling_site* site = &sampling_sites[(h + i) % SAMPLING_SITES];
+    target_ulong          cur = __atomic_load_n(&site->pc, __ATOMIC_ACQUIRE);
+
+    if (cur == 0 &&
+        __atomic_compare_exchange_n(&site->pc, &cur, pc, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+      cur = pc;
+
+    if (cur == pc)
+      return __atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED);
+
+  }
+
+  return UINT32_MAX;
+
+}
+
+static int sampling_take_stack(target_ulong pc, size_t size) {
+
+  if (sampling_first_k && sampling_site_hit(pc) < sampling_first_k) return 1;
+
+  int      c = sampling_size_class(size);
+  uint32_t rate = sampling_class_rate[c];
+  if (!rate) rate = sampling_rate;
+  if (rate <= 1) return 1;
+
+  if (++sampling_countdown[c] < rate) return 0;
+  sampling_countdown[c] = 0;
+  return 1;
+
+}
+
+void asan_giovese_alloc_context(struct call_context* ctx, target_ulong pc,
+                                size_t size) {
+
+  if (sampling_take_stack(pc, size)) {
+
+    asan_giovese_populate_context(ctx, pc);
+    return;
+
+  }
+
+  ctx->addresses = malloc(sizeof(target_ulong));
+  ctx->addresses[0] = pc;
+  ctx->size = 1;
+  ctx->tid = current_tid();
+  ctx->flags |= ASAN_CTX_SAMPLED;
+
+}
+
+// ------------------------------------------------------------------------- //
+// Counters
+// ------------------------------------------------------------------------- //
+
+// Each thread counts in a shard that only it writes, with plain loads and
+// stores, asan_giovese_get_stats sums the shards. When a thread exits its
+// shard is folded into stats_retired and kept for the next thread. The checks
+// are counted only when ASAN_GIOVESE_STATS is defined, the check functions
+// stay free of it otherwise.
+
+struct stats_shard {
+
+  struct stats_shard* next;
+  struct stats_shard* next_free;
+  uint64_t            checks[2][ASAN_STATS_CHECK_SIZES][2];
+  uint64_t            poisoned_bytes;
+  uint64_t            unpoisoned_bytes;
+  uint64_t            reports[ASAN_STATS_ERRORS];
+
+};
+
+enum {
+
+  STATS_CHECK_1,
+  STATS_CHECK_2,
+  STATS_CHECK_4,
+  STATS_CHECK_8,
+  STATS_CHECK_N,
+
+};
+
+static struct stats_shard* stats_shards;
+static struct stats_shard  stats_lost;  // counts of threads without a shard
+
+// the shards of the exited threads, folded and free for reuse
+static struct stats_shard  stats_retired;
+static struct stats_shard* stats_shards_free;
+static pthread_mutex_t     stats_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t       stats_shard_key;
+static pthread_once_t      stats_shard_once = PTHREAD_ONCE_INIT;
+
+static __thread struct stats_shard* stats_local;
+
+// add the counters of src to dst
+static void stats_fold(struct stats_shard* dst, struct stats_shard* src) {
+
+  size_t i, j, k;
+
+  for (i = 0; i < 2; ++i)
+    for (j = 0; j < ASAN_STATS_CHECK_SIZES; ++j)
+      for (k = 0; k < 2; ++k)
+        dst->checks[i][j][k] +=
+            __atomic_load_n(&src->checks[i][j][k], __ATOMIC_RELAXED);
+
+  dst->poisoned_bytes +=
+      __atomic_load_n(&src->poisoned_bytes, __ATOMIC_RELAXED);
+  dst->unpoisoned_bytes +=
+      __atomic_load_n(&src->unpoisoned_bytes, __ATOMIC_RELAXED);
+  for (i = 0; i < ASAN_STATS_ERRORS; ++i)
+    dst->reports[i] += __atomic_load_n(&src->reports[i], __ATOMIC_RELAXED);
+
+}
+
+static void stats_shard_exit(void* arg) {
+
+  struct stats_shard* shard = arg;
+
+  pthread_mutex_lock(&stats_shards_lock);
+
+  stats_fold(&stats_retired, shard);
+  memset(shard->checks, 0,
+         sizeof(struct stats_shard) - offsetof(struct stats_shard, checks));
+  shard->next_free = stats_shards_free;
+  stats_shards_free = shard;
+
+  pthread_mutex_unlock(&stats_shards_lock);
+  stats_local = NULL;
+
+}
+
+static void stats_shard_key_init(void) {
+
+  pthread_key_create(&stats_shard_key, stats_shard_exit);
+
+}
+
+static struct stats_shard* stats_shard_new(void) {
+
+  struct stats_shard* shard = NULL;
+
+  pthread_once(&stats_shard_once, stats_shard_key_init);
+
+  // a report from a signal handler may get here, never wait for the lock
+  if (!pthread_mutex_trylock(&stats_shards_lock)) {
+
+    if ((shard = stats_shards_free)) stats_shards_free = shard->next_free;
+    pthread_mutex_unlock(&stats_shards_lock);
+
+  }
+
+  if (!shard) {
+
+    shard = mmap(NULL, sizeof(struct stats_shard), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (shard == MAP_FAILED) return &stats_lost;
+
+    shard->next = __atomic_load_n(&stats_shards, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&stats_shards, &shard->next, shard, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+
+  }
+
+  pthread_setspecific(stats_shard_key, shard);
+  stats_local = shard;
+  return shard;
+
+}
+
+static inline struct stats_shard* stats_get(void) {
+
+  struct stats_shard* shard = stats_local;
+  if (__builtin_expect(!shard, 0)) shard = stats_shard_new();
+  return shard;
+
+}
+
+// only the owner thread writes a shard, a reader may load it meanwhile
+static inline void stats_add(uint64_t* counter, uint64_t v) {
+
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + v,
+                   __ATOMIC_RELAXED);
+
+}
+
+#ifdef ASAN_GIOVESE_STATS
+#define STATS_CHECK(type, size, r) \
+  stats_add(&stats_get()->checks[type][size][(r) != 0], 1)
+#else
+#define STATS_CHECK(type, size, r)
+#endif
+
+static void stats_report(int error) {
+
+  stats_add(&stats_get()->reports[error], 1);
+
+}
+
+// ------------------------------------------------------------------------- //
+// Alloc
+// ------------------------------------------------------------------------- //
+
+// Writers hold alloc_lock. The chunk_info returned by a search stays valid
+// until the chunk is overlapped by a new insert or evicted (from the
+// quarantine or the history), reports hold the lock while they use it.
+// The chunks of the guest heap are not in the tree, their node is kept with
+// their slot under a lock per stripe of spans (see Heap). The readers that
+// look at any chunk take every lock with alloc_lock_all.
+
+struct alloc_tree_node {
+
+  struct rb_node          rb;
+  struct chunk_info       ckinfo;
+  target_ulong            __subtree_last;
+  struct alloc_tree_node* quarantine_next;
+  struct alloc_tree_node* history_prev;
+  struct alloc_tree_node* history_next;
+  size_t                  meta_bytes;
+  uint32_t                flags;
+  uint32_t                site;  // heap profile site + 1, 0 if not profiled
+
+};
+
+#define ALLOC_QUARANTINED 1  // in a quarantine queue
+#define ALLOC_DETACHED 2     // removed from the tree while quarantined
+#define ALLOC_HISTORY 4      // freed, in the history FIFO
+#define ALLOC_HEAP 8         // in the slot table of the heap, not in the tree
+
+#define START(node) ((node)->ckinfo.start)
+#define LAST(node) ((node)->ckinfo.end)
+
+INTERVAL_TREE_DEFINE(struct alloc_tree_node, rb, target_ulong, __subtree_last,
+                     START, LAST, static, alloc_tree)
+
+static struct rb_root  root = RB_ROOT;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t        alloc_tree_nodes;  // for the stats
+
+// the guest heap, defined below
+static int heap_owns(target_ulong addr);
+static int heap_recycle(target_ulong start, target_ulong end);
+static int heap_guard_free(target_ulong start, target_ulong end);
+static struct alloc_tree_node* heap_chunk_node(target_ulong addr);
+static struct alloc_tree_node* heap_mark_free(target_ulong         start,
+                                              struct call_context* free_ctx);
+static int                     alloc_lock_all(void);
+static void                    alloc_unlock_all(void);
+
+// alloc_lock_all must be held
+static struct chunk_info* alloc_search(target_ulong query) {
+
+  struct alloc_tree_node* node;
+
+  if (heap_owns(query)) {
+
+    node = heap_chunk_node(query);
+    if (node && (query < node->ckinfo.start || query > node->ckinfo.end))
+      node = NULL;
+
+  } else {
+
+    node = alloc_tree_iter_first(&root, query, query);
+
+  }
+
+  if (node) return &node->ckinfo;
+  return NULL;
+
+}
+
+struct chunk_info* asan_giovese_alloc_search(target_ulong query) {
+
+  struct chunk_info* ckinfo;
+
+  if (!alloc_lock_all()) return NULL;
+  ckinfo = alloc_search(query);
+  alloc_unlock_all();
+  return ckinfo;
+
+}
+
+// Metadata budget. Every node accounts for itself and its contexts while it
+// is in the tree, the dead nodes waiting to be freed are not counted. Freed
+// chunks that are not quarantined stay in the tree only as history for the
+// reports, they are linked in freed order and the oldest are evicted first
+// when the metadata goes over the budget. Live and quarantined chunks are
+// never evicted.
+
+static size_t                  alloc_meta_budget;
+static size_t                  alloc_meta_bytes;
+static struct alloc_tree_node* alloc_history_head;
+static struct alloc_tree_node* alloc_history_tail;
+static uint64_t                alloc_history_evicted;
+static uint64_t                alloc_history_evicted_bytes;
+
+static size_t context_bytes(struct call_context* ctx) {
+
+  if (!ctx) return 0;
+  if (ctx->flags & ASAN_CTX_PACKED)
+    return sizeof(struct call_context) + ctx->packed_size;
+  return sizeof(struct call_context) + ctx->size * sizeof(target_ulong);
+
+}
+
+// the heap nodes are bounded by the slots and stay out of the budget
+static void alloc_meta_add(struct alloc_tree_node* node, size_t bytes) {
+
+  node->meta_bytes += bytes;
+  if (!(node->flags & ALLOC_HEAP))
+    __atomic_add_fetch(&alloc_meta_bytes, bytes, __ATOMIC_RELAXED);
+
+}
+
+// alloc_lock must be held to change the tree
+static void alloc_tree_link(struct alloc_tree_node* node) {
+
+  alloc_tree_insert(node, &root);
+  stats_add(&alloc_tree_nodes, 1);
+
+}
+
+// the metadata of a node out of the tree is not counted, even if the node is
+// freed later
+static void alloc_tree_unlink(struct alloc_tree_node* node) {
+
+  alloc_tree_remove(node, &root);
+  stats_add(&alloc_tree_nodes, -(uint64_t)1);
+  __atomic_sub_fetch(&alloc_meta_bytes, node->meta_bytes, __ATOMIC_RELAXED);
+
+}
+
+static void alloc_node_free(struct alloc_tree_node* node) {
+
+  free_context(node->ckinfo.alloc_ctx);
+  free_context(node->ckinfo.free_ctx);
+  free(node);
+
+}
+
+// the heap profile, defined below
+static uint32_t profile_alloc(struct call_context* ctx, size_t size);
+static void     profile_free(uint32_t site, size_t size);
+
+// alloc_lock must be held by the history functions
+
+static void alloc_history_push(struct alloc_tree_node* node) {
+
+  node->flags |= ALLOC_HISTORY;
+  node->history_next = NULL;
+  node->history_prev = alloc_history_tail;
+  if (alloc_history_tail)
+    alloc_history_tail->history_next = node;
+  else
+    alloc_history_head = node;
+  alloc_history_tail = node;
+
+}
+
+static void alloc_history_unlink(struct alloc_tree_node* node) {
+
+  if (!(node->flags & ALLOC_HISTORY)) return;
+  node->flags &= ~ALLOC_HISTORY;
+
+  if (node->history_prev)
+    node->history_prev->history_next = node->history_next;
+  else
+    alloc_history_head = node->history_next;
+  if (node->history_next)
+    node->history_next->history_prev = node->history_prev;
+  else
+    alloc_history_tail = node->history_prev;
+
+}
+
+// take the oldest history out of the tree until the metadata fits the
+// budget, the nodes are chained on dead through quarantine_next
+static void alloc_history_trim(struct alloc_tree_node** dead) {
+
+  size_t   evicted_bytes = 0;
+  uint64_t evicted = 0;
+
+  if (!alloc_meta_budget) return;
+
+  while (alloc_history_head &&
+         __atomic_load_n(&alloc_meta_bytes, __ATOMIC_RELAXED) >
+             alloc_meta_budget) {
+
+    struct alloc_tree_node* node = alloc_history_head;
+    alloc_history_unlink(node);
+    alloc_tree_unlink(node);
+    node->quarantine_next = *dead;
+    *dead = node;
+    evicted_bytes += node->meta_bytes;
+    ++evicted;
+
+  }
+
+  if (!evicted) return;
+  __atomic_add_fetch(&alloc_history_evicted, evicted, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&alloc_history_evicted_bytes, evicted_bytes,
+                     __ATOMIC_RELAXED);
+
+}
+
+static void alloc_free_list(struct alloc_tree_node* dead) {
+
+  while (dead) {
+
+    struct alloc_tree_node* n = dead->quarantine_next;
+    alloc_node_free(dead);
+    dead = n;
+
+  }
+
+}
+
+void asan_giovese_set_metadata_budget(size_t bytes) {
+
+  struct alloc_tree_node* dead = NULL;
+
+  pthread_mutex_lock(&alloc_lock);
+  alloc_meta_budget = bytes;
+  alloc_history_trim(&dead);
+  pthread_mutex_unlock(&alloc_lock);
+
+  alloc_free_list(dead);
+
+}
+
+void asan_giovese_metadata_stats(size_t* bytes, uint64_t* evicted,
+                                 uint64_t* evicted_bytes) {
+
+  if (bytes) *bytes = __atomic_load_n(&alloc_meta_bytes, __ATOMIC_RELAXED);
+  if (evicted)
+    *evicted = __atomic_load_n(&alloc_history_evicted, __ATOMIC_RELAXED);
+  if (evicted_bytes)
+    *evicted_bytes =
+        __atomic_load_n(&alloc_history_evicted_bytes, __ATOMIC_RELAXED);
+
+}
+
+static struct alloc_tree_node* alloc_node_new(target_ulong start,
+                                              target_ulong end,
+                                              struct call_context* alloc_ctx,
+                                              uint32_t flags) {
+
+  struct alloc_tree_node* node = calloc(sizeof(struct alloc_tree_node), 1);
+
+  node->flags = flags;
+  node->ckinfo.start = start;
+  node->ckinfo.end = end;
+  node->ckinfo.alloc_ctx = alloc_ctx;
+  node->site = profile_alloc(alloc_ctx, end - start);
+  asan_giovese_pack_context(alloc_ctx);
+  alloc_meta_add(node,
+                 sizeof(struct alloc_tree_node) + context_bytes(alloc_ctx));
+  return node;
+
+}
+
+void asan_giovese_alloc_insert(target_ulong start, target_ulong end,
+                               struct call_context* alloc_ctx) {
+
+  struct alloc_tree_node* node = alloc_node_new(start, end, alloc_ctx, 0);
+  struct alloc_tree_node* dead = NULL;
+
+  pthread_mutex_lock(&alloc_lock);
+
+  struct alloc_tree_node* prev_node = alloc_tree_iter_first(&root, start, end);
+  while (prev_node) {
+
+    struct alloc_tree_node* n = alloc_tree_iter_next(prev_node, start, end);
+    alloc_tree_unlink(prev_node);
+    alloc_history_unlink(prev_node);
+    if (!prev_node->ckinfo.free_ctx)
+      profile_free(prev_node->site,
+                   prev_node->ckinfo.end - prev_node->ckinfo.start);
+
+    // a quarantined node is released when it leaves the queue
+    if (prev_node->flags & ALLOC_QUARANTINED) {
+
+      prev_node->flags |= ALLOC_DETACHED;
+
+    } else {
+
+      prev_node->quarantine_next = dead;
+      dead = prev_node;
+
+    }
+
+    prev_node = n;
+
+  }
+
+  alloc_tree_link(node);
+  alloc_history_trim(&dead);
+  pthread_mutex_unlock(&alloc_lock);
+
+  alloc_free_list(dead);
+
+}
+
+// the chunk containing fault_addr or addr, or the closest one within a redzone,
+// alloc_lock_all must be held
+static struct chunk_info* alloc_search_near(target_ulong addr,
+                                            target_ulong fault_addr) {
+
+  struct chunk_info* ckinfo = alloc_search(fault_addr);
+  if (!ckinfo && addr != fault_addr) ckinfo = alloc_search(addr);
+
+  int i = 0;
+  while (!ckinfo && i < DEFAULT_REDZONE_SIZE)
+    ckinfo = alloc_search(fault_addr - (i++));
+
+  i = 0;
+  while (!ckinfo && i < DEFAULT_REDZONE_SIZE)
+    ckinfo = alloc_search(fault_addr + (i++));
+
+  // in the heap the whole slot, or the guard pages of a huge chunk, are the
+  // redzones of the chunk
+  if (!ckinfo) {
+
+    struct alloc_tree_node* node = heap_chunk_node(fault_addr);
+    if (node) ckinfo = &node->ckinfo;
+
+  }
+
+  return ckinfo;
+
+}
+
+// ------------------------------------------------------------------------- //
+// Quarantine
+// ------------------------------------------------------------------------- //
+
+// Freed chunks wait in a FIFO bounded in bytes before their memory is handed
+// back to the embedder. Each thread queues its frees in a batch, an array of
+// nodes, and appends the whole batch to the global queue when it is full, so
+// quarantine_lock is taken once per batch. Eviction pops whole batches by
+// their byte count and never walks the nodes under the lock, the queue keeps
+// between max_bytes minus a batch and max_bytes. The nodes of the evicted
+// batches are read in array order with prefetching, the ones still in the
+// tree are removed in one pass under alloc_lock, then their contexts are freed
+// and recycle is called with no lock held. The heap chunks keep their node in
+// their slot as history until the slot is reused.
+
+#define QUARANTINE_CACHE_BYTES (256 << 10)
+#define QUARANTINE_CACHE_CHUNKS 256
+#define QUARANTINE_PREFETCH 8  // nodes read ahead on release
+
+struct quarantine_batch {
+
+  struct quarantine_batch* next;
+  size_t                   bytes;
+  uint32_t                 count;
+  uint32_t                 tree;  // nodes that were in the alloc tree
+  struct alloc_tree_node*  nodes[QUARANTINE_CACHE_CHUNKS];
+
+};
+
+struct quarantine_queue {
+
+  struct quarantine_batch* head;
+  struct quarantine_batch* tail;
+  size_t                   bytes;
+  size_t                   count;
+
+};
+
+static size_t                  quarantine_max_bytes;
+static size_t                  quarantine_cache_bytes = QUARANTINE_CACHE_BYTES;
+static void                    (*quarantine_recycle)(target_ulong start,
+                                                     target_ulong end);
+static struct quarantine_queue quarantine_global;
+static pthread_mutex_t         quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t                quarantine_evicted, quarantine_evicted_bytes;
+
+static pthread_key_t                    quarantine_key;
+static pthread_once_t                   quarantine_once = PTHREAD_ONCE_INIT;
+static __thread struct quarantine_batch* quarantine_cache;
+
+// the memory of a freed chunk can be reused
+static void chunk_recycle(target_ulong start, target_ulong end) {
+
+  if (!heap_recycle(start, end) && quarantine_recycle)
+    quarantine_recycle(start, end);
+
+}
+
+void asan_giovese_set_quarantine(size_t max_bytes, size_t thread_bytes,
+                                 void (*recycle)(target_ulong start,
+                                                 target_ulong end)) {
+
+  quarantine_max_bytes = max_bytes;
+  quarantine_cache_bytes = thread_bytes ? thread_bytes : QUARANTINE_CACHE_BYTES;
+  if (quarantine_cache_bytes > max_bytes) quarantine_cache_bytes = max_bytes;
+  quarantine_recycle = recycle;
+
+}
+
+static size_t alloc_node_bytes(struct alloc_tree_node* node) {
+
+  return node->ckinfo.end - node->ckinfo.start;
+
+}
+
+// release count nodes taken out of the quarantine, tree if some may still be
+// in the alloc tree
+static void quarantine_release(struct alloc_tree_node** nodes, uint32_t count,
+                               int tree) {
+
+  uint64_t bytes = 0;
+  uint32_t i;
+
+  if (tree) {
+
+    pthread_mutex_lock(&alloc_lock);
+    for (i = 0; i < count; ++i)
+      if (!(nodes[i]->flags & (ALLOC_DETACHED | ALLOC_HEAP)))
+        alloc_tree_unlink(nodes[i]);
+    pthread_mutex_unlock(&alloc_lock);
+
+  }
+
+  for (i = 0; i < count; ++i) {
+
+    struct alloc_tree_node* node = nodes[i];
+    if (i + QUARANTINE_PREFETCH < count)
+      __builtin_prefetch(nodes[i + QUARANTINE_PREFETCH]);
+    bytes += alloc_node_bytes(node);
+
+    // the slot owns a heap node, it may be reused as soon as it is recycled
+    if (node->flags & ALLOC_HEAP) {
+
+      heap_recycle(node->ckinfo.start, node->ckinfo.end);
+      continue;
+
+    }
+
+    if (!(node->flags & ALLOC_DETACHED))
+      chunk_recycle(node->ckinfo.start, node->ckinfo.end);
+    alloc_node_free(node);
+
+  }
+
+  __atomic_add_fetch(&quarantine_evicted, count, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&quarantine_evicted_bytes, bytes, __ATOMIC_RELAXED);
+
+}
+
+// move the batch of the thread to the global queue, then evict the oldest
+// batches over the limit. One evicted batch becomes the next of the thread.
+static void quarantine_drain(void) {
+
+  struct quarantine_batch* c = quarantine_cache;
+  struct quarantine_queue* g = &quarantine_global;
+  struct quarantine_batch* evicted = NULL;
+  struct quarantine_batch* b;
+
+  quarantine_cache = NULL;
+  pthread_mutex_lock(&quarantine_lock);
+
+  if (c && c->count) {
+
+    c->next = NULL;
+    if (g->tail)
+      g->tail->next = c;
+    else
+      g->head = c;
+    g->tail = c;
+    g->bytes += c->bytes;
+    g->count += c->count;
+    c = NULL;
+
+  }
+
+  // the evicted batches come out oldest first, pushed here in reverse order
+  while (g->head && g->bytes > quarantine_max_bytes) {
+
+    b = g->head;
+    g->head = b->next;
+    g->bytes -= b->bytes;
+    g->count -= b->count;
+    b->next = evicted;
+    evicted = b;
+
+  }
+
+  if (!g->head) g->tail = NULL;
+
+  pthread_mutex_unlock(&quarantine_lock);
+
+  while ((b = evicted)) {
+
+    evicted = b->next;
+    quarantine_release(b->nodes, b->count, b->tree);
+    if (!c) {
+
+      c = b;
+      continue;
+
+    }
+
+    free(b);
+
+  }
+
+  if (c) {
+
+    c->bytes = 0;
+    c->count = 0;
+    c->tree = 0;
+    quarantine_cache = c;
+
+  }
+
+}
+
+// the batch of an exiting thread goes to the global queue
+static void quarantine_exit(void* arg) {
+
+  (void)arg;
+  quarantine_drain();
+  free(quarantine_cache);
+  quarantine_cache = NULL;
+
+}
+
+static void quarantine_key_init(void) {
+
+  pthread_key_create(&quarantine_key, quarantine_exit);
+
+}
+
+// queue a freed node in the batch of the thread
+static void quarantine_push(struct alloc_tree_node* node) {
+
+  struct quarantine_batch* c = quarantine_cache;
+
+  if (!c) {
+
+    if (!(c = quarantine_cache = calloc(1, sizeof(*c)))) {
+
+      // no memory for a batch, the chunk skips the quarantine
+      quarantine_release(&node, 1, !(node->flags & ALLOC_HEAP));
+      return;
+
+    }
+
+    pthread_once(&quarantine_once, quarantine_key_init);
+    pthread_setspecific(quarantine_key, c);
+
+  }
+
+  c->nodes[c->count++] = node;
+  c->bytes += alloc_node_bytes(node);
+  c->tree += !(node->flags & ALLOC_HEAP);
+
+  if (c->bytes >= quarantine_cache_bytes ||
+      c->count >= QUARANTINE_CACHE_CHUNKS)
+    quarantine_drain();
+
+}
+
+void asan_giovese_quarantine_flush(void) {
+
+  quarantine_drain();
+
+}
+
+void asan_giovese_quarantine_stats(size_t* bytes, size_t* chunks,
+                                   uint64_t* evicted, uint64_t* evicted_bytes) {
+
+  pthread_mutex_lock(&quarantine_lock);
+  if (bytes) *bytes = quarantine_global.bytes;
+  if (chunks) *chunks = quarantine_global.count;
+  pthread_mutex_unlock(&quarantine_lock);
+
+  if (evicted)
+    *evicted = __atomic_load_n(&quarantine_evicted, __ATOMIC_RELAXED);
+  if (evicted_bytes)
+    *evicted_bytes =
+        __atomic_load_n(&quarantine_evicted_bytes, __ATOMIC_RELAXED);
+
+}
+
+int asan_giovese_alloc_free(target_ulong start, struct call_context* free_ctx) {
+
+  struct alloc_tree_node* node;
+  struct alloc_tree_node* dead = NULL;
+  target_ulong            end;
+  uint32_t                site;
+
+  asan_giovese_pack_context(free_ctx);
+
+  if (heap_owns(start)) {
+
+    // only this thread can recycle the slot now, the node stays valid
+    if (!(node = heap_mark_free(start, free_ctx))) return 0;
+    end = node->ckinfo.end;
+    site = node->site;
+
+  } else {
+
+    pthread_mutex_lock(&alloc_lock);
+
+    node = alloc_tree_iter_first(&root, start, start);
+    if (!node || node->ckinfo.start != start || node->ckinfo.free_ctx) {
+
+      pthread_mutex_unlock(&alloc_lock);
+      return 0;
+
+    }
+
+    node->ckinfo.free_ctx = free_ctx;
+    alloc_meta_add(node, context_bytes(free_ctx));
+    end = node->ckinfo.end;
+    site = node->site;
+
+    if (quarantine_max_bytes) {
+
+      node->flags |= ALLOC_QUARANTINED;
+
+    } else {
+
+      alloc_history_push(node);
+      alloc_history_trim(&dead);
+
+    }
+
+    pthread_mutex_unlock(&alloc_lock);
+    alloc_free_list(dead);
+
+  }
+
+  profile_free(site, end - start);
+
+  // the partial granule at the end belongs to the chunk too
+  if (!heap_guard_free(start, end))
+    asan_giovese_poison_guest_region(start, (end - start + 7) & ~7,
+                                     ASAN_HEAP_FREED);
+
+  if (!quarantine_max_bytes) {
+
+    // no quarantine, the freed chunk stays as history in the tree or its slot
+    chunk_recycle(start, end);
+    return 1;
+
+  }
+
+  quarantine_push(node);
+  return 1;
+
+}
+
+// ------------------------------------------------------------------------- //
+// Heap
+// ------------------------------------------------------------------------- //
+
+// Guest allocator over an arena given by the embedder. The arena is cut in
+// spans, a span serves the slots of one size class or is part of a large
+// chunk. Each thread keeps a few free slots per class and exchanges them in
+// batches with the central stack of the class. Chunks are freed through
+// asan_giovese_alloc_free, so they go through the quarantine and their slot
+// comes back only when they are evicted.
+//
+// A slot is a left redzone followed by the chunk, the redzone grows with the
+// size like in ASan and the right redzone is the rest of the slot plus the
+// left redzone of the next slot. The shadow of a slot is rewritten with one
+// memset per part when it is allocated, new spans are poisoned in one go.
+//
+// In guard page mode huge chunks get a run of spans of their own, the chunk
+// is right aligned on the last page before a PROT_NONE page and all the run
+// before its first page is PROT_NONE too. Only the shadow of the two partial
+// pages at the ends of the chunk is written, the interior stays 0 and a free
+// protects the chunk instead of poisoning it. Overflows and uses after free
+// become faults, asan_giovese_deadly_signal attributes them to the chunk.
+//
+// The chunks are not in the alloc tree. The node of a chunk is kept in
+// heap_meta at the index of the start of its slot, outside of guest memory,
+// and stays there as history after the chunk is freed until the slot is
+// reused. heap_meta is guarded by a lock per stripe of spans, so the threads
+// that allocate and free in different spans do not share a lock. This
+// metadata is bounded by the number of slots and is not trimmed by the budget
+// of asan_giovese_set_metadata_budget.
+
+#define HEAP_SPAN_SHIFT 18
+#define HEAP_SPAN_SIZE ((target_ulong)1 << HEAP_SPAN_SHIFT)
+#define HEAP_CLASSES 49  // 16 to 64K, 0 is unused
+#define HEAP_MAX_CLASS_SIZE (64 << 10)
+#define HEAP_CACHE_SLOTS 32
+#define HEAP_SPAN_FREE 0
+#define HEAP_SPAN_GUARD 0xfd  // first span of a guard page mode chunk
+#define HEAP_SPAN_LARGE 0xfe
+#define HEAP_SPAN_LARGE_TAIL 0xff
+
+#define HEAP_SPAN_DIRTY 1      // the shadow is not all 0
+#define HEAP_SPAN_PROTECTED 2  // some pages are PROT_NONE
+
+#define HEAP_META_SHIFT 4  // one entry per 16 bytes, the smallest slot
+#define HEAP_META_LOCKS 64
+
+struct heap_central {
+
+  pthread_mutex_t lock;
+  target_ulong*   slots;  // free slots
+  size_t          count;
+  size_t          cap;
+  target_ulong    bump;  // next slot of the span being carved
+  target_ulong    bump_end;
+
+};
+
+struct heap_cache {
+
+  int          keyed;  // the exit destructor is set for this thread
+  uint32_t     count[HEAP_CLASSES];
+  target_ulong slots[HEAP_CLASSES][HEAP_CACHE_SLOTS];
+
+};
+
+static target_ulong        heap_base, heap_end;
+static size_t              heap_spans;
+static size_t              heap_spans_top;    // spans used at least once
+static size_t              heap_spans_freed;  // free spans below top
+static uint8_t*            heap_span_class;
+static uint8_t*            heap_span_flags;
+static size_t              heap_page_size;
+static size_t              heap_guard_size;  // 0 if guard pages are disabled
+static pthread_mutex_t     heap_span_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t            heap_class_size[HEAP_CLASSES];
+static struct heap_central heap_central[HEAP_CLASSES];
+
+static pthread_key_t              heap_cache_key;
+static pthread_once_t             heap_cache_once = PTHREAD_ONCE_INIT;
+static __thread struct heap_cache heap_cache;
+
+static struct alloc_tree_node** heap_meta;
+static pthread_mutex_t          heap_meta_locks[HEAP_META_LOCKS] = {
+
+    [0 ... HEAP_META_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+
+};
+
+
+static int heap_size_class(size_t n) {
+
+  if (n <= 256) return n ? (n + 15) >> 4 : 1;
+
+  int    l = 63 - __builtin_clzll((uint64_t)(n - 1));
+  size_t step = (size_t)1 << (l - 2);
+  return 17 + (l - 8) * 4 + (int)((n + step - 1) / step) - 5;
+
+}
+
+// log scale like ASan, from 16 to 2048 bytes
+static size_t heap_redzone(size_t size) {
+
+  int l = size <= 64 - 16             ? 0
+          : size <= 128 - 32          ? 1
+          : size <= 512 - 64          ? 2
+          : size <= 4096 - 128        ? 3
+          : size <= (1 << 14) - 256   ? 4
+          : size <= (1 << 15) - 512   ? 5
+          : size <= (1 << 16) - 1024  ? 6
+                                      : 7;
+  return (size_t)16 << l;
+
+}
+
+static void heap_shadow_fill(target_ulong addr, size_t n, uint8_t v) {
+
+  uintptr_t h = (uintptr_t)g2h(addr);
+  memset((uint8_t*)(h >> 3) + SHADOW_OFFSET, v, n >> 3);
+  stats_add(v ? &stats_get()->poisoned_bytes : &stats_get()->unpoisoned_bytes,
+            n);
+
+}
+
+// shadow of a new chunk at user in the slot [slot, slot_end)
+static void heap_shadow_chunk(target_ulong slot, target_ulong slot_end,
+                              target_ulong user, size_t size) {
+
+  target_ulong body = user + (size & ~(size_t)7);
+
+  heap_shadow_fill(slot, user - slot, ASAN_HEAP_LEFT_RZ);
+  heap_shadow_fill(user, body - user, ASAN_VALID);
+  if (size & 7) {
+
+    uintptr_t h = (uintptr_t)g2h(body);
+    *((uint8_t*)(h >> 3) + SHADOW_OFFSET) = size & 7;
+    body += 8;
+
+  }
+
+  heap_shadow_fill(body, slot_end - body, ASAN_HEAP_RIGHT_RZ);
+
+}
+
+int asan_giovese_heap_init(target_ulong base, size_t size) {
+
+  target_ulong aligned = (base + HEAP_SPAN_SIZE - 1) & ~(HEAP_SPAN_SIZE - 1);
+  int          c;
+
+  if (heap_span_class || size < aligned - base + HEAP_SPAN_SIZE) return 0;
+  size -= aligned - base;
+  base = aligned;
+
+  heap_spans = size >> HEAP_SPAN_SHIFT;
+  heap_span_class = calloc(heap_spans, 1);
+  heap_span_flags = calloc(heap_spans, 1);
+  heap_meta = mmap(NULL,
+                   (heap_spans << (HEAP_SPAN_SHIFT - HEAP_META_SHIFT)) *
+                       sizeof(struct alloc_tree_node*),
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+  if (!heap_span_class || !heap_span_flags || heap_meta == MAP_FAILED) {
+
+    free(heap_span_class);
+    free(heap_span_flags);
+    heap_span_class = NULL;
+    heap_meta = NULL;
+    return 0;
+
+  }
+
+  heap_page_size = sysconf(_SC_PAGESIZE);
+  heap_base = base;
+  heap_end = base + heap_spans * HEAP_SPAN_SIZE;
+
+  for (c = 1; c < HEAP_CLASSES; ++c) {
+
+    if (c <= 16) {
+
+      heap_class_size[c] = c * 16;
+
+    } else {
+
+      int l = 8 + (c - 17) / 4;
+      heap_class_size[c] = (5 + (c - 17) % 4) << (l - 2);
+
+    }
+
+    pthread_mutex_init(&heap_central[c].lock, NULL);
+
+  }
+
+  return 1;
+
+}
+
+void asan_giovese_set_heap_guard_pages(size_t min_size) {
+
+  heap_guard_size = min_size;
+
+}
+
+// give the spans [i, i + n) to cls, accessible and with the shadow it expects,
+// 0 if they stay protected
+static int heap_span_prepare(size_t i, size_t n, uint8_t cls) {
+
+  target_ulong start = heap_base + ((target_ulong)i << HEAP_SPAN_SHIFT);
+  uint8_t      flags = 0;
+  size_t       j;
+
+  for (j = i; j < i + n; ++j)
+    flags |= heap_span_flags[j];
+
+  if ((flags & HEAP_SPAN_PROTECTED) &&
+      mprotect((void*)g2h(start), n * HEAP_SPAN_SIZE, PROT_READ | PROT_WRITE))
+    return 0;
+
+  if (cls == HEAP_SPAN_GUARD) {
+
+    if (flags & HEAP_SPAN_DIRTY)
+      heap_shadow_fill(start, n * HEAP_SPAN_SIZE, ASAN_VALID);
+    memset(&heap_span_flags[i], HEAP_SPAN_PROTECTED, n);
+
+  } else {
+
+    memset(&heap_span_flags[i], HEAP_SPAN_DIRTY, n);
+
+  }
+
+  memset(&heap_span_class[i],
+         cls < HEAP_SPAN_GUARD ? cls : HEAP_SPAN_LARGE_TAIL, n);
+  heap_span_class[i] = cls;
+  return 1;
+
+}
+
+// a run of n free spans, the first span or 0 if the arena is full,
+// heap_span_lock must be held
+static target_ulong heap_span_alloc(size_t n, uint8_t cls) {
+
+  size_t i, run = 0;
+
+  if (heap_spans_freed >= n) {
+
+    for (i = 0; i < heap_spans_top; ++i) {
+
+      run = heap_span_class[i] == HEAP_SPAN_FREE ? run + 1 : 0;
+      if (run == n) break;
+
+    }
+
+    if (run == n && heap_span_prepare(i - (n - 1), n, cls)) {
+
+      i -= n - 1;
+      heap_spans_freed -= n;
+      return heap_base + ((target_ulong)i << HEAP_SPAN_SHIFT);
+
+    }
+
+  }
+
+  // the free run at the top can be extended
+  for (run = 0; run < heap_spans_top && run < n &&
+                heap_span_class[heap_spans_top - run - 1] == HEAP_SPAN_FREE;
+       ++run)
+    ;
+
+  if (heap_spans_top - run + n > heap_spans) return 0;
+  i = heap_spans_top - run;
+
+  // the spans past the top were never protected
+  if (!heap_span_prepare(i, n, cls)) {
+
+    if (!run || heap_spans_top + n > heap_spans) return 0;
+    run = 0;
+    i = heap_spans_top;
+    heap_span_prepare(i, n, cls);
+
+  }
+
+  heap_spans_freed -= run;
+  heap_spans_top = i + n;
+  return heap_base + ((target_ulong)i << HEAP_SPAN_SHIFT);
+
+}
+
+// move up to n free slots of class c to out
+static size_t heap_central_get(int c, target_ulong* out, size_t n) {
+
+  struct heap_central* hc = &heap_central[c];
+  size_t               got = 0;
+  target_ulong         span;
+
+  pthread_mutex_lock(&hc->lock);
+
+  while (got < n && hc->count)
+    out[got++] = hc->slots[--hc->count];
+
+  while (got < n) {
+
+    if (hc->bump + heap_class_size[c] > hc->bump_end) {
+
+      pthread_mutex_lock(&heap_span_lock);
+      span = heap_span_alloc(1, c);
+      pthread_mutex_unlock(&heap_span_lock);
+      if (!span) break;
+
+      heap_shadow_fill(span, HEAP_SPAN_SIZE, ASAN_HEAP_LEFT_RZ);
+      hc->bump = span;
+      // the tail of the span is the right redzone of its last slot
+      hc->bump_end = span + HEAP_SPAN_SIZE - 16;
+
+    }
+
+    out[got++] = hc->bump;
+    hc->bump += heap_class_size[c];
+
+  }
+
+  pthread_mutex_unlock(&hc->lock);
+  return got;
+
+}
+
+static void heap_central_put(int c, target_ulong* slots, size_t n) {
+
+  struct heap_central* hc = &heap_central[c];
+
+  pthread_mutex_lock(&hc->lock);
+
+  if (hc->count + n > hc->cap) {
+
+    size_t cap = hc->cap ? hc->cap * 2 : 256;
+    while (cap < hc->count + n)
+      cap *= 2;
+    hc->slots = realloc(hc->slots, cap * sizeof(target_ulong));
+    hc->cap = cap;
+
+  }
+
+  memcpy(&hc->slots[hc->count], slots, n * sizeof(target_ulong));
+  hc->count += n;
+
+  pthread_mutex_unlock(&hc->lock);
+
+}
+
+// the slots cached by an exiting thread go back to the central lists
+static void heap_cache_exit(void* arg) {
+
+  struct heap_cache* cache = arg;
+  int                c;
+
+  for (c = 1; c < HEAP_CLASSES; ++c) {
+
+    if (!cache->count[c]) continue;
+    heap_central_put(c, cache->slots[c], cache->count[c]);
+    cache->count[c] = 0;
+
+  }
+
+  cache->keyed = 0;
+
+}
+
+static void heap_cache_key_init(void) {
+
+  pthread_key_create(&heap_cache_key, heap_cache_exit);
+
+}
+
+static struct heap_cache* heap_cache_get(void) {
+
+  struct heap_cache* cache = &heap_cache;
+
+  if (__builtin_expect(!cache->keyed, 0)) {
+
+    pthread_once(&heap_cache_once, heap_cache_key_init);
+    pthread_setspecific(heap_cache_key, cache);
+    cache->keyed = 1;
+
+  }
+
+  return cache;
+
+}
+
+static target_ulong heap_slot_get(int c) {
+
+  struct heap_cache* cache = heap_cache_get();
+
+  if (!cache->count[c])
+    cache->count[c] =
+        heap_central_get(c, cache->slots[c], HEAP_CACHE_SLOTS / 2);
+  if (!cache->count[c]) return 0;
+  return cache->slots[c][--cache->count[c]];
+
+}
+
+static void heap_slot_put(int c, target_ulong slot) {
+
+  struct heap_cache* cache = heap_cache_get();
+
+  if (cache->count[c] == HEAP_CACHE_SLOTS) {
+
+    cache->count[c] -= HEAP_CACHE_SLOTS / 2;
+    heap_central_put(c, &cache->slots[c][cache->count[c]],
+                     HEAP_CACHE_SLOTS / 2);
+
+  }
+
+  cache->slots[c][cache->count[c]++] = slot;
+
+}
+
+static size_t heap_span_index(target_ulong addr) {
+
+  return (addr - heap_base) >> HEAP_SPAN_SHIFT;
+
+}
+
+// the slot that holds addr, with its class (HEAP_SPAN_LARGE or
+// HEAP_SPAN_GUARD for a run of spans) and end, 0 in a free span
+static target_ulong heap_slot_of(target_ulong addr, int* cls,
+                                 target_ulong* slot_end) {
+
+  size_t       i = heap_span_index(addr);
+  target_ulong span = heap_base + ((target_ulong)i << HEAP_SPAN_SHIFT);
+  int          c = heap_span_class[i];
+
+  if (c == HEAP_SPAN_FREE) {
+
+    *cls = c;
+    *slot_end = span + HEAP_SPAN_SIZE;
+    return 0;
+
+  }
+
+  if (c >= HEAP_SPAN_GUARD) {
+
+    size_t n = 1;
+    while (i && heap_span_class[i] == HEAP_SPAN_LARGE_TAIL)
+      --i;
+    while (i + n < heap_spans && heap_span_class[i + n] == HEAP_SPAN_LARGE_TAIL)
+      ++n;
+    *cls = heap_span_class[i];
+    *slot_end = heap_base + ((target_ulong)(i + n) << HEAP_SPAN_SHIFT);
+    return heap_base + ((target_ulong)i << HEAP_SPAN_SHIFT);
+
+  }
+
+  target_ulong slot =
+      span + (addr - span) / heap_class_size[c] * heap_class_size[c];
+  *cls = c;
+  *slot_end = slot + heap_class_size[c];
+  return slot;
+
+}
+
+static int heap_owns(target_ulong addr) {
+
+  return addr >= heap_base && addr < heap_end;
+
+}
+
+static struct alloc_tree_node** heap_meta_entry(target_ulong slot) {
+
+  return &heap_meta[(slot - heap_base) >> HEAP_META_SHIFT];
+
+}
+
+static pthread_mutex_t* heap_meta_stripe(target_ulong slot) {
+
+  return &heap_meta_locks[heap_span_index(slot) % HEAP_META_LOCKS];
+
+}
+
+// lock the stripe of the slot that holds addr, NULL if addr is not in a slot.
+// The slot is checked again under the lock, its run may have been recycled.
+static pthread_mutex_t* heap_meta_lock(target_ulong addr, target_ulong* slot) {
+
+  target_ulong     s, slot_end;
+  pthread_mutex_t* lock;
+  int              c;
+
+  if (!heap_span_class || !heap_owns(addr)) return NULL;
+
+  while ((s = heap_slot_of(addr, &c, &slot_end))) {
+
+    lock = heap_meta_stripe(s);
+    pthread_mutex_lock(lock);
+    if (heap_slot_of(addr, &c, &slot_end) == s) {
+
+      *slot = s;
+      return lock;
+
+    }
+
+    pthread_mutex_unlock(lock);
+
+  }
+
+  return NULL;
+
+}
+
+// the node of the slot that holds addr, alloc_lock_all must be held
+static struct alloc_tree_node* heap_chunk_node(target_ulong addr) {
+
+  target_ulong slot, slot_end;
+  int          c;
+
+  if (!heap_span_class || !heap_owns(addr) ||
+      !(slot = heap_slot_of(addr, &c, &slot_end)))
+    return NULL;
+  return *heap_meta_entry(slot);
+
+}
+
+// the new chunk [user, user + size) replaces the history of its slot
+static void heap_chunk_insert(target_ulong user, size_t size,
+                              struct call_context* ctx) {
+
+  struct alloc_tree_node* node =
+      alloc_node_new(user, user + size, ctx, ALLOC_HEAP);
+  struct alloc_tree_node* old;
+  pthread_mutex_t*        lock;
+  target_ulong            slot, slot_end;
+  int                     c;
+
+  slot = heap_slot_of(user, &c, &slot_end);
+  lock = heap_meta_stripe(slot);
+
+  pthread_mutex_lock(lock);
+  old = *heap_meta_entry(slot);
+  *heap_meta_entry(slot) = node;
+  pthread_mutex_unlock(lock);
+
+  if (old) alloc_node_free(old);
+
+}
+
+// the live chunk at start is freed, its node or NULL if there is none
+static struct alloc_tree_node* heap_mark_free(target_ulong         start,
+                                              struct call_context* free_ctx) {
+
+  struct alloc_tree_node* node;
+  pthread_mutex_t*        lock;
+  target_ulong            slot;
+
+  if (!(lock = heap_meta_lock(start, &slot))) return NULL;
+
+  node = *heap_meta_entry(slot);
+  if (!node || node->ckinfo.start != start || node->ckinfo.free_ctx) {
+
+    pthread_mutex_unlock(lock);
+    return NULL;
+
+  }
+
+  node->ckinfo.free_ctx = free_ctx;
+  alloc_meta_add(node, context_bytes(free_ctx));
+  if (quarantine_max_bytes) node->flags |= ALLOC_QUARANTINED;
+
+  pthread_mutex_unlock(lock);
+  return node;
+
+}
+
+// the tree and every chunk of the heap stay as they are until
+// alloc_unlock_all, alloc_lock is taken first
+static int alloc_lock_all(void) {
+
+  int i;
+
+  if (!internal_lock(&alloc_lock)) return 0;
+
+  for (i = 0; i < HEAP_META_LOCKS; ++i) {
+
+    if (internal_lock(&heap_meta_locks[i])) continue;
+
+    while (i--)
+      pthread_mutex_unlock(&heap_meta_locks[i]);
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+
+  }
+
+  return 1;
+
+}
+
+static void alloc_unlock_all(void) {
+
+  int i;
+
+  for (i = HEAP_META_LOCKS - 1; i >= 0; --i)
+    pthread_mutex_unlock(&heap_meta_locks[i]);
+  pthread_mutex_unlock(&alloc_lock);
+
+}
+
+// the nodes of the heap in address order, only counted if out is NULL,
+// alloc_lock_all must be held
+static size_t heap_nodes(struct alloc_tree_node** out) {
+
+  const size_t per_span = (size_t)1 << (HEAP_SPAN_SHIFT - HEAP_META_SHIFT);
+  size_t       i, j, n = 0;
+
+  for (i = 0; heap_span_class && i < heap_spans_top; ++i) {
+
+    uint8_t c = heap_span_class[i];
+    if (c == HEAP_SPAN_FREE || c == HEAP_SPAN_LARGE_TAIL) continue;
+
+    struct alloc_tree_node** meta = &heap_meta[i * per_span];
+    for (j = 0; j < per_span; ++j) {
+
+      if (!meta[j]) continue;
+      if (out) out[n] = meta[j];
+      ++n;
+
+    }
+
+  }
+
+  return n;
+
+}
+
+static int heap_recycle(target_ulong start, target_ulong end) {
+
+  struct alloc_tree_node* node;
+  pthread_mutex_t*        lock;
+  target_ulong            slot, slot_end;
+  int                     c;
+
+  if (!heap_owns(start)) return 0;
+
+  slot = heap_slot_of(start, &c, &slot_end);
+
+  if (c < HEAP_SPAN_GUARD) {
+
+    heap_slot_put(c, slot);
+    return 1;
+
+  }
+
+  // the run stays protected, clear the shadow of the ends of the chunk so
+  // that the next guard page chunk finds it all 0
+  if (c == HEAP_SPAN_GUARD) {
+
+    target_ulong page_start = start & ~(target_ulong)(heap_page_size - 1);
+    target_ulong tail = end & ~(target_ulong)7;
+    heap_shadow_fill(page_start, start - page_start, ASAN_VALID);
+    heap_shadow_fill(tail, slot_end - heap_page_size - tail, ASAN_VALID);
+
+  }
+
+  // the history of a run goes with it, the span may get a smaller class
+  lock = heap_meta_stripe(slot);
+  pthread_mutex_lock(lock);
+  node = *heap_meta_entry(slot);
+  *heap_meta_entry(slot) = NULL;
+  pthread_mutex_unlock(lock);
+  if (node) alloc_node_free(node);
+
+  size_t i = heap_span_index(slot), n = heap_span_index(slot_end) - i;
+  pthread_mutex_lock(&heap_span_lock);
+  memset(&heap_span_class[i], HEAP_SPAN_FREE, n);
+  heap_spans_freed += n;
+  pthread_mutex_unlock(&heap_span_lock);
+  return 1;
+
+}
+
+// the run of the guard page mode chunk that holds addr
+static int heap_guard_run(target_ulong addr, target_ulong* start,
+                          target_ulong* end) {
+
+  int c;
+
+  if (!heap_guard_size || !heap_owns(addr) ||
+      heap_span_class[heap_span_index(addr)] < HEAP_SPAN_GUARD)
+    return 0;
+
+  *start = heap_slot_of(addr, &c, end);
+  return c == HEAP_SPAN_GUARD;
+
+}
+
+// protect a freed guard page mode chunk, 0 if it is not one or if it must be
+// poisoned instead
+static int heap_guard_free(target_ulong start, target_ulong end) {
+
+  target_ulong run_start, run_end;
+
+  if (!heap_guard_run(start, &run_start, &run_end)) return 0;
+
+  target_ulong page = heap_page_size;
+  target_ulong page_start = start & ~(page - 1);
+  target_ulong page_end = (end + page - 1) & ~(page - 1);
+  if (!mprotect((void*)g2h(page_start), page_end - page_start, PROT_NONE))
+    return 1;
+
+  // out of mappings (ENOMEM at max_map_count), the shadow of the run is
+  // written and must be cleared before its next guard page chunk
+  size_t i = heap_span_index(run_start);
+  size_t n = heap_span_index(run_end) - i;
+  while (n--)
+    heap_span_flags[i++] |= HEAP_SPAN_DIRTY;
+  return 0;
+
+}
+
+// the error of a fault at addr, heap-buffer-overflow on the guard pages of a
+// chunk and heap-use-after-free inside a freed one
+static int heap_guard_error(target_ulong addr) {
+
+  target_ulong            run_start, run_end;
+  struct alloc_tree_node* node;
+  int                     error = ASAN_ERROR_DEADLY_SIGNAL;
+
+  if (!heap_guard_run(addr, &run_start, &run_end) || !alloc_lock_all())
+    return error;
+
+  node = heap_chunk_node(addr);
+  if (node && (addr < node->ckinfo.start || addr >= node->ckinfo.end))
+    error = ASAN_ERROR_HEAP_BUFFER_OVERFLOW;
+  else if (node && node->ckinfo.free_ctx)
+    error = ASAN_ERROR_HEAP_USE_AFTER_FREE;
+
+  alloc_unlock_all();
+  return error;
+
+}
+
+static target_ulong heap_guard_alloc(size_t align, size_t size) {
+
+  target_ulong page = heap_page_size;
+  target_ulong slot, slot_end, body_end, page_start, user, tail;
+  size_t       n = (size + align + 2 * page + HEAP_SPAN_SIZE - 1) >>
+             HEAP_SPAN_SHIFT;
+
+  pthread_mutex_lock(&heap_span_lock);
+  slot = heap_span_alloc(n, HEAP_SPAN_GUARD);
+  pthread_mutex_unlock(&heap_span_lock);
+  if (!slot) return 0;
+
+  slot_end = slot + n * HEAP_SPAN_SIZE;
+  body_end = slot_end - page;
+  user = (body_end - size) & ~(target_ulong)(align - 1);
+  page_start = user & ~(page - 1);
+
+  // out of mappings (ENOMEM at max_map_count), the chunk takes a slot with
+  // shadow redzones, the run is unprotected when it is given again
+  if (mprotect((void*)g2h(slot), page_start - slot, PROT_NONE) ||
+      mprotect((void*)g2h(body_end), page, PROT_NONE)) {
+
+    pthread_mutex_lock(&heap_span_lock);
+    memset(&heap_span_class[heap_span_index(slot)], HEAP_SPAN_FREE, n);
+    heap_spans_freed += n;
+    pthread_mutex_unlock(&heap_span_lock);
+    return 0;
+
+  }
+
+  tail = user + (size & ~(size_t)7);
+  heap_shadow_fill(page_start, user - page_start, ASAN_HEAP_LEFT_RZ);
+  if (size & 7) {
+
+    uintptr_t h = (uintptr_t)g2h(tail);
+    *((uint8_t*)(h >> 3) + SHADOW_OFFSET) = size & 7;
+    tail += 8;
+
+  }
+
+  heap_shadow_fill(tail, body_end - tail, ASAN_HEAP_RIGHT_RZ);
+  return user;
+
+}
+
+static target_ulong heap_slot_alloc(size_t align, size_t size) {
+
+  target_ulong slot, slot_end, user;
+  size_t       rz = heap_redzone(size);
+  size_t       need;
+
+  need = rz + (align > 16 ? align - 16 : 0) + size;
+
+  if (need <= HEAP_MAX_CLASS_SIZE) {
+
+    int c = heap_size_class(need);
+    if (!(slot = heap_slot_get(c))) return 0;
+    slot_end = slot + heap_class_size[c];
+
+  } else {
+
+    size_t n = (need + 16 + HEAP_SPAN_SIZE - 1) >> HEAP_SPAN_SHIFT;
+    pthread_mutex_lock(&heap_span_lock);
+    slot = heap_span_alloc(n, HEAP_SPAN_LARGE);
+    pthread_mutex_unlock(&heap_span_lock);
+    if (!slot) return 0;
+    slot_end = slot + n * HEAP_SPAN_SIZE;
+
+  }
+
+  user = (slot + rz + align - 1) & ~(target_ulong)(align - 1);
+  heap_shadow_chunk(slot, slot_end, user, size);
+  return user;
+
+}
+
+target_ulong asan_giovese_memalign(size_t align, size_t size, target_ulong pc) {
+
+  target_ulong user;
+
+  if (!heap_span_class || (align & (align - 1))) return 0;
+  if (align < 16) align = 16;
+  if (size > heap_end - heap_base) return 0;
+
+  user = 0;
+  if (heap_guard_size && size >= heap_guard_size)
+    user = heap_guard_alloc(align, size);
+  if (!user && !(user = heap_slot_alloc(align, size))) return 0;
+
+  struct call_context* ctx = calloc(sizeof(struct call_context), 1);
+  asan_giovese_alloc_context(ctx, pc, size);
+  heap_chunk_insert(user, size, ctx);
+  return user;
+
+}
+
+target_ulong asan_giovese_malloc(size_t size, target_ulong pc) {
+
+  return asan_giovese_memalign(16, size, pc);
+
+}
+
+target_ulong asan_giovese_calloc(size_t nmemb, size_t size, target_ulong pc) {
+
+  target_ulong user;
+
+  if (size && nmemb > SIZE_MAX / size) return 0;
+  if (!(user = asan_giovese_memalign(16, nmemb * size, pc))) return 0;
+  memset((void*)g2h(user), 0, nmemb * size);
+  return user;
+
+}
+
+int asan_giovese_free(target_ulong ptr, target_ulong pc) {
+
+  if (!ptr) return 1;
+
+  if (heap_owns(ptr)) {
+
+    struct call_context* ctx = calloc(sizeof(struct call_context), 1);
+    asan_giovese_populate_context(ctx, pc);
+    if (asan_giovese_alloc_free(ptr, ctx)) return 1;
+    free_context(ctx);
+
+  }
+
+  asan_giovese_badfree(ptr, pc);
+  return 0;
+
+}
+
+size_t asan_giovese_malloc_usable_size(target_ulong ptr) {
+
+  struct alloc_tree_node* node;
+  pthread_mutex_t*        lock;
+  target_ulong            slot;
+  size_t                  size = 0;
+
+  if (!(lock = heap_meta_lock(ptr, &slot))) return 0;
+  node = *heap_meta_entry(slot);
+  if (node && node->ckinfo.start == ptr && !node->ckinfo.free_ctx)
+    size = node->ckinfo.end - node->ckinfo.start;
+  pthread_mutex_unlock(lock);
+  return size;
+
+}
+
+target_ulong asan_giovese_realloc(target_ulong ptr, size_t size,
+                                  target_ulong pc) {
+
+  target_ulong user;
+  size_t       old;
+
+  if (!ptr) return asan_giovese_malloc(size, pc);
+
+  old = asan_giovese_malloc_usable_size(ptr);
+  if (!old) {
+
+    asan_giovese_badfree(ptr, pc);
+    return 0;
+
+  }
+
+  if (!(user = asan_giovese_malloc(size, pc))) return 0;
+  memcpy((void*)g2h(user), (void*)g2h(ptr), old < size ? old : size);
+  asan_giovese_free(ptr, pc);
+  return user;
+
+}
+
+// give back the cached slots and quarantined chunks of the thread
+void asan_giovese_heap_thread_exit(void) {
+
+  asan_giovese_quarantine_flush();
+  heap_cache_exit(&heap_cache);
+
+}
+
+// ------------------------------------------------------------------------- //
+// Init
+// ------------------------------------------------------------------------- //
+
+void* __ag_high_shadow = HIGH_SHADOW_ADDR;
+void* __ag_low_shadow = LOW_SHADOW_ADDR;
+
+void asan_giovese_init(void) {
+
+  assert(mmap(__ag_high_shadow, HIGH_SHADOW_SIZE, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE | MAP_ANON, -1,
+              0) != MAP_FAILED);
+
+  assert(mmap(__ag_low_shadow, LOW_SHADOW_SIZE, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE | MAP_ANON, -1,
+              0) != MAP_FAILED);
+
+  assert(mmap(GAP_SHADOW_ADDR, GAP_SHADOW_SIZE, PROT_NONE,
+              MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE | MAP_ANON, -1,
+              0) != MAP_FAILED);
+
+  shadow_stack_init();
+
+}
+
+// ------------------------------------------------------------------------- //
+// Checks
+// ------------------------------------------------------------------------- //
+
+int asan_giovese_load1(void* ptr) {
+
+  uintptr_t h = (uintptr_t)ptr;
+  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+  int8_t    k = *shadow_addr;
+  int       r = k != 0 && (intptr_t)((h & 7) + 1) > k;
+  STATS_CHECK(ACCESS_TYPE_LOAD, STATS_CHECK_1, r);
+  return r;
+
+}
+
+int asan_giovese_load2(void* ptr) {
+
+  uintptr_t h = (uintptr_t)ptr;
+  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+  int8_t    k = *shadow_addr;
+  int       r = k != 0 && (intptr_t)((h & 7) + 2) > k;
+  STATS_CHECK(ACCESS_TYPE_LOAD, STATS_CHECK_2, r);
+  return r;
+
+}
+
+int asan_giovese_load4(void* ptr) {
+
+  uintptr_t h = (uintptr_t)ptr;
+  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+  int8_t    k = *shadow_addr;
+  int       r = k != 0 && (intptr_t)((h & 7) + 4) > k;
+  STATS_CHECK(ACCESS_TYPE_LOAD, STATS_CHECK_4, r);
+  return r;
+
+}
+
+int asan_giovese_load8(void* ptr) {
+
+  uintptr_t h = (uintptr_t)ptr;
+  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+  STATS_CHECK(ACCESS_TYPE_LOAD, STATS_CHECK_8, *shadow_addr);
+  return (*shadow_addr);
+
+}
+
+int asan_giovese_store1(void* ptr) {
+
+  uintptr_t h = (uintptr_t)ptr;
+  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+  int8_t    k = *shadow_addr;
+  int       r = k != 0 && (intptr_t)((h & 7) + 1) > k;
+  STATS_CHECK(ACCESS_TYPE_STORE, STATS_CHECK_1, r);
+  return r;
+
+}
+
+int asan_giovese_store2(void* ptr) {
+
+  uintptr_t h = (uintptr_t)ptr;
+  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+  int8_t    k = *shadow_addr;
+  int       r = k != 0 && (intptr_t)((h & 7) + 2) > k;
+  STATS_CHECK(ACCESS_TYPE_STORE, STATS_CHECK_2, r);
+  return r;
+
+}
+
+int asan_giovese_store4(void* ptr) {
+
+  uintptr_t h = (uintptr_t)ptr;
+  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+  int8_t    k = *shadow_addr;
+  int       r = k != 0 && (intptr_t)((h & 7) + 4) > k;
+  STATS_CHECK(ACCESS_TYPE_STORE, STATS_CHECK_4, r);
+  return r;
+
+}
+
+int asan_giovese_store8(void* ptr) {
+
+  uintptr_t h = (uintptr_t)ptr;
+  int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+  STATS_CHECK(ACCESS_TYPE_STORE, STATS_CHECK_8, *shadow_addr);
+  return (*shadow_addr);
+
+}
+
+static int check_loadN(void* ptr, size_t n) {
+
+  if (!n) return 0;
+
+  uintptr_t start = (uintptr_t)ptr;
+  uintptr_t end = start + n;
+  uintptr_t last_8 = end & ~7;
+
+  if (start & 0x7) {
+
+    uintptr_t next_8 = (start & ~7) + 8;
+    size_t       first_size = next_8 - start;
+
+    if (n <= first_size) {
+
+      uintptr_t h = start;
+      int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+      int8_t    k = *shadow_addr;
+      return k != 0 && ((intptr_t)((h & 7) + n) > k);
+
+    }
+
+    uintptr_t h = start;
+    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+    int8_t    k = *shadow_addr;
+    if (k != 0 && ((intptr_t)((h & 7) + first_size) > k)) return 1;
+
+    start = next_8;
+
+  }
+
+  while (start < last_8) {
+
+    uintptr_t h = start;
+    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+    if (*shadow_addr) return 1;
+    start += 8;
+
+  }
+
+  if (last_8 != end) {
+
+    uintptr_t h = start;
+    size_t    last_size = end - last_8;
+    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+    int8_t    k = *shadow_addr;
+    return k != 0 && ((intptr_t)((h & 7) + last_size) > k);
+
+  }
+
+  return 0;
+
+}
+
+static int check_storeN(void* ptr, size_t n) {
+
+  if (!n) return 0;
+
+  uintptr_t start = (uintptr_t)ptr;
+  uintptr_t end = start + n;
+  uintptr_t last_8 = end & ~7;
+
+  if (start & 0x7) {
+
+    uintptr_t next_8 = (start & ~7) + 8;
+    size_t       first_size = next_8 - start;
+
+    if (n <= first_size) {
+
+      uintptr_t h = start;
+      int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+      int8_t    k = *shadow_addr;
+      return k != 0 && ((intptr_t)((h & 7) + n) > k);
+
+    }
+
+    uintptr_t h = start;
+    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+    int8_t    k = *shadow_addr;
+    if (k != 0 && ((intptr_t)((h & 7) + first_size) > k)) return 1;
+
+    start = next_8;
+
+  }
+
+  while (start < last_8) {
+
+    uintptr_t h = start;
+    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+    if (*shadow_addr) return 1;
+    start += 8;
+
+  }
+
+  if (last_8 != end) {
+
+    uintptr_t h = start;
+    size_t    last_size = end - last_8;
+    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+    int8_t    k = *shadow_addr;
+    return k != 0 && ((intptr_t)((h & 7) + last_size) > k);
+
+  }
+
+  return 0;
+
+}
+
+static int check_guest_loadN(target_ulong addr, size_t n) {
+
+  if (!n) return 0;
+
+  target_ulong start = addr;
+  target_ulong end = start + n;
+  target_ulong last_8 = end & ~7;
+
+  if (start & 0x7) {
+
+    target_ulong next_8 = (start & ~7) + 8;
+    size_t       first_size = next_8 - start;
+
+    if (n <= first_size) {
+
+      uintptr_t h = (uintptr_t)g2h(start);
+      int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+      int8_t    k = *shadow_addr;
+      return k != 0 && ((intptr_t)((h & 7) + n) > k);
+
+    }
+
+    uintptr_t h = (uintptr_t)g2h(start);
+    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+    int8_t    k = *shadow_addr;
+    if (k != 0 && ((intptr_t)((h & 7) + first_size) > k)) return 1;
+
+    start = next_8;
+
+  }
+
+  while (start < last_8) {
+
+    uintptr_t h = (uintptr_t)g2h(start);
+    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+    if (*shadow_addr) return 1;
+    start += 8;
+
+  }
+
+  if (last_8 != end) {
+
+    uintptr_t h = (uintptr_t)g2h(start);
+    size_t    last_size = end - last_8;
+    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+    int8_t    k = *shadow_addr;
+    return k != 0 && ((intptr_t)((h & 7) + last_size) > k);
+
+  }
+
+  return 0;
+
+}
+
+static int check_guest_storeN(target_ulong addr, size_t n) {
+
+  if (!n) return 0;
+
+  target_ulong start = addr;
+  target_ulong end = start + n;
+  target_ulong last_8 = end & ~7;
+
+  if (start & 0x7) {
+
+    target_ulong next_8 = (start & ~7) + 8;
+    size_t       first_size = next_8 - start;
+
+    if (n <= first_size) {
+
+      uintptr_t h = (uintptr_t)g2h(start);
+      int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+      int8_t    k = *shadow_addr;
+      return k != 0 && ((intptr_t)((h & 7) + n) > k);
+
+    }
+
+    uintptr_t h = (uintptr_t)g2h(start);
+    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+    int8_t    k = *shadow_addr;
+    if (k != 0 && ((intptr_t)((h & 7) + first_size) > k)) return 1;
+
+    start = next_8;
+
+  }
+
+  while (start < last_8) {
+
+    uintptr_t h = (uintptr_t)g2h(start);
+    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+    if (*shadow_addr) return 1;
+    start += 8;
+
+  }
+
+  if (last_8 != end) {
+
+    uintptr_t h = (uintptr_t)g2h(start);
+    size_t    last_size = end - last_8;
+    int8_t*   shadow_addr = (int8_t*)(h >> 3) + SHADOW_OFFSET;
+    int8_t    k = *shadow_addr;
+    return k != 0 && ((intptr_t)((h & 7) + last_size) > k);
+
+  }
+
+  return 0;
+
+}
+
+int asan_giovese_loadN(void* ptr, size_t n) {
+
+  int r = check_loadN(ptr, n);
+  STATS_CHECK(ACCESS_TYPE_LOAD, STATS_CHECK_N, r);
+  return r;
+
+}
+
+int asan_giovese_storeN(void* ptr, size_t n) {
+
+  int r = check_storeN(ptr, n);
+  STATS_CHECK(ACCESS_TYPE_STORE, STATS_CHECK_N, r);
+  return r;
+
+}
+
+int asan_giovese_guest_loadN(target_ulong addr, size_t n) {
+
+  int r = check_guest_loadN(addr, n);
+  STATS_CHECK(ACCESS_TYPE_LOAD, STATS_CHECK_N, r);
+  return r;
+
+}
+
+int asan_giovese_guest_storeN(target_ulong addr, size_t n) {
+
+  int r = check_guest_storeN(addr, n);
+  STATS_CHECK(ACCESS_TYPE_STORE, STATS_CHECK_N, r);
+  return r;
+
+}
+
+// ------------------------------------------------------------------------- //
+// Poison
+// ------------------------------------------------------------------------- //
+
+int asan_giovese_poison_region(void* ptr, size_t n,
+                               uint8_t poison_byte) {
+
+  if (!n) return 0;
+  stats_add(&stats_get()->poisoned_bytes, n);
+
+  uintptr_t start = (uintptr_t)ptr;
+  uintptr_t end = start + n;
+  uintptr_t last_8 = end & ~7;
+
+  if (start & 0x7) {
+
+    target_ulong next_8 = (start & ~7) + 8;
+    size_t       first_size = next_8 - start;
+
+    if (n < first_size) return 0;
+
+    uintptr_t h = start;
+    uint8_t*  shadow_addr = (uint8_t*)(h >> 3) + SHADOW_OFFSET;
+    *shadow_addr = 8 - first_size;
+
+    start = next_8;
+
+  }
+
+  // the shadow of a contiguous range is contiguous, fill it at once
+  if (start < last_8) {
+
+    uintptr_t h = start;
+    memset((uint8_t*)(h >> 3) + SHADOW_OFFSET, poison_byte,
+           (last_8 - start) >> 3);
+
+  }
+
+  return 1;
+
+}
+
+int asan_giovese_user_poison_region(void* ptr, size_t n) {
+
+  return asan_giovese_poison_region(ptr, n, ASAN_USER);
+
+}
+
+int asan_giovese_unpoison_region(void* ptr, size_t n) {
+
+  uintptr_t h = (uintptr_t)ptr;
+  memset((uint8_t*)(h >> 3) + SHADOW_OFFSET, 0, (n + 7) >> 3);
+  stats_add(&stats_get()->unpoisoned_bytes, n);
+
+  return 1;
+
+}
+
+int asan_giovese_poison_guest_region(target_ulong addr, size_t n,
+                                     uint8_t poison_byte) {
+
+  if (!n) return 0;
+  stats_add(&stats_get()->poisoned_bytes, n);
+  
+  target_ulong start = addr;
+  target_ulong end = start + n;
+  target_ulong last_8 = end & ~7;
+  
+  if (start & 0x7) {
+
+    target_ulong next_8 = (start & ~7) + 8;
+    size_t       first_size = next_8 - start;
+
+    if (n < first_size) return 0;
+
+    uintptr_t h = (uintptr_t)g2h(start);
+    uint8_t*  shadow_addr = (uint8_t*)(h >> 3) + SHADOW_OFFSET;
+    *shadow_addr = 8 - first_size;
+
+    start = next_8;
+
+  }
+
+  if (start < last_8) {
+
+    uintptr_t h = (uintptr_t)g2h(start);
+    memset((uint8_t*)(h >> 3) + SHADOW_OFFSET, poison_byte,
+           (last_8 - start) >> 3);
+
+  }
+
+  return 1;
+
+}
+
+int asan_giovese_user_poison_guest_region(target_ulong addr, size_t n) {
+
+  return asan_giovese_poison_guest_region(addr, n, ASAN_USER);
+
+}
+
+int asan_giovese_unpoison_guest_region(target_ulong addr, size_t n) {
+
+  uintptr_t h = (uintptr_t)g2h(addr);
+  memset((uint8_t*)(h >> 3) + SHADOW_OFFSET, 0, (n + 7) >> 3);
+  stats_add(&stats_get()->unpoisoned_bytes, n);
+
+  return 1;
+
+}
+
+// ------------------------------------------------------------------------- //
+// Crash records
+// ------------------------------------------------------------------------- //
+
+static const char* error_type_str[] = {
+
+    [ASAN_ERROR_HEAP_BUFFER_OVERFLOW] = "heap-buffer-overflow",
+    [ASAN_ERROR_HEAP_USE_AFTER_FREE] = "heap-use-after-free",
+    [ASAN_ERROR_USE_AFTER_POISON] = "use-after-poison",
+    [ASAN_ERROR_DEADLY_SIGNAL] = "deadly-signal",
+    [ASAN_ERROR_BAD_FREE] = "bad-free",
+    [ASAN_ERROR_MEMORY_LEAK] = "memory-leak",
+
+};
+
+static int record_fd = -1;
+static int record_fd_owned;  // opened by asan_giovese_set_record_file
+
+// the report, defined below
+static void report_begin(void);
+static void report_end(void);
+
+// a report may be writing the record, the fd changes while it is owned
+static void record_fd_set(int fd, int owned) {
+
+  report_begin();
+  if (record_fd_owned && record_fd >= 0 && record_fd != fd) close(record_fd);
+  record_fd = fd;
+  record_fd_owned = owned;
+  report_end();
+
+}
+
+void asan_giovese_set_record_fd(int fd) {
+
+  record_fd_set(fd, 0);
+
+}
+
+int asan_giovese_set_record_file(const char* path) {
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd >= 0) record_fd_set(fd, 1);
+  return fd;
+
+}
+
+static void write_all(int fd, const void* buf, size_t len) {
+
+  size_t off = 0;
+  while (off < len) {
+
+    ssize_t r = write(fd, (const char*)buf + off, len - off);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    off += r;
+
+  }
+
+}
+
+// FNV-1a over the innermost max frames
+static uint64_t context_stack_id(struct call_context* ctx, size_t max) {
+
+  target_ulong frames[MAX_CONTEXT_FRAMES];
+  uint64_t     h = 0xcbf29ce484222325ULL;
+  size_t       n, i;
+
+  if (!ctx) return 0;
+  if (max > MAX_CONTEXT_FRAMES) max = MAX_CONTEXT_FRAMES;
+  n = context_frames(ctx, frames, max);
+  if (!n) return 0;
+
+  for (i = 0; i < n; ++i)
+    h = (h ^ (uint64_t)frames[i]) * 0x100000001b3ULL;
+  return h;
+
+}
+
+// Bucket hash of an error, from its type, the access kind and the module
+// relative offsets of the innermost frames, so it does not change under ASLR.
+// Modules are identified by their file name, frames outside any module by
+// their offset in the page.
+
+#define BUCKET_FRAMES 3
+
+static uint64_t bucket_mix(uint64_t h, uint64_t v) {
+
+  int i;
+  for (i = 0; i < 8; ++i) {
+
+    h = (h ^ (v & 0xff)) * 0x100000001b3ULL;
+    v >>= 8;
+
+  }
+
+  return h;
+
+}
+
+static uint64_t fnv_str(uint64_t h, const char* s) {
+
+  while (*s)
+    h = (h ^ (uint8_t)*s++) * 0x100000001b3ULL;
+  return h;
+
+}
+
+// The ELF vaddr of a host frame needs the lowest PT_LOAD vaddr of its module.
+// It is read from the program headers alone with pread and kept in a lock
+// free set keyed by the hash of the path, so the bucket of a crash neither
+// loads a symbol table nor depends on a lock being free.
+
+#define MODULE_VADDR_SLOTS 256
+#define MODULE_VADDR_PHDRS 16  // program headers read at once
+
+struct module_vaddr {
+
+  uint64_t key;  // path hash | 1 once vaddr is set, | 0 while it is set
+  uint64_t vaddr;
+
+};
+
+static struct module_vaddr module_vaddrs[MODULE_VADDR_SLOTS];
+
+// lowest PT_LOAD vaddr of the ELF at path in vaddr, 0 for a file that is not
+// an ELF. Returns 0 if the file can not be opened, that may be transient.
+static int module_vaddr_read(const char* path, uint64_t* vaddr) {
+
+  uint8_t         buf[MODULE_VADDR_PHDRS * sizeof(Elf64_Phdr)];
+  struct elf_file e = {buf, 0, 0, 0};
+  uint64_t        min = UINT64_MAX;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+
+  *vaddr = 0;
+  ssize_t n = pread(fd, buf, sizeof(Elf64_Ehdr), 0);
+  if (n < EI_NIDENT || memcmp(buf, ELFMAG, SELFMAG)) {
+
+    close(fd);
+    return 1;
+
+  }
+
+  e.size = n;
+  e.is64 = buf[EI_CLASS] == ELFCLASS64;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  e.swap = buf[EI_DATA] != ELFDATA2MSB;
+#else
+  e.swap = buf[EI_DATA] != ELFDATA2LSB;
+#endif
+
+  uint64_t phoff = ELF_FIELD(&e, 0, Ehdr, e_phoff);
+  uint64_t phentsize = ELF_FIELD(&e, 0, Ehdr, e_phentsize);
+  uint64_t phnum = ELF_FIELD(&e, 0, Ehdr, e_phnum);
+  uint64_t i;
+
+  if (phentsize && phentsize <= sizeof(Elf64_Phdr)) {
+
+    for (i = 0; i < phnum; i += MODULE_VADDR_PHDRS) {
+
+      uint64_t count = phnum - i < MODULE_VADDR_PHDRS ? phnum - i
+                                                      : MODULE_VADDR_PHDRS;
+      n = pread(fd, buf, count * phentsize, phoff + i * phentsize);
+      if (n <= 0) break;
+      e.size = n;
+
+      uint64_t vaddr = elf_min_vaddr(&e, 0, phentsize, n / phentsize);
+      if (vaddr < min) min = vaddr;
+
+    }
+
+  }
+
+  close(fd);
+  if (min != UINT64_MAX) *vaddr = min;
+  return 1;
+
+}
+
+static uint64_t module_vaddr(const char* path) {
+
+  uint64_t h = fnv_str(0xcbf29ce484222325ULL, path);
+  uint64_t ready = h | 1, pending = h & ~(uint64_t)1;
+  uint64_t vaddr = 0;
+  uint32_t i;
+
+  for (i = 0; i < MODULE_VADDR_SLOTS; ++i) {
+
+    struct module_vaddr* m =
+        &module_vaddrs[(h + i) & (MODULE_VADDR_SLOTS - 1)];
+    uint64_t cur = __atomic_load_n(&m->key, __ATOMIC_ACQUIRE);
+
+    if (cur == ready) return m->vaddr;
+    if (cur == pending) break;  // another thread is reading it
+    if (cur) continue;
+
+    if (!__atomic_compare_exchange_n(&m->key, &cur, pending, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+
+      if (cur == ready) return m->vaddr;
+      if (cur == pending) break;
+      continue;
+
+    }
+
+    // a failed open is not cached, the next crash reads the headers again
+    if (!module_vaddr_read(path, &vaddr)) {
+
+      __atomic_store_n(&m->key, 0, __ATOMIC_RELEASE);
+      return 0;
+
+    }
+
+    m->vaddr = vaddr;
+    __atomic_store_n(&m->key, ready, __ATOMIC_RELEASE);
+    return vaddr;
+
+  }
+
+  // full or being read, the headers give the same value
+  module_vaddr_read(path, &vaddr);
+  return vaddr;
+
+}
+
+// file name of the module containing addr and its ELF vaddr, the guest
+// modules first, NULL if none. The full path is copied in path.
+static const char* frame_module(target_ulong addr, char* path,
+                                size_t path_size, target_ulong* offset) {
+
+  if (!asan_giovese_guest_module_lookup(addr, path, path_size, offset)) {
+
+    if (!asan_giovese_module_lookup(addr, path, path_size, offset))
+      return NULL;
+
+    // the first mapping of a host module maps its lowest vaddr, a guest
+    // offset is already addr - load_bias
+    if (path[0] == '/') *offset += module_vaddr(path);
+
+  }
+
+  const char* name = strrchr(path, '/');
+  return name ? name + 1 : path;
+
+}
+
+uint64_t asan_giovese_bucket_hash(int error, int access_type,
+                                  struct call_context* ctx) {
+
+  target_ulong frames[BUCKET_FRAMES];
+  char         path[PATH_MAX];
+  uint64_t     h = 0xcbf29ce484222325ULL;
+  size_t       n = ctx ? context_frames(ctx, frames, BUCKET_FRAMES) : 0;
+  size_t       i;
+
+  h = bucket_mix(h, (uint32_t)error);
+  h = bucket_mix(h, (uint32_t)access_type);
+
+  for (i = 0; i < n; ++i) {
+
+    target_ulong offset;
+    const char*  name = frame_module(frames[i], path, sizeof(path), &offset);
+
+    if (name)
+      h = bucket_mix(fnv_str(h, name), offset);
+    else
+      h = bucket_mix(h, frames[i] & 0xfff);
+
+  }
+
+  return h;
+
+}
+
+// fill the fields that are not specific of the error and write the record
+static void record_write(struct asan_giovese_record* r,
+                         struct call_context*        ctx) {
+
+  struct chunk_info* ckinfo = NULL;
+  size_t             i;
+
+  r->magic = ASAN_RECORD_MAGIC;
+  r->size = sizeof(struct asan_giovese_record);
+  r->tid = ctx->tid;
+  r->stack_id = context_stack_id(ctx, MAX_CONTEXT_FRAMES);
+  // errors raised by a signal hash the signal instead of the access
+  r->bucket = asan_giovese_bucket_hash(
+      r->error, r->signum ? r->signum : (int)r->access_type, ctx);
+
+  // the address of a deadly signal may not be shadowed
+  if (r->error != ASAN_ERROR_DEADLY_SIGNAL) {
+
+    target_ulong start =
+        (r->fault_addr & ~127) - 16 * 8 * (ASAN_RECORD_SHADOW_LINES / 2);
+    for (i = 0; i < sizeof(r->shadow); ++i) {
+
+      uintptr_t h = (uintptr_t)g2h(start + i * 8);
+      r->shadow[i] = *((uint8_t*)(h >> 3) + SHADOW_OFFSET);
+
+    }
+
+    r->shadow_addr = start;
+
+    if (alloc_lock_all()) {
+
+      ckinfo = alloc_search_near(r->addr, r->fault_addr);
+      if (ckinfo) {
+
+        r->chunk_start = ckinfo->start;
+        r->chunk_end = ckinfo->end;
+        r->alloc_stack_id =
+            context_stack_id(ckinfo->alloc_ctx, MAX_CONTEXT_FRAMES);
+        r->free_stack_id =
+            context_stack_id(ckinfo->free_ctx, MAX_CONTEXT_FRAMES);
+
+      }
+
+      alloc_unlock_all();
+
+    }
+
+  }
+
+  write_all(record_fd, r, sizeof(struct asan_giovese_record));
+
+}
+
+// ------------------------------------------------------------------------- //
+// Deduplication
+// ------------------------------------------------------------------------- //
+
+// In continue mode an error is keyed by its type, pc and the hash of the top
+// frames in a fixed open addressing set, only the first occurrence of a key
+// is reported and the others bump its counter. A slot keeps the error, pc and
+// stack hash of its key, so errors whose hashes collide are not merged. With
+// a single frame the key is the pc alone and a repeat is counted before its
+// stack is unwound.
+
+#define DEDUP_SLOTS 4096
+#define DEDUP_FRAMES 4
+
+struct dedup_slot {
+
+  uint64_t     key;  // 0 if free
+  uint64_t     stack_id;
+  target_ulong pc;
+  uint32_t     error;
+  uint32_t     count;
+
+};
+
+static struct dedup_slot dedup_slots[DEDUP_SLOTS];
+static int               dedup_enabled;
+static int               dedup_at_exit;  // print the summary at exit
+static uint32_t          dedup_frames = DEDUP_FRAMES;
+static uint32_t          dedup_overflow;  // errors that found the set full
+
+// 0 if the error is a repeat, counted in its slot. A new error takes a slot
+// if claim is set. Called while the report is owned, so the fields of a slot
+// are set before another error can compare them.
+static int dedup_insert(int error, target_ulong pc, uint64_t stack_id,
+                        int claim) {
+
+  uint64_t key = (stack_id ^ ((uint64_t)pc * 0x9e3779b97f4a7c15ULL)) +
+                 (uint64_t)error;
+  size_t   i;
+
+  if (!key) key = 1;
+
+  for (i = 0; i < DEDUP_SLOTS; ++i) {
+
+    struct dedup_slot* slot = &dedup_slots[(key + i) & (DEDUP_SLOTS - 1)];
+    uint64_t           cur = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+
+    if (!cur) {
+
+      if (!claim) return 1;
+      if (!__atomic_compare_exchange_n(&slot->key, &cur, key, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        continue;
+
+      slot->stack_id = stack_id;
+      slot->pc = pc;
+      slot->error = error;
+      __atomic_add_fetch(&slot->count, 1, __ATOMIC_RELEASE);
+      return 1;
+
+    }
+
+    if (cur == key && slot->error == (uint32_t)error && slot->pc == pc &&
+        slot->stack_id == stack_id) {
+
+      __atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED);
+      return 0;
+
+    }
+
+  }
+
+  if (claim) __atomic_add_fetch(&dedup_overflow, 1, __ATOMIC_RELAXED);
+  return 1;
+
+}
+
+// 1 if the error has to be reported, it is new or the set is full. With ctx
+// NULL only a repeat keyed on the pc alone is found, before the unwind.
+static int dedup_check(int error, target_ulong pc, struct call_context* ctx) {
+
+  if (!dedup_enabled) return 1;
+  if (!ctx) return dedup_frames > 1 || dedup_insert(error, pc, 0, 0);
+  return dedup_insert(
+      error, pc, dedup_frames > 1 ? context_stack_id(ctx, dedup_frames) : 0,
+      1);
+
+}
+
+// The bucket store is a hash set of crash buckets in a file mapped shared by
+// every process that sets it, so parallel fuzzer instances report each bucket
+// once. Slots are claimed with a CAS on the mapping, no daemon or file lock.
+
+#define BUCKET_STORE_MAGIC 0x53424741  // "AGBS"
+#define BUCKET_STORE_SLOTS (1 << 16)
+
+struct bucket_store_slot {
+
+  uint64_t bucket;  // 0 if free
+  uint64_t count;
+
+};
+
+struct bucket_store {
+
+  uint32_t                 magic;
+  uint32_t                 slots;
+  uint64_t                 reserved;
+  struct bucket_store_slot slot[];
+
+};
+
+static struct bucket_store* bucket_store;
+
+int asan_giovese_set_bucket_store(const char* path) {
+
+  struct stat st;
+  size_t      size = sizeof(struct bucket_store) +
+                BUCKET_STORE_SLOTS * sizeof(struct bucket_store_slot);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) return 0;
+
+  // every instance extends the file to the same size, the new bytes are zero,
+  // a larger file was made with another number of slots
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size > size ||
+      ((size_t)st.st_size < size && ftruncate(fd, size) < 0)) {
+
+    close(fd);
+    return 0;
+
+  }
+
+  struct bucket_store* store =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (store == MAP_FAILED) return 0;
+
+  // the creator may not have set slots yet, 0 is taken as its value
+  uint32_t magic = 0, slots = 0;
+  if ((!__atomic_compare_exchange_n(&store->magic, &magic, BUCKET_STORE_MAGIC,
+                                    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+       magic != BUCKET_STORE_MAGIC) ||
+      (!__atomic_compare_exchange_n(&store->slots, &slots, BUCKET_STORE_SLOTS,
+                                    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+       slots != BUCKET_STORE_SLOTS)) {
+
+    munmap(store, size);
+    return 0;
+
+  }
+
+  bucket_store = store;
+  return 1;
+
+}
+
+// 1 if another report of the bucket was already stored
+static int bucket_store_seen(uint64_t bucket) {
+
+  struct bucket_store* store = bucket_store;
+  uint32_t             i;
+
+  if (!store) return 0;
+  if (!bucket) bucket = 1;
+
+  for (i = 0; i < BUCKET_STORE_SLOTS; ++i) {
+
+    struct bucket_store_slot* slot =
+        &store->slot[(bucket + i) & (BUCKET_STORE_SLOTS - 1)];
+    uint64_t cur = __atomic_load_n(&slot->bucket, __ATOMIC_ACQUIRE);
+
+    if (!cur && __atomic_compare_exchange_n(&slot->bucket, &cur, bucket, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+
+      __atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED);
+      return 0;
+
+    }
+
+    if (cur == bucket) {
+
+      __atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED);
+      return 1;
+
+    }
+
+  }
+
+  return 0;  // full, report it
+
+}
+
+// ------------------------------------------------------------------------- //
+// Suppressions
+// ------------------------------------------------------------------------- //
+
+// Rules, one per line, '*' for any error type:
+//
+//   heap-use-after-free                 every error of the type
+//   heap-buffer-overflow:libfoo.so      in a module, by file name
+//   *:libfoo.so+0x1000-0x2000           in a range of module ELF vaddrs
+//   use-after-poison:fun:png_read_*     in the functions matching a glob
+//
+// A rule matches if any frame of the error matches it. The rules are
+// compiled in a mask of the suppressed types, a hash set of the modules and
+// a table of offset intervals sorted by module and start. The function globs
+// become intervals the first time a frame falls in a module, looking up its
+// symbol table once, so the matching never symbolizes a frame. A glob added
+// later is applied alone to the modules already seen. Rules are added and
+// matched while the report is owned.
+
+#define SUPP_MODULES 1024
+#define SUPP_GLOBS 256
+
+struct supp_module {
+
+  uint64_t name;  // hash of the file name, 0 if free
+  uint32_t errors;  // mask of the suppressed error types
+  uint32_t globs;  // in supp_expanded, the globs applied so far
+
+};
+
+struct supp_interval {
+
+  uint64_t name;
+  uint64_t lo;
+  uint64_t hi;
+  uint64_t max_hi;  // of the intervals of the module up to this one
+  uint32_t errors;
+
+};
+
+struct supp_glob {
+
+  uint32_t errors;
+  char*    pattern;
+
+};
+
+static uint32_t              supp_errors;
+static struct supp_module    supp_modules[SUPP_MODULES];
+static struct supp_module    supp_expanded[SUPP_MODULES];  // globs applied
+static struct supp_interval* supp_intervals;
+static size_t                supp_intervals_count;
+static size_t                supp_intervals_cap;
+static struct supp_glob      supp_globs[SUPP_GLOBS];
+static size_t                supp_globs_count;
+static size_t                supp_rules;
+static uint32_t              supp_hits;
+
+// the slot of name, a free one if missing, NULL if the set is full
+static struct supp_module* supp_module_slot(struct supp_module* set,
+                                            uint64_t            name) {
+
+  size_t i;
+  if (!name) name = 1;
+
+  for (i = 0; i < SUPP_MODULES; ++i) {
+
+    struct supp_module* m = &set[(name + i) & (SUPP_MODULES - 1)];
+    if (!m->name || m->name == name) return m;
+
+  }
+
+  return NULL;
+
+}
+
+// append an interval, supp_interval_sort must follow before a lookup
+static void supp_interval_add(uint64_t name, uint64_t lo, uint64_t hi,
+                              uint32_t errors) {
+
+  struct supp_interval* r;
+
+  if (supp_intervals_count == supp_intervals_cap) {
+
+    supp_intervals_cap = supp_intervals_cap ? supp_intervals_cap * 2 : 64;
+    supp_intervals = internal_realloc(
+        supp_intervals, supp_intervals_cap * sizeof(struct supp_interval));
+
+  }
+
+  r = &supp_intervals[supp_intervals_count++];
+  r->name = name;
+  r->lo = lo;
+  r->hi = hi;
+  r->errors = errors;
+
+}
+
+static int supp_interval_cmp(const void* a, const void* b) {
+
+  const struct supp_interval* x = a;
+  const struct supp_interval* y = b;
+
+  if (x->name != y->name) return x->name < y->name ? -1 : 1;
+  if (x->lo != y->lo) return x->lo < y->lo ? -1 : 1;
+  return 0;
+
+}
+
+// sort by module and start and compute max_hi in one pass
+static void supp_interval_sort(void) {
+
+  size_t i;
+
+  internal_sort(supp_intervals, supp_intervals_count,
+                sizeof(struct supp_interval), supp_interval_cmp);
+
+  for (i = 0; i < supp_intervals_count; ++i) {
+
+    struct supp_interval* prev = i ? &supp_intervals[i - 1] : NULL;
+    uint64_t              max_hi = supp_intervals[i].hi;
+    if (prev && prev->name == supp_intervals[i].name && prev->max_hi > max_hi)
+      max_hi = prev->max_hi;
+    supp_intervals[i].max_hi = max_hi;
+
+  }
+
+}
+
+// mask of the error types suppressed at offset of the module
+static uint32_t supp_interval_errors(uint64_t name, uint64_t offset) {
+
+  size_t   lo = 0, hi = supp_intervals_count;
+  uint32_t errors = 0;
+
+  // first interval after (name, offset)
+  while (lo < hi) {
+
+    size_t                mid = lo + (hi - lo) / 2;
+    struct supp_interval* r = &supp_intervals[mid];
+    if (r->name < name || (r->name == name && r->lo <= offset))
+      lo = mid + 1;
+    else
+      hi = mid;
+
+  }
+
+  while (lo-- && supp_intervals[lo].name == name &&
+         supp_intervals[lo].max_hi > offset)
+    if (offset < supp_intervals[lo].hi) errors |= supp_intervals[lo].errors;
+
+  return errors;
+
+}
+
+static int supp_glob_match(const char* p, const char* s) {
+
+  while (*p) {
+
+    if (*p == '*') {
+
+      while (*p == '*')
+        ++p;
+      if (!*p) return 1;
+      for (; *s; ++s)
+        if (supp_glob_match(p, s)) return 1;
+      return 0;
+
+    }
+
+    if (!*s || (*p != '?' && *p != *s)) return 0;
+    ++p;
+    ++s;
+
+  }
+
+  return !*s;
+
+}
+
+// turn the globs not applied yet to the module in intervals of the module
+static void supp_expand(const char* path, uint64_t name) {
+
+  struct supp_module* done = supp_module_slot(supp_expanded, name);
+  size_t              i, j, first, count = supp_intervals_count;
+
+  if (!done || (done->name && done->globs == supp_globs_count)) return;
+  done->name = name ? name : 1;
+  first = done->globs;
+  done->globs = supp_globs_count;
+
+  if (path[0] != '/') return;
+  struct elf_symbols* es = elf_symbols_get(path);
+  if (!es) return;
+
+  // frame_module gives ELF vaddrs, the symbol values are used as they are
+  for (i = 0; i < es->count; ++i)
+    for (j = first; j < supp_globs_count; ++j)
+      if (supp_glob_match(supp_globs[j].pattern, es->syms[i].name))
+        supp_interval_add(name, es->syms[i].value,
+                          es->syms[i].value +
+                              (es->syms[i].size ? es->syms[i].size : 1),
+                          supp_globs[j].errors);
+
+  if (supp_intervals_count != count) supp_interval_sort();
+
+}
+
+static uint32_t supp_parse_errors(const char* type, size_t len) {
+
+  uint32_t i;
+
+  if (len == 1 && *type == '*') return ~0u;
+
+  for (i = 0; i < sizeof(error_type_str) / sizeof(error_type_str[0]); ++i)
+    if (strlen(error_type_str[i]) == len &&
+        !strncmp(error_type_str[i], type, len))
+      return 1u << i;
+
+  return 0;
+
+}
+
+static int supp_add(const char* rule) {
+
+  const char* what = strchr(rule, ':');
+  uint32_t    errors = supp_parse_errors(rule, what ? (size_t)(what - rule)
+                                                    : strlen(rule));
+  char        name[SYMBOL_NAME_MAX];
+
+  if (!errors) return 0;
+
+  if (!what) {
+
+    supp_errors |= errors;
+    ++supp_rules;
+    return 1;
+
+  }
+
+  ++what;
+  if (!strncmp(what, "fun:", 4)) {
+
+    size_t len = strlen(what + 4);
+    if (!len || supp_globs_count == SUPP_GLOBS) return 0;
+
+    char* pattern = internal_alloc(len + 1);
+    memcpy(pattern, what + 4, len + 1);
+    supp_globs[supp_globs_count].errors = errors;
+    supp_globs[supp_globs_count++].pattern = pattern;
+    ++supp_rules;
+    return 1;
+
+  }
+
+  const char* plus = strchr(what, '+');
+  size_t      len = plus ? (size_t)(plus - what) : strlen(what);
+  if (!len || len >= sizeof(name)) return 0;
+  memcpy(name, what, len);
+  name[len] = 0;
+
+  uint64_t h = fnv_str(0xcbf29ce484222325ULL, name);
+
+  if (!plus) {
+
+    struct supp_module* m = supp_module_slot(supp_modules, h);
+    if (!m) return 0;
+    m->name = h ? h : 1;
+    m->errors |= errors;
+    ++supp_rules;
+    return 1;
+
+  }
+
+  char*    end;
+  uint64_t lo = strtoull(plus + 1, &end, 16);
+  uint64_t hi = lo + 1;
+  if (end == plus + 1) return 0;
+  if (*end == '-') {
+
+    const char* p = end + 1;
+    hi = strtoull(p, &end, 16);
+    if (end == p || hi <= lo) return 0;
+
+  }
+
+  if (*end) return 0;
+
+  supp_interval_add(h, lo, hi, errors);
+  supp_interval_sort();
+  ++supp_rules;
+  return 1;
+
+}
+
+// suppressed runs while the report is owned, so the rules change under it
+int asan_giovese_add_suppression(const char* rule) {
+
+  int added;
+
+  report_begin();
+  added = supp_add(rule);
+  report_end();
+  return added;
+
+}
+
+int asan_giovese_load_suppressions(const char* path) {
+
+  char  line[1024];
+  int   count = 0;
+  FILE* f = fopen(path, "r");
+  if (!f) return -1;
+
+  while (fgets(line, sizeof(line), f)) {
+
+    char*  p = line;
+    size_t len;
+    while (*p == ' ' || *p == '\t')
+      ++p;
+    len = strlen(p);
+    while (len && (p[len - 1] == '\n' || p[len - 1] == '\r' ||
+                   p[len - 1] == ' ' || p[len - 1] == '\t'))
+      p[--len] = 0;
+
+    if (!*p || *p == '#') continue;
+    count += asan_giovese_add_suppression(p);
+
+  }
+
+  fclose(f);
+  return count;
+
+}
+
+// 1 if an error of the type with the stack of ctx is suppressed
+static int suppressed(int error, struct call_context* ctx) {
+
+  target_ulong frames[MAX_CONTEXT_FRAMES];
+  char         path[PATH_MAX];
+  uint32_t     bit = 1u << error;
+  size_t       n, i;
+
+  if (!supp_rules) return 0;
+  if (supp_errors & bit) goto hit;
+
+  n = context_frames(ctx, frames, MAX_CONTEXT_FRAMES);
+  for (i = 0; i < n; ++i) {
+
+    target_ulong offset;
+    const char*  mod = frame_module(frames[i], path, sizeof(path), &offset);
+    if (!mod) continue;
+
+    uint64_t            name = fnv_str(0xcbf29ce484222325ULL, mod);
+    struct supp_module* m = supp_module_slot(supp_modules, name);
+    if (m && m->name && (m->errors & bit)) goto hit;
+
+    if (supp_globs_count) supp_expand(path, name);
+
+    if (supp_interval_errors(name, offset) & bit) goto hit;
+
+  }
+
+  return 0;
+
+hit:
+  __atomic_add_fetch(&supp_hits, 1, __ATOMIC_RELAXED);
+  return 1;
+
+}
+
+
+// ------------------------------------------------------------------------- //
+// Rate limiting
+// ------------------------------------------------------------------------- //
+
+// In continue mode the reports of each site (pc) and of the whole process go
+// through token buckets, an error over the limit is dropped before it is even
+// classified. A bucket is one word, the time of the last refill in ms and the
+// tokens left, updated with a CAS.
+
+#define RATE_SITES 4096
+#define RATE_PROBES 16  // a miss means the table is full
+#define RATE_TOKENS_BITS 24
+#define RATE_TOKENS_MAX ((1u << RATE_TOKENS_BITS) - 1)
+
+struct rate_site {
+
+  target_ulong pc;
+  uint64_t     bucket;
+
+};
+
+static uint32_t         rate_site_rate, rate_site_burst;
+static uint32_t         rate_global_rate, rate_global_burst;
+static uint64_t         rate_global_bucket;
+static struct rate_site rate_sites[RATE_SITES];
+static uint64_t         rate_site_dropped, rate_global_dropped;
+
+// a burst of 0 is one second of reports, at least one
+static uint32_t rate_burst(uint32_t rate, uint32_t burst) {
+
+  if (!burst) burst = rate ? rate : 1;
+  return burst < RATE_TOKENS_MAX ? burst : RATE_TOKENS_MAX;
+
+}
+
+void asan_giovese_set_rate_limit(uint32_t site_rate, uint32_t site_burst,
+                                 uint32_t global_rate, uint32_t global_burst) {
+
+  rate_site_rate = site_rate;
+  rate_site_burst = rate_burst(site_rate, site_burst);
+  rate_global_rate = global_rate;
+  rate_global_burst = rate_burst(global_rate, global_burst);
+
+}
+
+void asan_giovese_rate_dropped(uint64_t* site, uint64_t* global) {
+
+  if (site) *site = __atomic_load_n(&rate_site_dropped, __ATOMIC_RELAXED);
+  if (global) *global = __atomic_load_n(&rate_global_dropped, __ATOMIC_RELAXED);
+
+}
+
+static uint64_t rate_now_ms(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+}
+
+// take a token, 0 if the bucket is empty
+static int rate_take(uint64_t* bucket, uint32_t rate, uint32_t burst,
+                     uint64_t now) {
+
+  uint64_t old = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+  uint64_t next;
+
+  do {
+
+    uint64_t last = old >> RATE_TOKENS_BITS;
+    uint64_t tokens = old & RATE_TOKENS_MAX;
+
+    if (!last) {
+
+      last = now;
+      tokens = burst;
+
+    } else if (now > last) {
+
+      // keep the fraction of a token that is not refilled yet
+      uint64_t refill = (now - last) * rate / 1000;
+      tokens += refill;
+      last += refill * 1000 / rate;
+      if (tokens >= burst) {
+
+        tokens = burst;
+        last = now;
+
+      }
+
+    }
+
+    if (!tokens) return 0;
+    next = (last << RATE_TOKENS_BITS) | (tokens - 1);
+
+  } while (!__atomic_compare_exchange_n(bucket, &old, next, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  return 1;
+
+}
+
+// give back a token taken by rate_take
+static void rate_refund(uint64_t* bucket, uint32_t burst) {
+
+  uint64_t old = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+  uint64_t next;
+
+  do {
+
+    if ((old & RATE_TOKENS_MAX) >= burst) return;
+    next = old + 1;
+
+  } while (!__atomic_compare_exchange_n(bucket, &old, next, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+}
+
+static struct rate_site* rate_site_get(target_ulong pc) {
+
+  uint32_t h = (uint32_t)(((uint64_t)pc * 0x9E3779B97F4A7C15ULL) >> 40);
+  uint32_t i;
+
+  for (i = 0; i < RATE_PROBES; ++i) {
+
+    struct rate_site* site = &rate_sites[(h + i) % RATE_SITES];
+    target_ulong      cur = __atomic_load_n(&site->pc, __ATOMIC_ACQUIRE);
+
+    if (cur == 0 &&
+        __atomic_compare_exchange_n(&site->pc, &cur, pc, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+      cur = pc;
+
+    if (cur == pc) return site;
+
+  }
+
+  return NULL;  // full, only the global limit applies
+
+}
+
+// 1 if an error at pc can be reported
+static int rate_allow(target_ulong pc) {
+
+  struct rate_site* site = NULL;
+  uint64_t          now;
+
+  if (!dedup_enabled || (!rate_site_rate && !rate_global_rate)) return 1;
+  now = rate_now_ms();
+
+  if (rate_site_rate) {
+
+    site = rate_site_get(pc);
+    if (site &&
+        !rate_take(&site->bucket, rate_site_rate, rate_site_burst, now)) {
+
+      __atomic_add_fetch(&rate_site_dropped, 1, __ATOMIC_RELAXED);
+      return 0;
+
+    }
+
+  }
+
+  if (rate_global_rate && !rate_take(&rate_global_bucket, rate_global_rate,
+                                     rate_global_burst, now)) {
+
+    // the report is not made, the site keeps its token
+    if (site) rate_refund(&site->bucket, rate_site_burst);
+    __atomic_add_fetch(&rate_global_dropped, 1, __ATOMIC_RELAXED);
+    return 0;
+
+  }
+
+  return 1;
+
+}
+
+// ------------------------------------------------------------------------- //
+// Report
+// ------------------------------------------------------------------------- //
+
+// from https://gist.github.com/RabaDabaDoba/145049536f815903c79944599c6f952a
+
+// Regular text
+#define ANSI_COLOR_BLK "\e[0;30m"
+#define ANSI_COLOR_RED "\e[0;31m"
+#define ANSI_COLOR_GRN "\e[0;32m"
+#define ANSI_COLOR_YEL "\e[0;33m"
+#define ANSI_COLOR_BLU "\e[0;34m"
+#define ANSI_COLOR_MAG "\e[0;35m"
+#define ANSI_COLOR_CYN "\e[0;36m"
+#define ANSI_COLOR_WHT "\e[0;37m"
+
+// High intensty text
+#define ANSI_COLOR_HBLK "\e[0;90m"
+#define ANSI_COLOR_HRED "\e[0;91m"
+#define ANSI_COLOR_HGRN "\e[0;92m"
+#define ANSI_COLOR_HYEL "\e[0;93m"
+#define ANSI_COLOR_HBLU "\e[0;94m"
+#define ANSI_COLOR_HMAG "\e[0;95m"
+#define ANSI_COLOR_HCYN "\e[0;96m"
+#define ANSI_COLOR_HWHT "\e[0;97m"
+
+// Reset
+#define ANSI_COLOR_RESET "\e[0m"
+
+static const char* shadow_color_map[] = {
+
+    "" /* 0x0 */,
+    "" /* 0x1 */,
+    "" /* 0x2 */,
+    "" /* 0x3 */,
+    "" /* 0x4 */,
+    "" /* 0x5 */,
+    "" /* 0x6 */,
+    "" /* 0x7 */,
+    "" /* 0x8 */,
+    "" /* 0x9 */,
+    "" /* 0xa */,
+    "" /* 0xb */,
+    "" /* 0xc */,
+    "" /* 0xd */,
+    "" /* 0xe */,
+    "" /* 0xf */,
+    "" /* 0x10 */,
+    "" /* 0x11 */,
+    "" /* 0x12 */,
+    "" /* 0x13 */,
+    "" /* 0x14 */,
+    "" /* 0x15 */,
+    "" /* 0x16 */,
+    "" /* 0x17 */,
+    "" /* 0x18 */,
+    "" /* 0x19 */,
+    "" /* 0x1a */,
+    "" /* 0x1b */,
+    "" /* 0x1c */,
+    "" /* 0x1d */,
+    "" /* 0x1e */,
+    "" /* 0x1f */,
     "" /* 0x20 */,
     "" /* 0x21 */,
     "" /* 0x22 */,
@@ -821,665 +5956,1840 @@ static const char* shadow_color_map[] = {
     ANSI_COLOR_HYEL /* 0xfe */,
     ""                                                              /* 0xff */
 
-};
+};
+
+static const char* access_type_str[] = {"READ", "WRITE"};
+
+static int poisoned_error(uint8_t poison_byte) {
+
+  switch (poison_byte) {
+
+    case ASAN_HEAP_RZ:
+    case ASAN_HEAP_LEFT_RZ:
+    case ASAN_HEAP_RIGHT_RZ: return ASAN_ERROR_HEAP_BUFFER_OVERFLOW;
+    case ASAN_HEAP_FREED: return ASAN_ERROR_HEAP_USE_AFTER_FREE;
+
+  }
+
+  return ASAN_ERROR_USE_AFTER_POISON;
+
+}
+
+static int poisoned_find_error(target_ulong addr, size_t n,
+                               target_ulong* fault_addr, int* error) {
+
+  target_ulong start = addr;
+  target_ulong end = start + n;
+  int          have_partials = 0;
+
+  while (start < end) {
+
+    uintptr_t rs = (uintptr_t)g2h(start);
+    int8_t*   shadow_addr = (int8_t*)(rs >> 3) + SHADOW_OFFSET;
+    switch (*shadow_addr) {
+
+      case ASAN_VALID: have_partials = 0; break;
+      case ASAN_PARTIAL1:
+      case ASAN_PARTIAL2:
+      case ASAN_PARTIAL3:
+      case ASAN_PARTIAL4:
+      case ASAN_PARTIAL5:
+      case ASAN_PARTIAL6:
+      case ASAN_PARTIAL7: {
+
+        have_partials = 1;
+        target_ulong a = (start & ~7) + *shadow_addr;
+        if (*fault_addr == 0 && a >= start && a < end) *fault_addr = a;
+        break;
+
+      }
+
+      default: {
+
+        if (*fault_addr == 0) *fault_addr = start;
+        *error = poisoned_error(*shadow_addr);
+        return 1;
+
+      }
+
+    }
+
+    start += 8;
+
+  }
+
+  if (have_partials) {
+
+    uintptr_t rs = (uintptr_t)g2h((end & ~7) + 8);
+    uint8_t*  last_shadow_addr = (uint8_t*)(rs >> 3) + SHADOW_OFFSET;
+    *error = poisoned_error(*last_shadow_addr);
+    return 1;
+
+  }
+
+  if (*fault_addr == 0) *fault_addr = addr;
+  *error = ASAN_ERROR_USE_AFTER_POISON;
+  return 1;
+
+}
+
+// Reports are rendered in one preallocated buffer and written with a single
+// write(), under a lock so that reports of different threads never mix. The
+// path is async-signal-safe: no stdio, no malloc and no blocking lock that the
+// interrupted code may hold. A fault raised while the thread is reporting
+// writes out what was rendered so far and aborts instead of recursing.
+
+#define REPORT_BUF_SIZE (256 * 1024)
+
+static char            report_buf[REPORT_BUF_SIZE];
+static size_t          report_len;
+static int             report_colors = 1;
+static uint32_t        report_owner;  // tid of the reporting thread, 0 if none
+
+void asan_giovese_set_colors(int enabled) {
+
+  report_colors = enabled;
+
+}
+
+static void report_flush(void) {
+
+  write_all(STDERR_FILENO, report_buf, report_len);
+  report_len = 0;
+
+}
+
+// drop the ANSI escapes from the last n bytes of the buffer
+static void report_strip_colors(size_t n) {
+
+  char*  p = &report_buf[report_len - n];
+  size_t i, j = 0;
+
+  for (i = 0; i < n; ++i) {
+
+    if (p[i] == '\e') {
+
+      while (i < n && p[i] != 'm')
+        ++i;
+      continue;
+
+    }
+
+    p[j++] = p[i];
+
+  }
+
+  report_len -= n - j;
+
+}
+
+static void report_printf(const char* fmt, ...) {
+
+  va_list ap;
+  int     n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(&report_buf[report_len], REPORT_BUF_SIZE - report_len, fmt, ap);
+  va_end(ap);
+
+  if (n >= 0 && (size_t)n >= REPORT_BUF_SIZE - report_len && report_len) {
+
+    // does not fit, write out what we have
+    report_flush();
+    va_start(ap, fmt);
+    n = vsnprintf(report_buf, REPORT_BUF_SIZE, fmt, ap);
+    va_end(ap);
+
+  }
+
+  if (n < 0) return;
+  if ((size_t)n >= REPORT_BUF_SIZE - report_len)
+    n = REPORT_BUF_SIZE - report_len - 1;
+  report_len += n;
+  if (!report_colors) report_strip_colors(n);
+
+}
+
+__attribute__((noreturn)) static void report_abort(void) {
+
+  report_flush();
+  signal(SIGABRT, SIG_DFL);
+  abort();
+
+}
+
+static void report_begin(void) {
+
+  uint32_t tid = current_tid();
+  uint32_t none = 0;
+
+  if (report_active) {
+
+    report_printf("\n" ASAN_NAME_STR ": nested error while reporting, "
+                  "aborting\n");
+    report_abort();
+
+  }
+
+  report_active = 1;
+  while (!__atomic_compare_exchange_n(&report_owner, &none, tid, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+
+    none = 0;
+    sched_yield();
+
+  }
+
+}
+
+static void report_end(void) {
+
+  report_flush();
+  __atomic_store_n(&report_owner, 0, __ATOMIC_RELEASE);
+  report_active = 0;
+
+}
+
+// a bucket already reported by this or another process, only say so
+static int report_known(uint64_t bucket) {
+
+  if (record_fd < 0)
+    report_printf("==%d==ERROR: " ASAN_NAME_STR ": known bucket %016" PRIx64
+                  ", report skipped\n",
+                  getpid(), bucket);
+  return 1;
+
+}
+
+// end of an error report, aborts unless in continue mode
+static int report_done(void) {
+
+  if (!dedup_enabled) {
+
+    if (record_fd < 0) report_printf("==%d==ABORTING\n", getpid());
+    report_abort();
+
+  }
+
+  if (record_fd < 0) report_printf("==%d==CONTINUING\n", getpid());
+  report_end();
+  return 1;
+
+}
+
+// Raw reports leave the frames as addresses and end with a snapshot of the
+// guest modules and of the host mappings, so that asan-giovese-symbolize can
+// symbolize them offline.
+
+static int report_raw;
+
+void asan_giovese_set_raw_reports(int enabled) {
+
+  report_raw = enabled;
+
+}
+
+static const char* report_printaddr(target_ulong addr) {
+
+  return report_raw ? NULL : asan_giovese_printaddr(addr);
+
+}
+
+static void report_modules(void) {
+
+  size_t i;
+
+  if (!report_raw) return;
+
+  report_printf("==%d==MODULES guest_base 0x%" PRIxPTR "\n", getpid(),
+                (uintptr_t)g2h(0));
+
+  __atomic_add_fetch(&guest_modules_readers, 1, __ATOMIC_SEQ_CST);
+
+  struct guest_modules* mods =
+      __atomic_load_n(&guest_modules, __ATOMIC_SEQ_CST);
+  for (i = 0; mods && i < mods->count; ++i)
+    report_printf("0x%" PRIxPTR " 0x%" PRIxPTR " 0x%" PRIxPTR " %s\n",
+                  (uintptr_t)mods->mods[i]->base, (uintptr_t)mods->mods[i]->end,
+                  (uintptr_t)mods->mods[i]->load_bias, mods->mods[i]->path);
+
+  __atomic_sub_fetch(&guest_modules_readers, 1, __ATOMIC_RELEASE);
+
+  report_printf("==%d==MAPS\n", getpid());
+
+  // read straight in the report buffer
+  int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  while (fd >= 0) {
+
+    if (REPORT_BUF_SIZE - report_len < 4096) report_flush();
+    ssize_t r = read(fd, &report_buf[report_len], REPORT_BUF_SIZE - report_len);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    report_len += r;
+
+  }
+
+  if (fd >= 0) close(fd);
+  report_printf("==%d==END\n", getpid());
+
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static void report_hex(uint64_t v, int width) {
+
+  char* p = &report_buf[report_len];
+  int   i;
+  for (i = width - 1; i >= 0; --i) {
+
+    p[i] = hex_digits[v & 0xf];
+    v >>= 4;
+
+  }
+
+  report_len += width;
+
+}
+
+// one line of 16 shadow bytes, the byte of fault_addr (if any) is bracketed
+static void print_shadow_line(target_ulong addr, target_ulong fault_addr,
+                              int has_fault) {
+
+  uint8_t* shadow = (uint8_t*)((uintptr_t)g2h(addr) >> 3) + SHADOW_OFFSET;
+  int      fault = has_fault ? (int)((fault_addr - addr) / 8) : -1;
+  int      i;
+
+  // 16 bytes, each at most separator + color + 2 digits + reset
+  if (REPORT_BUF_SIZE - report_len < 64 + 16 * 24) report_flush();
+
+  memcpy(&report_buf[report_len], has_fault ? "=>0x" : "  0x", 4);
+  report_len += 4;
+  report_hex((uintptr_t)shadow, 12);
+  report_buf[report_len++] = ':';
+
+  for (i = 0; i < 16; ++i) {
+
+    uint8_t     b = shadow[i];
+    const char* color = report_colors ? shadow_color_map[b] : "";
+    size_t      color_len = strlen(color);
+
+    if (i == fault)
+      report_buf[report_len++] = '[';
+    else if (fault >= 0 && i == fault + 1)
+      report_buf[report_len++] = ']';
+    else
+      report_buf[report_len++] = ' ';
+    memcpy(&report_buf[report_len], color, color_len);
+    report_len += color_len;
+    report_hex(b, 2);
+    if (color_len) {
+
+      memcpy(&report_buf[report_len], ANSI_COLOR_RESET,
+             sizeof(ANSI_COLOR_RESET) - 1);
+      report_len += sizeof(ANSI_COLOR_RESET) - 1;
+
+    }
+
+  }
+
+  if (fault == 15) report_buf[report_len++] = ']';
+  report_buf[report_len++] = '\n';
+
+}
+
+static void print_shadow(target_ulong addr) {
+
+  target_ulong center = addr & ~127;
+  int          i;
+
+  for (i = -5; i <= 5; ++i)
+    print_shadow_line(center + i * 16 * 8, addr, i == 0);
+
+}
+
+static void print_context(struct call_context* ctx) {
+
+  target_ulong frames[MAX_CONTEXT_FRAMES];
+  size_t       n = context_frames(ctx, frames, MAX_CONTEXT_FRAMES);
+  size_t       i;
+
+  for (i = 0; i < n; ++i) {
+
+    const char* printable = report_printaddr(frames[i]);
+    if (printable)
+      report_printf("    #%lu 0x%012" PRIxPTR "%s\n", i, frames[i], printable);
+    else
+      report_printf("    #%lu 0x%012" PRIxPTR "\n", i, frames[i]);
+
+  }
+
+  if (ctx->flags & ASAN_CTX_SAMPLED)
+    report_printf("    (stack sampled out, only the pc was recorded)\n");
+
+  report_printf("\n");
+
+}
+
+static void print_alloc_location_chunk(struct chunk_info* ckinfo,
+                                       target_ulong       fault_addr) {
+
+  if (fault_addr >= ckinfo->start && fault_addr < ckinfo->end)
+    report_printf(
+        ANSI_COLOR_HGRN
+        "0x%012" PRIxPTR
+        " is located %ld bytes inside of %ld-byte region [0x%012" PRIxPTR
+        ",0x%012" PRIxPTR ")" ANSI_COLOR_RESET "\n",
+        fault_addr, fault_addr - ckinfo->start, ckinfo->end - ckinfo->start,
+        ckinfo->start, ckinfo->end);
+  else if (ckinfo->start >= fault_addr)
+    report_printf(
+        ANSI_COLOR_HGRN
+        "0x%012" PRIxPTR
+        " is located %ld bytes to the left of %ld-byte region [0x%012" PRIxPTR
+        ",0x%012" PRIxPTR ")" ANSI_COLOR_RESET "\n",
+        fault_addr, ckinfo->start - fault_addr, ckinfo->end - ckinfo->start,
+        ckinfo->start, ckinfo->end);
+  else
+    report_printf(
+        ANSI_COLOR_HGRN
+        "0x%012" PRIxPTR
+        " is located %ld bytes to the right of %ld-byte region [0x%012" PRIxPTR
+        ",0x%012" PRIxPTR ")" ANSI_COLOR_RESET "\n",
+        fault_addr, fault_addr - ckinfo->end, ckinfo->end - ckinfo->start,
+        ckinfo->start, ckinfo->end);
+
+  if (ckinfo->free_ctx) {
+
+    report_printf(
+        ANSI_COLOR_HMAG "freed by thread T%d here:" ANSI_COLOR_RESET "\n",
+        ckinfo->free_ctx->tid);
+    print_context(ckinfo->free_ctx);
+
+    report_printf(
+        ANSI_COLOR_HMAG
+        "previously allocated by thread T%d here:" ANSI_COLOR_RESET "\n",
+        ckinfo->free_ctx->tid);
+
+  } else
+
+    report_printf(
+        ANSI_COLOR_HMAG "allocated by thread T%d here:" ANSI_COLOR_RESET
+        "\n",
+        ckinfo->alloc_ctx->tid);
+
+  print_context(ckinfo->alloc_ctx);
+
+}
+
+static void print_alloc_location(target_ulong addr, target_ulong fault_addr) {
+
+  struct chunk_info* ckinfo;
+
+  if (!alloc_lock_all()) {
+
+    report_printf("Address 0x%012" PRIxPTR " has no chunk information.\n",
+                  fault_addr);
+    return;
+
+  }
+
+  ckinfo = alloc_search_near(addr, fault_addr);
+  if (ckinfo)
+    print_alloc_location_chunk(ckinfo, fault_addr);
+  else
+    report_printf("Address 0x%012" PRIxPTR " is a wild pointer.\n",
+                  fault_addr);
+
+  alloc_unlock_all();
+
+}
+
+int asan_giovese_report_and_crash(int access_type, target_ulong addr, size_t n,
+                                  target_ulong pc, target_ulong bp,
+                                  target_ulong sp) {
+
+  struct call_context ctx = {0};
+  target_ulong        fault_addr = 0;
+  int                 error;
+
+  if (!rate_allow(pc)) return 1;
+  if (!poisoned_find_error(addr, n, &fault_addr, &error)) return 0;
+
+  report_begin();
+  if (!dedup_check(error, pc, NULL)) {
+
+    report_end();
+    return 1;
+
+  }
+
+  asan_giovese_populate_context(&ctx, pc);
+
+  if (suppressed(error, &ctx)) {
+
+    report_end();
+    return 0;
+
+  }
+
+  if (!dedup_check(error, pc, &ctx)) {
+
+    report_end();
+    return 1;
+
+  }
+
+  stats_report(error);
+  uint64_t bucket = asan_giovese_bucket_hash(error, access_type, &ctx);
+  if (bucket_store_seen(bucket)) {
+
+    report_known(bucket);
+    return report_done();
+
+  }
+
+  if (record_fd >= 0) {
+
+    struct asan_giovese_record r = {0};
+    r.error = error;
+    r.access_type = access_type;
+    r.access_size = n;
+    r.addr = addr;
+    r.fault_addr = fault_addr;
+    r.pc = pc;
+    r.bp = bp;
+    r.sp = sp;
+    record_write(&r, &ctx);
+    return report_done();
+
+  }
+
+  const char* error_type = error_type_str[error];
+
+  report_printf(
+      "================================================================="
+      "\n" ANSI_COLOR_HRED "==%d==ERROR: " ASAN_NAME_STR
+      ": %s on address 0x%012" PRIxPTR " at pc 0x%012" PRIxPTR
+      " bp 0x%012" PRIxPTR " sp 0x%012" PRIxPTR ANSI_COLOR_RESET "\n",
+      getpid(), error_type, addr, pc, bp, sp);
+
+  report_printf(
+      ANSI_COLOR_HBLU "%s of size %lu at 0x%012" PRIxPTR
+      " thread T%d" ANSI_COLOR_RESET "\n",
+      access_type_str[access_type], n, addr, ctx.tid);
+  print_context(&ctx);
+
+  print_alloc_location(addr, fault_addr);
+
+  const char* printable_pc = report_printaddr(pc);
+  if (!printable_pc) printable_pc = "";
+  report_printf(
+      "SUMMARY: " ASAN_NAME_STR
+      ": %s%s\n"
+      "BUCKET: %016" PRIx64 "\n"
+      "Shadow bytes around the buggy address:\n",
+      error_type, printable_pc, bucket);
+
+  print_shadow(fault_addr);
+
+  report_printf(
+      "Shadow byte legend (one shadow byte represents 8 application bytes):\n"
+      "  Addressable:           00\n"
+      "  Partially addressable: 01 02 03 04 05 06 07\n"
+      "  Heap left redzone:       " ANSI_COLOR_HRED "fa" ANSI_COLOR_RESET "\n"
+      "  Heap right redzone:      " ANSI_COLOR_HRED "fb" ANSI_COLOR_RESET "\n"
+      "  Freed heap region:       " ANSI_COLOR_HMAG "fd" ANSI_COLOR_RESET "\n"
+      //"  Stack left redzone:      " ANSI_COLOR_HRED "f1" ANSI_COLOR_RESET "\n"
+      //"  Stack mid redzone:       " ANSI_COLOR_HRED "f2" ANSI_COLOR_RESET "\n"
+      //"  Stack right redzone:     " ANSI_COLOR_HRED "f3" ANSI_COLOR_RESET "\n"
+      //"  Stack after return:      " ANSI_COLOR_HMAG "f5" ANSI_COLOR_RESET "\n"
+      //"  Stack use after scope:   " ANSI_COLOR_HMAG "f8" ANSI_COLOR_RESET "\n"
+      //"  Global redzone:          " ANSI_COLOR_HRED "f9" ANSI_COLOR_RESET "\n"
+      //"  Global init order:       " ANSI_COLOR_HCYN "f6" ANSI_COLOR_RESET "\n"
+      "  Poisoned by user:        " ANSI_COLOR_HBLU "f7" ANSI_COLOR_RESET "\n"
+      //"  Container overflow:      " ANSI_COLOR_HBLU "fc" ANSI_COLOR_RESET "\n"
+      //"  Array cookie:            " ANSI_COLOR_HRED "ac" ANSI_COLOR_RESET "\n"
+      //"  Intra object redzone:    " ANSI_COLOR_HYEL "bb" ANSI_COLOR_RESET "\n"
+      "  ASan internal:           " ANSI_COLOR_HYEL "fe" ANSI_COLOR_RESET "\n"
+      //"  Left alloca redzone:     " ANSI_COLOR_HBLU "ca" ANSI_COLOR_RESET "\n"
+      //"  Right alloca redzone:    " ANSI_COLOR_HBLU "cb" ANSI_COLOR_RESET "\n"
+      "  Shadow gap:              cc\n");
+
+  report_modules();
+  return report_done();
+
+}
+
+static const char* singal_to_string[] = {
+    [SIGHUP] = "HUP",
+    [SIGINT] = "INT",
+    [SIGQUIT] = "QUIT",
+    [SIGILL] = "ILL",
+    [SIGTRAP] = "TRAP",
+    [SIGABRT] = "ABRT",
+    [SIGBUS] = "BUS",
+    [SIGFPE] = "FPE",
+    [SIGKILL] = "KILL",
+    [SIGUSR1] = "USR1",
+    [SIGSEGV] = "SEGV",
+    [SIGUSR2] = "USR2",
+    [SIGPIPE] = "PIPE",
+    [SIGALRM] = "ALRM",
+    [SIGTERM] = "TERM",
+#ifdef SIGSTKFLT
+    [SIGSTKFLT] = "STKFLT",
+#endif
+    [SIGCHLD] = "CHLD",
+    [SIGCONT] = "CONT",
+    [SIGSTOP] = "STOP",
+    [SIGTSTP] = "TSTP",
+    [SIGTTIN] = "TTIN",
+    [SIGTTOU] = "TTOU",
+    [SIGURG] = "URG",
+    [SIGXCPU] = "XCPU",
+    [SIGXFSZ] = "XFSZ",
+    [SIGVTALRM] = "VTALRM",
+    [SIGPROF] = "PROF",
+    [SIGWINCH] = "WINCH",
+    [SIGIO] = "IO",
+    [SIGPWR] = "PWR",
+    [SIGSYS] = "SYS",
+};
+
+int asan_giovese_deadly_signal(int signum, target_ulong addr, target_ulong pc, target_ulong bp, target_ulong sp) {
+
+  struct call_context ctx = {0};
+  const char*         error_type = singal_to_string[signum];
+  int                 error = ASAN_ERROR_DEADLY_SIGNAL;
+
+  if (signum == SIGSEGV || signum == SIGBUS) error = heap_guard_error(addr);
+
+  report_begin();
+
+  // a guard page fault is a heap error, suppressed and deduplicated as one
+  if (error != ASAN_ERROR_DEADLY_SIGNAL && !dedup_check(error, pc, NULL)) {
+
+    report_end();
+    return 0;
+
+  }
+
+  asan_giovese_populate_context(&ctx, pc);
+
+  if (error != ASAN_ERROR_DEADLY_SIGNAL &&
+      (suppressed(error, &ctx) || !dedup_check(error, pc, &ctx))) {
+
+    report_end();
+    return 0;
+
+  }
+
+  stats_report(error);
+  uint64_t bucket = asan_giovese_bucket_hash(error, signum, &ctx);
+  if (bucket_store_seen(bucket)) {
+
+    report_known(bucket);
+    report_end();
+    return signum;
+
+  }
+
+  if (record_fd >= 0) {
+
+    struct asan_giovese_record r = {0};
+    r.error = error;
+    r.signum = signum;
+    r.addr = r.fault_addr = addr;
+    r.pc = pc;
+    r.bp = bp;
+    r.sp = sp;
+    record_write(&r, &ctx);
+    report_end();
+    return signum;
+
+  }
+
+  if (error != ASAN_ERROR_DEADLY_SIGNAL) {
+
+    // a fault on the pages of a guard page mode chunk
+    error_type = error_type_str[error];
+    report_printf(
+        "================================================================="
+        "\n" ANSI_COLOR_HRED "==%d==ERROR: " ASAN_NAME_STR
+        ": %s on address 0x%012" PRIxPTR " (SIG%s on a protected page, pc "
+        "0x%012" PRIxPTR " bp 0x%012" PRIxPTR " sp 0x%012" PRIxPTR
+        " T%d)" ANSI_COLOR_RESET "\n",
+        getpid(), error_type, addr, singal_to_string[signum], pc, bp, sp,
+        ctx.tid);
+
+    print_context(&ctx);
+    print_alloc_location(addr, addr);
+
+  } else {
+
+    report_printf(
+        ASAN_NAME_STR ":DEADLYSIGNAL\n"
+        "================================================================="
+        "\n" ANSI_COLOR_HRED "==%d==ERROR: " ASAN_NAME_STR
+        ": %s on unknown address 0x%012" PRIxPTR " (pc 0x%012" PRIxPTR
+        " bp 0x%012" PRIxPTR " sp 0x%012" PRIxPTR " T%d)" ANSI_COLOR_RESET
+        "\n",
+        getpid(), error_type, addr, pc, bp, sp, ctx.tid);
+
+    print_context(&ctx);
+    report_printf(ASAN_NAME_STR " can not provide additional info.\n");
+
+  }
+
+  const char* printable_pc = report_printaddr(pc);
+  if (!printable_pc) printable_pc = "";
+  report_printf(
+      "SUMMARY: " ASAN_NAME_STR
+      ": %s%s\n", error != ASAN_ERROR_DEADLY_SIGNAL ? error_type : "",
+      printable_pc);
+  report_printf("BUCKET: %016" PRIx64 "\n", bucket);
+
+  report_modules();
+  report_printf("==%d==ABORTING\n", getpid());
+  report_end();
+  return signum;
+
+}
+
+int asan_giovese_badfree(target_ulong addr, target_ulong pc) {
+
+  struct call_context ctx = {0};
+
+  if (!rate_allow(pc)) return 1;
+
+  report_begin();
+  if (!dedup_check(ASAN_ERROR_BAD_FREE, pc, NULL)) {
+
+    report_end();
+    return 1;
+
+  }
+
+  asan_giovese_populate_context(&ctx, pc);
+
+  if (suppressed(ASAN_ERROR_BAD_FREE, &ctx)) {
+
+    report_end();
+    return 0;
+
+  }
+
+  if (!dedup_check(ASAN_ERROR_BAD_FREE, pc, &ctx)) {
+
+    report_end();
+    return 1;
+
+  }
+
+  stats_report(ASAN_ERROR_BAD_FREE);
+  uint64_t bucket = asan_giovese_bucket_hash(ASAN_ERROR_BAD_FREE, 0, &ctx);
+  if (bucket_store_seen(bucket)) {
+
+    report_known(bucket);
+    return report_done();
+
+  }
+
+  if (record_fd >= 0) {
+
+    struct asan_giovese_record r = {0};
+    r.error = ASAN_ERROR_BAD_FREE;
+    r.addr = r.fault_addr = addr;
+    r.pc = pc;
+    record_write(&r, &ctx);
+    return report_done();
+
+  }
+
+  report_printf(
+      "================================================================="
+      "\n" ANSI_COLOR_HRED "==%d==ERROR: " ASAN_NAME_STR
+      ": attempting free on address which was not malloc()-ed: 0x%012"
+      PRIxPTR " in thread T%d" ANSI_COLOR_RESET "\n", getpid(), addr,
+      ctx.tid);
+
+  print_context(&ctx);
+  print_alloc_location(addr, addr);
+  
+  const char* printable_pc = report_printaddr(pc);
+  if (!printable_pc) printable_pc = "";
+  report_printf(
+      "SUMMARY: " ASAN_NAME_STR
+      ": bad-free %s\n", printable_pc);
+  report_printf("BUCKET: %016" PRIx64 "\n", bucket);
+
+  report_modules();
+  return report_done();
+
+}
+
+static void dedup_summary(void) {
+
+  uint32_t total = 0, distinct = 0;
+  size_t   i;
+
+  report_begin();
+
+  for (i = 0; i < DEDUP_SLOTS; ++i) {
+
+    struct dedup_slot* slot = &dedup_slots[i];
+    if (!__atomic_load_n(&slot->key, __ATOMIC_ACQUIRE)) continue;
+
+    uint32_t count = __atomic_load_n(&slot->count, __ATOMIC_ACQUIRE);
+    if (!distinct++)
+      report_printf("==%d==Distinct errors:\n", getpid());
+    total += count;
+
+    const char* printable = report_printaddr(slot->pc);
+    report_printf("  %8u x %s at pc 0x%012" PRIxPTR "%s (stack %016" PRIx64
+                  ")\n",
+                  count, error_type_str[slot->error], (uintptr_t)slot->pc,
+                  printable ? printable : "", slot->stack_id);
+
+  }
+
+  uint32_t overflow = __atomic_load_n(&dedup_overflow, __ATOMIC_RELAXED);
+  report_printf("==%d==ERROR SUMMARY: %u errors, %u distinct, %u not "
+                "deduplicated\n",
+                getpid(), total + overflow, distinct, overflow);
+
+  uint64_t site_dropped, global_dropped;
+  asan_giovese_rate_dropped(&site_dropped, &global_dropped);
+  if (site_dropped || global_dropped)
+    report_printf("==%d==Rate limited: %" PRIu64 " reports dropped by the "
+                  "site limit, %" PRIu64 " by the global limit\n",
+                  getpid(), site_dropped, global_dropped);
+
+  report_end();
+
+}
+
+// the exit handler, defined below
+static void exit_handler_register(void);
+
+void asan_giovese_set_continue(int enabled, uint32_t top_frames) {
+
+  dedup_enabled = enabled;
+  dedup_frames = top_frames ? top_frames : DEDUP_FRAMES;
+  if (enabled) {
+
+    dedup_at_exit = 1;
+    exit_handler_register();
+
+  }
+
+}
+
+// ------------------------------------------------------------------------- //
+// Leaks
+// ------------------------------------------------------------------------- //
+
+// Mark pass like LeakSanitizer. The live chunks are copied sorted by address
+// while alloc_lock_all is held for the whole pass, then the roots are cut in
+// pieces that a pool of threads takes one at a time. Each word that points
+// into a chunk marks it reachable, the thread that marks a chunk scans it too.
+// The chunks left are scanned again to tell the indirect leaks, the ones
+// pointed by another leaked chunk, from the direct ones. The locks are
+// released once the leaks are grouped and their stacks copied, before the
+// report is printed.
+
+#define LEAK_TASK_BYTES (1 << 20)
+#define LEAK_MAX_THREADS 64
+#define LEAK_EXIT_CODE 23
+
+enum {
+
+  LEAK_UNREACHED,
+  LEAK_REACHABLE,
+  LEAK_INDIRECT,
+
+};
+
+struct leak_range {
+
+  target_ulong start;
+  target_ulong end;
+
+};
+
+struct leak_chunk {
+
+  target_ulong            start;
+  target_ulong            end;
+  struct alloc_tree_node* node;
+  uint32_t                state;
+
+};
+
+struct leak_group {
+
+  uint64_t             stack_id;
+  uint32_t             state;
+  size_t               bytes;
+  size_t               count;
+  struct leak_chunk*   chunk;  // first of the group, for the stack
+  struct call_context* ctx;  // copy of its stack, set once grouped
+
+};
+
+struct leak_stack {
+
+  struct leak_chunk** items;
+  size_t              count;
+  size_t              cap;
+
+};
+
+static struct leak_range* leak_roots;
+static size_t             leak_roots_count, leak_roots_cap;
+static pthread_mutex_t    leak_roots_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t           leak_threads;
+static int                leak_at_exit;
+
+// the pass in progress, one at a time under alloc_lock_all
+static struct leak_chunk* leak_chunks;
+static size_t             leak_chunks_count;
+static struct leak_range* leak_tasks;
+static size_t             leak_tasks_count;
+static size_t             leak_next;
+static int                leak_indirect_pass;
+
+void asan_giovese_leak_add_root(target_ulong start, size_t size) {
+
+  pthread_mutex_lock(&leak_roots_lock);
+
+  if (leak_roots_count == leak_roots_cap) {
+
+    leak_roots_cap = leak_roots_cap ? leak_roots_cap * 2 : 64;
+    leak_roots =
+        realloc(leak_roots, leak_roots_cap * sizeof(struct leak_range));
+
+  }
+
+  leak_roots[leak_roots_count].start = start;
+  leak_roots[leak_roots_count].end = start + size;
+  ++leak_roots_count;
+
+  pthread_mutex_unlock(&leak_roots_lock);
+
+}
+
+void asan_giovese_leak_remove_root(target_ulong start) {
+
+  size_t i;
+
+  pthread_mutex_lock(&leak_roots_lock);
+
+  for (i = 0; i < leak_roots_count; ++i) {
+
+    if (leak_roots[i].start != start) continue;
+    leak_roots[i] = leak_roots[--leak_roots_count];
+    break;
+
+  }
+
+  pthread_mutex_unlock(&leak_roots_lock);
+
+}
+
+static struct leak_chunk* leak_find(target_ulong p) {
+
+  size_t lo = 0, hi = leak_chunks_count;
+
+  while (lo < hi) {
+
+    size_t mid = lo + (hi - lo) / 2;
+    if (leak_chunks[mid].start <= p)
+      lo = mid + 1;
+    else
+      hi = mid;
+
+  }
+
+  if (!lo) return NULL;
+  struct leak_chunk* c = &leak_chunks[lo - 1];
+  return p < c->end || p == c->start ? c : NULL;
+
+}
+
+static void leak_push(struct leak_stack* st, struct leak_chunk* c) {
+
+  if (st->count == st->cap) {
+
+    st->cap = st->cap ? st->cap * 2 : 256;
+    st->items = realloc(st->items, st->cap * sizeof(struct leak_chunk*));
+
+  }
+
+  st->items[st->count++] = c;
+
+}
+
+// look for pointers to chunks in [lo, hi), the chunks found are marked
+// reachable and pushed on st, or marked indirect if st is NULL
+static void leak_scan(struct leak_stack* st, target_ulong lo, target_ulong hi,
+                      struct leak_chunk* self) {
+
+  const size_t word = sizeof(target_ulong);
+
+  for (lo = (lo + word - 1) & ~(target_ulong)(word - 1); lo + word <= hi;
+       lo += word) {
+
+    uintptr_t          h = (uintptr_t)g2h(lo);
+    struct leak_chunk* c = leak_find(*(target_ulong*)h);
+    uint32_t           expected = LEAK_UNREACHED;
+
+    if (!c || c == self) continue;
+
+    if (!st)
+      __atomic_compare_exchange_n(&c->state, &expected, LEAK_INDIRECT, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    else if (__atomic_compare_exchange_n(&c->state, &expected, LEAK_REACHABLE,
+                                         0, __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED))
+      leak_push(st, c);
+
+  }
+
+}
+
+static void* leak_worker(void* arg) {
+
+  struct leak_stack st = {0};
+  size_t            i;
+
+  (void)arg;
+
+  if (leak_indirect_pass) {
+
+    while ((i = __atomic_fetch_add(&leak_next, 1, __ATOMIC_RELAXED)) <
+           leak_chunks_count) {
+
+      struct leak_chunk* c = &leak_chunks[i];
+      if (c->state != LEAK_REACHABLE) leak_scan(NULL, c->start, c->end, c);
+
+    }
+
+    return NULL;
+
+  }
+
+  while ((i = __atomic_fetch_add(&leak_next, 1, __ATOMIC_RELAXED)) <
+         leak_tasks_count) {
+
+    leak_scan(&st, leak_tasks[i].start, leak_tasks[i].end, NULL);
+    while (st.count) {
+
+      struct leak_chunk* c = st.items[--st.count];
+      leak_scan(&st, c->start, c->end, c);
+
+    }
+
+  }
+
+  free(st.items);
+  return NULL;
+
+}
+
+// run leak_worker on the pool and on this thread
+static void leak_run(int indirect) {
+
+  pthread_t threads[LEAK_MAX_THREADS];
+  uint32_t  n = leak_threads, started = 0, i;
+
+  if (!n) {
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n = cpus > 0 ? (cpus < 8 ? cpus : 8) : 1;
+
+  }
+
+  if (n > LEAK_MAX_THREADS) n = LEAK_MAX_THREADS;
+
+  leak_indirect_pass = indirect;
+  leak_next = 0;
+
+  for (i = 1; i < n; ++i)
+    if (!pthread_create(&threads[started], NULL, leak_worker, NULL))
+      ++started;
+  leak_worker(NULL);
+  for (i = 0; i < started; ++i)
+    pthread_join(threads[i], NULL);
+
+}
+
+static void leak_collect_node(struct alloc_tree_node* node) {
+
+  if (node->ckinfo.free_ctx) return;
+
+  struct leak_chunk* c = &leak_chunks[leak_chunks_count++];
+  c->start = node->ckinfo.start;
+  c->end = node->ckinfo.end;
+  c->node = node;
+
+}
+
+static int leak_chunk_cmp(const void* a, const void* b) {
+
+  const struct leak_chunk* x = a;
+  const struct leak_chunk* y = b;
+
+  if (x->start != y->start) return x->start < y->start ? -1 : 1;
+  return 0;
+
+}
+
+// the live chunks in address order, from the tree and from the heap
+static void leak_collect_chunks(void) {
+
+  struct alloc_tree_node** heap;
+  struct rb_node*          rb;
+  size_t                   n = 0, heap_n = heap_nodes(NULL), i;
+
+  for (rb = rb_first(&root); rb; rb = rb_next(rb))
+    ++n;
+
+  leak_chunks = calloc(n + heap_n ? n + heap_n : 1, sizeof(struct leak_chunk));
+  leak_chunks_count = 0;
+
+  for (rb = rb_first(&root); rb; rb = rb_next(rb))
+    leak_collect_node(rb_entry(rb, struct alloc_tree_node, rb));
+
+  if (!heap_n) return;
+
+  heap = calloc(heap_n, sizeof(struct alloc_tree_node*));
+  heap_nodes(heap);
+  for (i = 0; i < heap_n; ++i)
+    leak_collect_node(heap[i]);
+  free(heap);
+
+  internal_sort(leak_chunks, leak_chunks_count, sizeof(struct leak_chunk),
+                leak_chunk_cmp);
+
+}
+
+// the roots cut in pieces of at most LEAK_TASK_BYTES
+static void leak_collect_tasks(void) {
+
+  size_t i, n = 0;
+
+  pthread_mutex_lock(&leak_roots_lock);
+
+  for (i = 0; i < leak_roots_count; ++i)
+    n += (leak_roots[i].end - leak_roots[i].start + LEAK_TASK_BYTES - 1) /
+         LEAK_TASK_BYTES;
+
+  leak_tasks = calloc(n ? n : 1, sizeof(struct leak_range));
+  leak_tasks_count = 0;
+
+  for (i = 0; i < leak_roots_count; ++i) {
+
+    target_ulong start = leak_roots[i].start;
+    while (start < leak_roots[i].end) {
+
+      target_ulong end = leak_roots[i].end - start > LEAK_TASK_BYTES
+                             ? start + LEAK_TASK_BYTES
+                             : leak_roots[i].end;
+      leak_tasks[leak_tasks_count].start = start;
+      leak_tasks[leak_tasks_count].end = end;
+      ++leak_tasks_count;
+      start = end;
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&leak_roots_lock);
+
+}
+
+static int leak_group_cmp(const void* a, const void* b) {
+
+  const struct leak_group* x = a;
+  const struct leak_group* y = b;
+
+  if (x->state != y->state) return x->state < y->state ? -1 : 1;
+  if (x->stack_id != y->stack_id) return x->stack_id < y->stack_id ? -1 : 1;
+  return 0;
+
+}
+
+static int leak_group_bytes_cmp(const void* a, const void* b) {
+
+  const struct leak_group* x = a;
+  const struct leak_group* y = b;
+
+  if (x->state != y->state) return x->state < y->state ? -1 : 1;
+  if (x->bytes != y->bytes) return x->bytes > y->bytes ? -1 : 1;
+  return 0;
+
+}
+
+// group the leaked chunks by kind and allocation stack, returns the number
+// of groups
+static size_t leak_group(struct leak_group* groups) {
+
+  size_t i, n = 0, merged = 0;
+
+  for (i = 0; i < leak_chunks_count; ++i) {
+
+    struct leak_chunk* c = &leak_chunks[i];
+    if (c->state == LEAK_REACHABLE) continue;
+
+    groups[n].stack_id =
+        context_stack_id(c->node->ckinfo.alloc_ctx, MAX_CONTEXT_FRAMES);
+    groups[n].state = c->state;
+    groups[n].bytes = c->end - c->start;
+    groups[n].count = 1;
+    groups[n].chunk = c;
+    ++n;
+
+  }
+
+  internal_sort(groups, n, sizeof(struct leak_group), leak_group_cmp);
+
+  for (i = 0; i < n; ++i) {
+
+    if (merged && !leak_group_cmp(&groups[merged - 1], &groups[i])) {
+
+      groups[merged - 1].bytes += groups[i].bytes;
+      groups[merged - 1].count += groups[i].count;
+
+    } else {
+
+      groups[merged++] = groups[i];
+
+    }
+
+  }
+
+  internal_sort(groups, merged, sizeof(struct leak_group),
+                leak_group_bytes_cmp);
+
+  for (i = 0; i < merged; ++i)
+    groups[i].ctx = context_copy(groups[i].chunk->node->ckinfo.alloc_ctx);
+  return merged;
+
+}
+
+size_t asan_giovese_leak_check(void) {
+
+  struct leak_group* groups;
+  size_t             n, i, leaked = 0, bytes = 0;
+
+  if (!alloc_lock_all()) return 0;
+
+  leak_collect_chunks();
+  leak_collect_tasks();
+  leak_run(0);
+  leak_run(1);
+
+  groups = calloc(leak_chunks_count ? leak_chunks_count : 1,
+                  sizeof(struct leak_group));
+  n = leak_group(groups);
+
+  free(leak_tasks);
+  free(leak_chunks);
+  leak_tasks = NULL;
+  leak_chunks = NULL;
+  alloc_unlock_all();
+
+  report_begin();
+
+  for (i = 0; i < n; ++i) {
+
+    struct call_context* ctx = groups[i].ctx;
+    if (suppressed(ASAN_ERROR_MEMORY_LEAK, ctx)) continue;
+
+    if (!leaked)
+      report_printf(
+          "\n================================================================="
+          "\n" ANSI_COLOR_HRED "==%d==ERROR: LeakSanitizer: detected memory "
+          "leaks" ANSI_COLOR_RESET "\n\n",
+          getpid());
+
+    report_printf(ANSI_COLOR_HBLU "%s leak of %zu byte(s) in %zu object(s) "
+                  "allocated from:" ANSI_COLOR_RESET "\n",
+                  groups[i].state == LEAK_UNREACHED ? "Direct" : "Indirect",
+                  groups[i].bytes, groups[i].count);
+    print_context(ctx);
+
+    leaked += groups[i].count;
+    bytes += groups[i].bytes;
+
+  }
+
+  if (leaked) {
+
+    stats_report(ASAN_ERROR_MEMORY_LEAK);
+    report_printf("SUMMARY: " ASAN_NAME_STR ": %zu byte(s) leaked in %zu "
+                  "allocation(s).\n",
+                  bytes, leaked);
+
+  }
+
+  report_end();
+
+  for (i = 0; i < n; ++i)
+    free_context(groups[i].ctx);
+  free(groups);
+  return leaked;
+
+}
+
+void asan_giovese_set_leak_check(int at_exit, uint32_t threads) {
+
+  leak_threads = threads;
+  if (at_exit) {
+
+    leak_at_exit = 1;
+    exit_handler_register();
+
+  }
+
+}
+
+// One handler prints everything at exit. A leak makes it leave with _exit,
+// so the summary of continue mode is printed and stdio flushed first.
+static void exit_handler(void) {
+
+  size_t leaked = leak_at_exit ? asan_giovese_leak_check() : 0;
+
+  if (dedup_at_exit) dedup_summary();
+
+  if (leaked) {
+
+    fflush(NULL);
+    _exit(LEAK_EXIT_CODE);
+
+  }
+
+}
+
+static void exit_handler_register(void) {
+
+  static int registered;
+
+  if (!__atomic_exchange_n(&registered, 1, __ATOMIC_RELAXED))
+    atexit(exit_handler);
+
+}
+
+// ------------------------------------------------------------------------- //
+// Heap profile
+// ------------------------------------------------------------------------- //
+
+// Counters per allocation site, a site is the allocation stack. The sites are
+// interned in a global table that keeps a copy of their frames, the counters
+// are in a shard per thread that only its thread writes, so they need no
+// locked instruction. The free of a chunk is counted in the shard of the
+// thread that frees it, the live counters of a shard can wrap but their sum
+// over the shards is right. A dump sums the shards and sorts the sites by
+// live bytes. Sites that do not fit the table are counted together, a site
+// probes only a few entries so a full table stays cheap. When a thread exits
+// its shard is folded into profile_retired and kept for the next thread.
+
+#define PROFILE_SITES 4096
+#define PROFILE_OTHER PROFILE_SITES  // the sites that did not fit
+#define PROFILE_PROBES 16
+#define PROFILE_SIZE_BUCKETS 16      // 16, 64, 256 ... bytes
+#define PROFILE_SIGNAL_SITES 32
+
+struct profile_site {
+
+  uint64_t             id;
+  struct call_context* ctx;  // set after id
+
+};
+
+struct profile_counters {
+
+  uint64_t live_bytes;
+  uint64_t live_chunks;
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t sizes[PROFILE_SIZE_BUCKETS];
+
+};
+
+struct profile_shard {
+
+  struct profile_shard*   next;
+  struct profile_shard*   next_free;
+  struct profile_counters sites[PROFILE_SITES + 1];
+
+};
+
+static int                   profile_enabled;
+static struct profile_site   profile_sites[PROFILE_SITES];
+static struct profile_shard* profile_shards;
+
+// the shards of the exited threads, folded and free for reuse
+static struct profile_shard  profile_retired;
+static struct profile_shard* profile_shards_free;
+static pthread_mutex_t       profile_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t         profile_shard_key;
+static pthread_once_t        profile_shard_once = PTHREAD_ONCE_INIT;
+
+static __thread struct profile_shard* profile_shard;
+
+// the merge of a dump, only used while the report is owned
+static struct profile_counters profile_merged[PROFILE_SITES + 1];
+static uint32_t                profile_order[PROFILE_SITES + 1];
 
-static const char* access_type_str[] = {"READ", "WRITE"};
+static int profile_size_bucket(size_t size) {
 
-static const char* poisoned_strerror(uint8_t poison_byte) {
+  int b;
 
-  switch (poison_byte) {
+  if (size <= 16) return 0;
+  b = (64 - __builtin_clzll((uint64_t)size - 1) - 3) / 2;
+  return b < PROFILE_SIZE_BUCKETS ? b : PROFILE_SIZE_BUCKETS - 1;
 
-    case ASAN_HEAP_RZ:
-    case ASAN_HEAP_LEFT_RZ:
-    case ASAN_HEAP_RIGHT_RZ: return "heap-buffer-overflow";
-    case ASAN_HEAP_FREED: return "heap-use-after-free";
+}
+
+static uint32_t profile_site_get(struct call_context* ctx) {
+
+  uint64_t id = context_stack_id(ctx, MAX_CONTEXT_FRAMES);
+  uint32_t h = (uint32_t)(id >> 40);
+  uint32_t i;
+
+  if (!id) return PROFILE_OTHER;
+
+  for (i = 0; i < PROFILE_PROBES; ++i) {
+
+    uint32_t             idx = (h + i) % PROFILE_SITES;
+    struct profile_site* site = &profile_sites[idx];
+    uint64_t             cur = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+
+    if (cur == 0 &&
+        __atomic_compare_exchange_n(&site->id, &cur, id, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+
+      // the chunk context goes away, the site keeps a copy
+      __atomic_store_n(&site->ctx, context_copy(ctx), __ATOMIC_RELEASE);
+      return idx;
+
+    }
+
+    if (cur == id) return idx;
 
   }
 
-  return "use-after-poison";
+  return PROFILE_OTHER;
 
 }
 
-static int poisoned_find_error(target_ulong addr, size_t n,
-                               target_ulong* fault_addr,
-                               const char**  err_string) {
+// add the counters of shard to dst
+static void profile_fold(struct profile_counters* dst,
+                         struct profile_shard*    shard) {
 
-  target_ulong start = addr;
-  target_ulong end = start + n;
-  int          have_partials = 0;
+  uint32_t i, b;
 
-  while (start < end) {
+  for (i = 0; i <= PROFILE_SITES; ++i, ++dst) {
 
-    uintptr_t rs = (uintptr_t)g2h(start);
-    int8_t*   shadow_addr = (int8_t*)(rs >> 3) + SHADOW_OFFSET;
-    switch (*shadow_addr) {
+    struct profile_counters* src = &shard->sites[i];
 
-      case ASAN_VALID: have_partials = 0; break;
-      case ASAN_PARTIAL1:
-      case ASAN_PARTIAL2:
-      case ASAN_PARTIAL3:
-      case ASAN_PARTIAL4:
-      case ASAN_PARTIAL5:
-      case ASAN_PARTIAL6:
-      case ASAN_PARTIAL7: {
+    dst->live_bytes += __atomic_load_n(&src->live_bytes, __ATOMIC_RELAXED);
+    dst->live_chunks += __atomic_load_n(&src->live_chunks, __ATOMIC_RELAXED);
+    dst->allocs += __atomic_load_n(&src->allocs, __ATOMIC_RELAXED);
+    dst->frees += __atomic_load_n(&src->frees, __ATOMIC_RELAXED);
+    for (b = 0; b < PROFILE_SIZE_BUCKETS; ++b)
+      dst->sizes[b] += __atomic_load_n(&src->sizes[b], __ATOMIC_RELAXED);
 
-        have_partials = 1;
-        target_ulong a = (start & ~7) + *shadow_addr;
-        if (*fault_addr == 0 && a >= start && a < end) *fault_addr = a;
-        break;
+  }
 
-      }
+}
 
-      default: {
+// the counters of the exiting thread go to profile_retired, its shard is
+// cleared and stays in profile_shards for the next thread
+static void profile_shard_exit(void* arg) {
 
-        if (*fault_addr == 0) *fault_addr = start;
-        *err_string = poisoned_strerror(*shadow_addr);
-        return 1;
+  struct profile_shard* shard = arg;
 
-      }
+  pthread_mutex_lock(&profile_shards_lock);
 
-    }
+  profile_fold(profile_retired.sites, shard);
+  memset(shard->sites, 0, sizeof(shard->sites));
+  shard->next_free = profile_shards_free;
+  profile_shards_free = shard;
 
-    start += 8;
+  pthread_mutex_unlock(&profile_shards_lock);
+  profile_shard = NULL;
 
-  }
+}
 
-  if (have_partials) {
+static void profile_shard_key_init(void) {
 
-    uintptr_t rs = (uintptr_t)g2h((end & ~7) + 8);
-    uint8_t*  last_shadow_addr = (uint8_t*)(rs >> 3) + SHADOW_OFFSET;
-    *err_string = poisoned_strerror(*last_shadow_addr);
-    return 1;
+  pthread_key_create(&profile_shard_key, profile_shard_exit);
+
+}
+
+static struct profile_counters* profile_counters(uint32_t site) {
+
+  struct profile_shard* shard = profile_shard;
+
+  if (!shard) {
+
+    pthread_once(&profile_shard_once, profile_shard_key_init);
+
+    pthread_mutex_lock(&profile_shards_lock);
+    if ((shard = profile_shards_free)) profile_shards_free = shard->next_free;
+    pthread_mutex_unlock(&profile_shards_lock);
+
+    if (!shard) {
+
+      shard = mmap(NULL, sizeof(struct profile_shard), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (shard == MAP_FAILED) return NULL;
+
+      shard->next = __atomic_load_n(&profile_shards, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n(&profile_shards, &shard->next,
+                                          shard, 0, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED))
+        ;
+
+    }
+
+    pthread_setspecific(profile_shard_key, shard);
+    profile_shard = shard;
 
   }
 
-  if (*fault_addr == 0) *fault_addr = addr;
-  *err_string = "use-after-poison";
-  return 1;
+  return &shard->sites[site];
 
 }
 
-#define _MEM2SHADOW(x) ((uint8_t*)((uintptr_t)g2h(x) >> 3) + SHADOW_OFFSET)
+static uint32_t profile_alloc(struct call_context* ctx, size_t size) {
 
-#define _MEM2SHADOWPRINT(x) shadow_color_map[*_MEM2SHADOW(x)], *_MEM2SHADOW(x)
+  struct profile_counters* c;
+  uint32_t                 site;
 
-static int print_shadow_line(target_ulong addr) {
+  if (!profile_enabled || !ctx) return 0;
 
-  fprintf(stderr,
-          "  0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-          " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-          " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-          " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-          " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-          " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-          " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-          " "
-          "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-          " %s%02x" ANSI_COLOR_RESET "\n",
-          (uintptr_t)_MEM2SHADOW(addr), _MEM2SHADOWPRINT(addr),
-          _MEM2SHADOWPRINT(addr + 8), _MEM2SHADOWPRINT(addr + 16),
-          _MEM2SHADOWPRINT(addr + 24), _MEM2SHADOWPRINT(addr + 32),
-          _MEM2SHADOWPRINT(addr + 40), _MEM2SHADOWPRINT(addr + 48),
-          _MEM2SHADOWPRINT(addr + 56), _MEM2SHADOWPRINT(addr + 64),
-          _MEM2SHADOWPRINT(addr + 72), _MEM2SHADOWPRINT(addr + 80),
-          _MEM2SHADOWPRINT(addr + 88), _MEM2SHADOWPRINT(addr + 96),
-          _MEM2SHADOWPRINT(addr + 104), _MEM2SHADOWPRINT(addr + 112),
-          _MEM2SHADOWPRINT(addr + 120));
+  site = profile_site_get(ctx);
+  if (!(c = profile_counters(site))) return 0;
 
-  return 1;
+  stats_add(&c->live_bytes, size);
+  stats_add(&c->live_chunks, 1);
+  stats_add(&c->allocs, 1);
+  stats_add(&c->sizes[profile_size_bucket(size)], 1);
+  return site + 1;
 
 }
 
-static int print_shadow_line_fault(target_ulong addr, target_ulong fault_addr) {
-
-  int         i = (fault_addr - addr) / 8;
-  const char* format =
-      "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-      " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-      " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-      " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-      " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-      " "
-      "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-      " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-      " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET "\n";
-  switch (i) {
-
-    case 0:
-      format = "=>0x%012" PRIxPTR ":[%s%02x" ANSI_COLOR_RESET
-               "]%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 1:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               "[%s%02x" ANSI_COLOR_RESET "]%s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 2:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET "[%s%02x" ANSI_COLOR_RESET
-               "]%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 3:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               "[%s%02x" ANSI_COLOR_RESET "]%s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 4:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET "[%s%02x" ANSI_COLOR_RESET
-               "]%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 5:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               "[%s%02x" ANSI_COLOR_RESET "]%s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 6:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET "[%s%02x" ANSI_COLOR_RESET
-               "]%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 7:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               "[%s%02x" ANSI_COLOR_RESET "]%s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 8:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET "[%s%02x" ANSI_COLOR_RESET
-               "]%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 9:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               "[%s%02x" ANSI_COLOR_RESET "]%s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 10:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET "[%s%02x" ANSI_COLOR_RESET
-               "]%s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 11:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET "[%s%02x" ANSI_COLOR_RESET
-               "]%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 12:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET "[%s%02x" ANSI_COLOR_RESET
-               "]%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 13:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET "[%s%02x" ANSI_COLOR_RESET
-               "]%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 14:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               "[%s%02x" ANSI_COLOR_RESET "]%s%02x" ANSI_COLOR_RESET "\n";
-      break;
-    case 15:
-      format = "=>0x%012" PRIxPTR ": %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET
-               " "
-               "%s%02x" ANSI_COLOR_RESET " %s%02x" ANSI_COLOR_RESET
-               " %s%02x" ANSI_COLOR_RESET "[%s%02x" ANSI_COLOR_RESET "]\n";
-      break;
+static void profile_free(uint32_t site, size_t size) {
 
-  }
+  struct profile_counters* c;
 
-  fprintf(stderr, format, (uintptr_t)_MEM2SHADOW(addr), _MEM2SHADOWPRINT(addr),
-          _MEM2SHADOWPRINT(addr + 8), _MEM2SHADOWPRINT(addr + 16),
-          _MEM2SHADOWPRINT(addr + 24), _MEM2SHADOWPRINT(addr + 32),
-          _MEM2SHADOWPRINT(addr + 40), _MEM2SHADOWPRINT(addr + 48),
-          _MEM2SHADOWPRINT(addr + 56), _MEM2SHADOWPRINT(addr + 64),
-          _MEM2SHADOWPRINT(addr + 72), _MEM2SHADOWPRINT(addr + 80),
-          _MEM2SHADOWPRINT(addr + 88), _MEM2SHADOWPRINT(addr + 96),
-          _MEM2SHADOWPRINT(addr + 104), _MEM2SHADOWPRINT(addr + 112),
-          _MEM2SHADOWPRINT(addr + 120));
+  if (!site || !(c = profile_counters(site - 1))) return;
 
-  return 1;
+  stats_add(&c->live_bytes, -(uint64_t)size);
+  stats_add(&c->live_chunks, -(uint64_t)1);
+  stats_add(&c->frees, 1);
 
 }
 
-#undef _MEM2SHADOW
-#undef _MEM2SHADOWPRINT
+static int profile_order_cmp(const void* a, const void* b) {
 
-static void print_shadow(target_ulong addr) {
+  const struct profile_counters* x = &profile_merged[*(const uint32_t*)a];
+  const struct profile_counters* y = &profile_merged[*(const uint32_t*)b];
 
-  target_ulong center = addr & ~127;
-  print_shadow_line(center - 16 * 8 * 5);
-  print_shadow_line(center - 16 * 8 * 4);
-  print_shadow_line(center - 16 * 8 * 3);
-  print_shadow_line(center - 16 * 8 * 2);
-  print_shadow_line(center - 16 * 8);
-  print_shadow_line_fault(center, addr);
-  print_shadow_line(center + 16 * 8);
-  print_shadow_line(center + 16 * 8 * 2);
-  print_shadow_line(center + 16 * 8 * 3);
-  print_shadow_line(center + 16 * 8 * 4);
-  print_shadow_line(center + 16 * 8 * 5);
+  if (x->live_bytes != y->live_bytes)
+    return (int64_t)x->live_bytes > (int64_t)y->live_bytes ? -1 : 1;
+  if (x->allocs != y->allocs) return x->allocs > y->allocs ? -1 : 1;
+  return 0;
 
 }
 
-static void print_alloc_location_chunk(struct chunk_info* ckinfo,
-                                       target_ulong       fault_addr) {
+// sum the shards in profile_merged, returns the number of sites seen
+static size_t profile_merge(void) {
 
-  if (fault_addr >= ckinfo->start && fault_addr < ckinfo->end)
-    fprintf(stderr,
-            ANSI_COLOR_HGRN
-            "0x%012" PRIxPTR
-            " is located %ld bytes inside of %ld-byte region [0x%012" PRIxPTR
-            ",0x%012" PRIxPTR ")" ANSI_COLOR_RESET "\n",
-            fault_addr, fault_addr - ckinfo->start, ckinfo->end - ckinfo->start,
-            ckinfo->start, ckinfo->end);
-  else if (ckinfo->start >= fault_addr)
-    fprintf(
-        stderr,
-        ANSI_COLOR_HGRN
-        "0x%012" PRIxPTR
-        " is located %ld bytes to the left of %ld-byte region [0x%012" PRIxPTR
-        ",0x%012" PRIxPTR ")" ANSI_COLOR_RESET "\n",
-        fault_addr, ckinfo->start - fault_addr, ckinfo->end - ckinfo->start,
-        ckinfo->start, ckinfo->end);
-  else
-    fprintf(
-        stderr,
-        ANSI_COLOR_HGRN
-        "0x%012" PRIxPTR
-        " is located %ld bytes to the right of %ld-byte region [0x%012" PRIxPTR
-        ",0x%012" PRIxPTR ")" ANSI_COLOR_RESET "\n",
-        fault_addr, fault_addr - ckinfo->end, ckinfo->end - ckinfo->start,
-        ckinfo->start, ckinfo->end);
+  struct profile_shard* shard;
+  size_t                n = 0;
+  uint32_t              i;
+  int                   locked = internal_lock(&profile_shards_lock);
 
-  if (ckinfo->free_ctx) {
+  // a shard is folded and cleared under the lock, it is not counted twice
+  memset(profile_merged, 0, sizeof(profile_merged));
+  profile_fold(profile_merged, &profile_retired);
+  for (shard = __atomic_load_n(&profile_shards, __ATOMIC_ACQUIRE); shard;
+       shard = shard->next)
+    profile_fold(profile_merged, shard);
+  if (locked) pthread_mutex_unlock(&profile_shards_lock);
+
+  for (i = 0; i <= PROFILE_SITES; ++i)
+    if (profile_merged[i].allocs) profile_order[n++] = i;
+
+  internal_sort(profile_order, n, sizeof(uint32_t), profile_order_cmp);
+  return n;
+
+}
+
+void asan_giovese_heap_profile_dump(size_t max_sites) {
+
+  uint64_t live_bytes = 0, live_chunks = 0, allocs = 0, frees = 0;
+  size_t   n, i;
+  uint32_t b;
 
-    fprintf(stderr,
-            ANSI_COLOR_HMAG "freed by thread T%d here:" ANSI_COLOR_RESET "\n",
-            ckinfo->free_ctx->tid);
-    size_t i;
-    for (i = 0; i < ckinfo->free_ctx->size; ++i) {
+  report_begin();
 
-      char* printable = asan_giovese_printaddr(ckinfo->free_ctx->addresses[i]);
-      if (printable)
-        fprintf(stderr, "    #%lu 0x%012" PRIxPTR "%s\n", i,
-                ckinfo->free_ctx->addresses[i], printable);
+  n = profile_merge();
+  for (i = 0; i < n; ++i) {
+
+    struct profile_counters* c = &profile_merged[profile_order[i]];
+    live_bytes += c->live_bytes;
+    live_chunks += c->live_chunks;
+    allocs += c->allocs;
+    frees += c->frees;
+
+  }
+
+  report_printf("==%d==Heap profile: %" PRId64 " live byte(s) in %" PRId64
+                " chunk(s), %" PRIu64 " alloc(s), %" PRIu64
+                " free(s) from %zu site(s)\n\n",
+                getpid(), (int64_t)live_bytes, (int64_t)live_chunks, allocs,
+                frees, n);
+
+  if (max_sites && n > max_sites) n = max_sites;
+
+  for (i = 0; i < n; ++i) {
+
+    uint32_t                 site = profile_order[i];
+    struct profile_counters* c = &profile_merged[site];
+    struct call_context*     ctx = NULL;
+
+    if (site != PROFILE_OTHER)
+      ctx = __atomic_load_n(&profile_sites[site].ctx, __ATOMIC_ACQUIRE);
+
+    report_printf(ANSI_COLOR_HBLU "Live %" PRId64 " byte(s) in %" PRId64
+                  " chunk(s), %" PRIu64 " alloc(s), %" PRIu64 " free(s), "
+                  "sizes",
+                  (int64_t)c->live_bytes, (int64_t)c->live_chunks, c->allocs,
+                  c->frees);
+    for (b = 0; b < PROFILE_SIZE_BUCKETS; ++b) {
+
+      if (!c->sizes[b]) continue;
+      if (b == PROFILE_SIZE_BUCKETS - 1)
+        report_printf(" more:%" PRIu64, c->sizes[b]);
       else
-        fprintf(stderr, "    #%lu 0x%012" PRIxPTR "\n", i,
-                ckinfo->free_ctx->addresses[i]);
+        report_printf(" <=%" PRIu64 ":%" PRIu64, (uint64_t)16 << (2 * b),
+                      c->sizes[b]);
 
     }
 
-    fputc('\n', stderr);
+    if (ctx) {
 
-    fprintf(stderr,
-            ANSI_COLOR_HMAG
-            "previously allocated by thread T%d here:" ANSI_COLOR_RESET "\n",
-            ckinfo->free_ctx->tid);
-
-  } else
+      report_printf(" allocated from:" ANSI_COLOR_RESET "\n");
+      print_context(ctx);
 
-    fprintf(stderr,
-            ANSI_COLOR_HMAG "allocated by thread T%d here:" ANSI_COLOR_RESET
-                            "\n",
-            ckinfo->alloc_ctx->tid);
+    } else {
 
-  size_t i;
-  for (i = 0; i < ckinfo->alloc_ctx->size; ++i) {
+      report_printf(" allocated from other sites" ANSI_COLOR_RESET "\n\n");
 
-    char* printable = asan_giovese_printaddr(ckinfo->alloc_ctx->addresses[i]);
-    if (printable)
-      fprintf(stderr, "    #%lu 0x%012" PRIxPTR "%s\n", i,
-              ckinfo->alloc_ctx->addresses[i], printable);
-    else
-      fprintf(stderr, "    #%lu 0x%012" PRIxPTR "\n", i,
-              ckinfo->alloc_ctx->addresses[i]);
+    }
 
   }
 
-  fputc('\n', stderr);
+  report_end();
 
 }
 
-static void print_alloc_location(target_ulong addr, target_ulong fault_addr) {
+static void profile_signal_handler(int signum) {
 
-  struct chunk_info* ckinfo = asan_giovese_alloc_search(fault_addr);
-  if (!ckinfo && addr != fault_addr) ckinfo = asan_giovese_alloc_search(addr);
+  int saved_errno = errno;
 
-  if (ckinfo) {
+  (void)signum;
+  // a report of this thread is in progress, nothing can be printed
+  if (!report_active) asan_giovese_heap_profile_dump(PROFILE_SIGNAL_SITES);
+  errno = saved_errno;
 
-    print_alloc_location_chunk(ckinfo, fault_addr);
-    return;
+}
 
-  }
+void asan_giovese_set_heap_profile(int enabled, int dump_signum) {
 
-  int i = 0;
-  while (!ckinfo && i < DEFAULT_REDZONE_SIZE)
-    ckinfo = asan_giovese_alloc_search(fault_addr - (i++));
-  if (ckinfo) {
+  profile_enabled = enabled;
 
-    print_alloc_location_chunk(ckinfo, fault_addr);
-    return;
+  if (dump_signum) {
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = profile_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(dump_signum, &sa, NULL);
 
   }
 
-  i = 0;
-  while (!ckinfo && i < DEFAULT_REDZONE_SIZE)
-    ckinfo = asan_giovese_alloc_search(fault_addr + (i++));
-  if (ckinfo) {
+}
 
-    print_alloc_location_chunk(ckinfo, fault_addr);
-    return;
+// ------------------------------------------------------------------------- //
+// Stats
+// ------------------------------------------------------------------------- //
 
-  }
+static uint32_t stats_dump_interval;  // ms, 0 when paused
 
-  fprintf(stderr, "Address 0x%012" PRIxPTR " is a wild pointer.\n", fault_addr);
+static int stats_is_shadow(uintptr_t addr) {
+
+  return (addr >= (uintptr_t)LOW_SHADOW_ADDR &&
+          addr < (uintptr_t)LOW_SHADOW_ADDR + LOW_SHADOW_SIZE) ||
+         (addr >= (uintptr_t)HIGH_SHADOW_ADDR &&
+          addr < (uintptr_t)HIGH_SHADOW_ADDR + HIGH_SHADOW_SIZE);
 
 }
 
-int asan_giovese_report_and_crash(int access_type, target_ulong addr, size_t n,
-                                  target_ulong pc, target_ulong bp,
-                                  target_ulong sp) {
+// resident pages of the shadow mappings, from the Rss of /proc/self/smaps
+static uint64_t stats_shadow_pages(void) {
 
-  struct call_context ctx;
-  asan_giovese_populate_context(&ctx, pc);
-  target_ulong fault_addr = 0;
-  const char*  error_type;
+  char     buf[4096];
+  size_t   len = 0;
+  uint64_t kb = 0;
+  int      in_shadow = 0;
 
-  if (!poisoned_find_error(addr, n, &fault_addr, &error_type)) return 0;
-  
-  fprintf(stderr,
-          "================================================================="
-          "\n" ANSI_COLOR_HRED "==%d==ERROR: " ASAN_NAME_STR
-          ": %s on address 0x%012" PRIxPTR " at pc 0x%012" PRIxPTR
-          " bp 0x%012" PRIxPTR " sp 0x%012" PRIxPTR ANSI_COLOR_RESET "\n",
-          getpid(), error_type, addr, pc, bp, sp);
-
-  fprintf(stderr,
-          ANSI_COLOR_HBLU "%s of size %lu at 0x%012" PRIxPTR
-                          " thread T%d" ANSI_COLOR_RESET "\n",
-          access_type_str[access_type], n, addr, ctx.tid);
-  size_t i;
-  for (i = 0; i < ctx.size; ++i) {
+  int fd = open("/proc/self/smaps", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
 
-    char* printable = asan_giovese_printaddr(ctx.addresses[i]);
-    if (printable)
-      fprintf(stderr, "    #%lu 0x%012" PRIxPTR "%s\n", i, ctx.addresses[i],
-              printable);
-    else
-      fprintf(stderr, "    #%lu 0x%012" PRIxPTR "\n", i, ctx.addresses[i]);
+  while (1) {
+
+    ssize_t r = read(fd, &buf[len], sizeof(buf) - len - 1);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    len += r;
+    buf[len] = 0;
+
+    char* line = buf;
+    char* eol;
+    while ((eol = strchr(line, '\n'))) {
+
+      char*     p = line;
+      uintptr_t start = module_map_hex(&p);
+      if (p != line && *p == '-')
+        in_shadow = stats_is_shadow(start);
+      else if (in_shadow && !strncmp(line, "Rss:", 4))
+        kb += strtoull(line + 4, NULL, 10);
+      line = eol + 1;
+
+    }
+
+    // a line longer than the buffer is dropped
+    len = buf + len - line;
+    if (len == sizeof(buf) - 1) len = 0;
+    memmove(buf, line, len);
 
   }
 
-  fputc('\n', stderr);
+  close(fd);
+  return kb * 1024 / sysconf(_SC_PAGESIZE);
 
-  print_alloc_location(addr, fault_addr);
+}
 
-  const char* printable_pc = asan_giovese_printaddr(pc);
-  if (!printable_pc) printable_pc = "";
-  fprintf(stderr,
-          "SUMMARY: " ASAN_NAME_STR
-          ": %s%s\n"
-          "Shadow bytes around the buggy address:\n",
-          error_type, printable_pc);
+void asan_giovese_get_stats(struct asan_giovese_stats* stats) {
 
-  print_shadow(fault_addr);
+  struct stats_shard  sum = {0};
+  struct stats_shard* shard;
+  int                 locked = internal_lock(&stats_shards_lock);
+  uint64_t            nodes;
 
-  fprintf(
-      stderr,
-      "Shadow byte legend (one shadow byte represents 8 application bytes):\n"
-      "  Addressable:           00\n"
-      "  Partially addressable: 01 02 03 04 05 06 07\n"
-      "  Heap left redzone:       " ANSI_COLOR_HRED "fa" ANSI_COLOR_RESET "\n"
-      "  Heap right redzone:      " ANSI_COLOR_HRED "fb" ANSI_COLOR_RESET "\n"
-      "  Freed heap region:       " ANSI_COLOR_HMAG "fd" ANSI_COLOR_RESET "\n"
-      //"  Stack left redzone:      " ANSI_COLOR_HRED "f1" ANSI_COLOR_RESET "\n"
-      //"  Stack mid redzone:       " ANSI_COLOR_HRED "f2" ANSI_COLOR_RESET "\n"
-      //"  Stack right redzone:     " ANSI_COLOR_HRED "f3" ANSI_COLOR_RESET "\n"
-      //"  Stack after return:      " ANSI_COLOR_HMAG "f5" ANSI_COLOR_RESET "\n"
-      //"  Stack use after scope:   " ANSI_COLOR_HMAG "f8" ANSI_COLOR_RESET "\n"
-      //"  Global redzone:          " ANSI_COLOR_HRED "f9" ANSI_COLOR_RESET "\n"
-      //"  Global init order:       " ANSI_COLOR_HCYN "f6" ANSI_COLOR_RESET "\n"
-      "  Poisoned by user:        " ANSI_COLOR_HBLU "f7" ANSI_COLOR_RESET "\n"
-      //"  Container overflow:      " ANSI_COLOR_HBLU "fc" ANSI_COLOR_RESET "\n"
-      //"  Array cookie:            " ANSI_COLOR_HRED "ac" ANSI_COLOR_RESET "\n"
-      //"  Intra object redzone:    " ANSI_COLOR_HYEL "bb" ANSI_COLOR_RESET "\n"
-      "  ASan internal:           " ANSI_COLOR_HYEL "fe" ANSI_COLOR_RESET "\n"
-      //"  Left alloca redzone:     " ANSI_COLOR_HBLU "ca" ANSI_COLOR_RESET "\n"
-      //"  Right alloca redzone:    " ANSI_COLOR_HBLU "cb" ANSI_COLOR_RESET "\n"
-      "  Shadow gap:              cc\n"
-      "==%d==ABORTING\n",
-      getpid());
+  // a shard is folded and cleared under the lock, it is not counted twice
+  stats_fold(&sum, &stats_retired);
+  stats_fold(&sum, &stats_lost);
+  for (shard = __atomic_load_n(&stats_shards, __ATOMIC_ACQUIRE); shard;
+       shard = shard->next)
+    stats_fold(&sum, shard);
+  if (locked) pthread_mutex_unlock(&stats_shards_lock);
 
-  signal(SIGABRT, SIG_DFL);
-  abort();
+  memset(stats, 0, sizeof(*stats));
+  memcpy(stats->checks, sum.checks, sizeof(stats->checks));
+  stats->poisoned_bytes = sum.poisoned_bytes;
+  stats->unpoisoned_bytes = sum.unpoisoned_bytes;
+  memcpy(stats->reports, sum.reports, sizeof(stats->reports));
+
+  // a red-black tree of n nodes is at most 2 log2(n + 1) deep
+  nodes = __atomic_load_n(&alloc_tree_nodes, __ATOMIC_RELAXED);
+  stats->alloc_tree_nodes = nodes;
+  stats->alloc_tree_depth = nodes ? 2 * (64 - __builtin_clzll(nodes)) : 0;
+
+  stats->metadata_bytes = __atomic_load_n(&alloc_meta_bytes, __ATOMIC_RELAXED);
+  stats->shadow_pages = stats_shadow_pages();
 
 }
 
-static const char* singal_to_string[] = {
-    [SIGHUP] = "HUP",
-    [SIGINT] = "INT",
-    [SIGQUIT] = "QUIT",
-    [SIGILL] = "ILL",
-    [SIGTRAP] = "TRAP",
-    [SIGABRT] = "ABRT",
-    [SIGBUS] = "BUS",
-    [SIGFPE] = "FPE",
-    [SIGKILL] = "KILL",
-    [SIGUSR1] = "USR1",
-    [SIGSEGV] = "SEGV",
-    [SIGUSR2] = "USR2",
-    [SIGPIPE] = "PIPE",
-    [SIGALRM] = "ALRM",
-    [SIGTERM] = "TERM",
-#ifdef SIGSTKFLT
-    [SIGSTKFLT] = "STKFLT",
-#endif
-    [SIGCHLD] = "CHLD",
-    [SIGCONT] = "CONT",
-    [SIGSTOP] = "STOP",
-    [SIGTSTP] = "TSTP",
-    [SIGTTIN] = "TTIN",
-    [SIGTTOU] = "TTOU",
-    [SIGURG] = "URG",
-    [SIGXCPU] = "XCPU",
-    [SIGXFSZ] = "XFSZ",
-    [SIGVTALRM] = "VTALRM",
-    [SIGPROF] = "PROF",
-    [SIGWINCH] = "WINCH",
-    [SIGIO] = "IO",
-    [SIGPWR] = "PWR",
-    [SIGSYS] = "SYS",
-};
+void asan_giovese_print_stats(void) {
 
-int asan_giovese_deadly_signal(int signum, target_ulong addr, target_ulong pc, target_ulong bp, target_ulong sp) {
+  static const char* sizes[ASAN_STATS_CHECK_SIZES] = {"1", "2", "4", "8", "N"};
 
-  struct call_context ctx;
-  asan_giovese_populate_context(&ctx, pc);
-  const char* error_type = singal_to_string[signum];
+  struct asan_giovese_stats st;
+  size_t                    i, j;
 
-  fprintf(stderr,
-          ASAN_NAME_STR ":DEADLYSIGNAL\n"
-          "================================================================="
-          "\n" ANSI_COLOR_HRED "==%d==ERROR: " ASAN_NAME_STR
-          ": %s on unknown address 0x%012" PRIxPTR " (pc 0x%012" PRIxPTR
-          " bp 0x%012" PRIxPTR " sp 0x%012" PRIxPTR " T%d)" ANSI_COLOR_RESET "\n",
-          getpid(), error_type, addr, pc, bp, sp, ctx.tid);
+  asan_giovese_get_stats(&st);
 
-  size_t i;
-  for (i = 0; i < ctx.size; ++i) {
+  report_begin();
 
-    char* printable = asan_giovese_printaddr(ctx.addresses[i]);
-    if (printable)
-      fprintf(stderr, "    #%lu 0x%012" PRIxPTR "%s\n", i, ctx.addresses[i],
-              printable);
-    else
-      fprintf(stderr, "    #%lu 0x%012" PRIxPTR "\n", i, ctx.addresses[i]);
+  report_printf("==%d==Stats:\n", getpid());
+  for (i = 0; i < 2; ++i) {
+
+    report_printf("  %-6s checks:", i == ACCESS_TYPE_LOAD ? "load" : "store");
+    for (j = 0; j < ASAN_STATS_CHECK_SIZES; ++j)
+      report_printf(" %s:%" PRIu64 "/%" PRIu64, sizes[j], st.checks[i][j][0],
+                    st.checks[i][j][1]);
+    report_printf(" (clean/poisoned)\n");
 
   }
-  
-  fputc('\n', stderr);
-  fprintf(stderr, ASAN_NAME_STR " can not provide additional info.\n");
-  
-  const char* printable_pc = asan_giovese_printaddr(pc);
-  if (!printable_pc) printable_pc = "";
-  fprintf(stderr,
-          "SUMMARY: " ASAN_NAME_STR
-          ": %s\n", printable_pc);
 
-  fprintf(stderr, "==%d==ABORTING\n", getpid());
-  return signum;
+  report_printf("  shadow:       %" PRIu64 " byte(s) poisoned, %" PRIu64
+                " unpoisoned, %" PRIu64 " resident page(s)\n",
+                st.poisoned_bytes, st.unpoisoned_bytes, st.shadow_pages);
+  report_printf("  alloc tree:   %" PRIu64 " node(s), depth <= %" PRIu64
+                ", %" PRIu64 " metadata byte(s)\n",
+                st.alloc_tree_nodes, st.alloc_tree_depth, st.metadata_bytes);
+  report_printf("  reports:     ");
+  for (i = 0; i < ASAN_STATS_ERRORS; ++i)
+    report_printf(" %s:%" PRIu64, error_type_str[i], st.reports[i]);
+  report_printf("\n");
+
+  report_end();
 
 }
 
-int asan_giovese_badfree(target_ulong addr, target_ulong pc) {
+static void* stats_dump_thread(void* arg) {
 
-  struct call_context ctx;
-  asan_giovese_populate_context(&ctx, pc);
+  (void)arg;
 
-  fprintf(stderr,
-          "================================================================="
-          "\n" ANSI_COLOR_HRED "==%d==ERROR: " ASAN_NAME_STR
-          ": attempting free on address which was not malloc()-ed: 0x%012"
-          PRIxPTR " in thread T%d" ANSI_COLOR_RESET "\n", getpid(), addr,
-          ctx.tid);
+  while (1) {
 
-  size_t i;
-  for (i = 0; i < ctx.size; ++i) {
+    uint32_t ms = __atomic_load_n(&stats_dump_interval, __ATOMIC_RELAXED);
+    uint32_t wait = ms ? ms : 1000;
 
-    char* printable = asan_giovese_printaddr(ctx.addresses[i]);
-    if (printable)
-      fprintf(stderr, "    #%lu 0x%012" PRIxPTR "%s\n", i, ctx.addresses[i],
-              printable);
-    else
-      fprintf(stderr, "    #%lu 0x%012" PRIxPTR "\n", i, ctx.addresses[i]);
+    struct timespec ts = {wait / 1000, (long)(wait % 1000) * 1000000};
+
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+      ;
+    if (ms) asan_giovese_print_stats();
 
   }
-  
-  fputc('\n', stderr);
-  print_alloc_location(addr, addr);
-  
-  const char* printable_pc = asan_giovese_printaddr(pc);
-  if (!printable_pc) printable_pc = "";
-  fprintf(stderr,
-          "SUMMARY: " ASAN_NAME_STR
-          ": bad-free %s\n", printable_pc);
 
-  fprintf(stderr, "==%d==ABORTING\n", getpid());
-  signal(SIGABRT, SIG_DFL);
-  abort();
+  return NULL;
+
+}
+
+void asan_giovese_set_stats_dump(uint32_t interval_ms) {
+
+  static int started;
+  pthread_t  thread;
+
+  __atomic_store_n(&stats_dump_interval, interval_ms, __ATOMIC_RELAXED);
+  if (!interval_ms || __atomic_exchange_n(&started, 1, __ATOMIC_ACQ_REL))
+    return;
+
+  if (pthread_create(&thread, NULL, stats_dump_thread, NULL))
+    started = 0;
+  else
+    pthread_detach(thread);
 
 }
 
@@ -0,0 +1,314 @@
+// Offline symbolizer for the reports written with asan_giovese_set_raw_reports.
+//
+//   asan-giovese-symbolize [-o outdir] report|dir...
+//
+// Each report is symbolized against the module snapshot at its end, also when
+// a file holds many reports (continue mode). The symbol and line tables are
+// cached per module and shared by all the reports.
+// The output goes to outdir/<report name>, or to stdout without -o.
+
+// Required definitions
+#include <stdint.h>
+typedef uintptr_t target_ulong;
+#define h2g(x) (x)
+#define g2h(x) (x)
+
+// Include the impl
+#include "asan-giovese-inl.h"
+
+#include <stdio.h>
+#include <limits.h>
+#include <dirent.h>
+
+#define MAX_MODULES 4096
+
+static target_ulong registered[MAX_MODULES];
+static size_t       registered_count;
+
+void asan_giovese_populate_context(struct call_context* ctx, target_ulong pc) {
+
+  (void)ctx;
+  (void)pc;
+
+}
+
+static void module_add(target_ulong base, target_ulong end,
+                       target_ulong load_bias, const char* path) {
+
+  if (registered_count == MAX_MODULES || end <= base) return;
+  asan_giovese_module_register(base, end - base, path, load_bias);
+  registered[registered_count++] = base;
+
+}
+
+static void modules_reset(void) {
+
+  while (registered_count)
+    asan_giovese_module_unregister(registered[--registered_count]);
+
+}
+
+// the ==pid==name lines that delimit the snapshot
+static int is_marker(const char* line, const char* name) {
+
+  if (strncmp(line, "==", 2)) return 0;
+  line += 2;
+  while (*line >= '0' && *line <= '9')
+    ++line;
+  return !strncmp(line, "==", 2) && !strncmp(line + 2, name, strlen(name));
+
+}
+
+// the file mapped from base, with its ELF load address
+static void map_add(uintptr_t base, uintptr_t end, uintptr_t guest_base,
+                    const char* path) {
+
+  if (path[0] != '/' || base < guest_base) return;
+
+  struct elf_symbols* es = elf_symbols_get(path);
+  uintptr_t           min_vaddr = es ? es->min_vaddr : 0;
+  module_add(base - guest_base, end - guest_base,
+             base - guest_base - min_vaddr, path);
+
+}
+
+// register the modules of the snapshot that starts at line
+static void snapshot_load(char* line) {
+
+  uintptr_t guest_base = 0, start, end, offset, load_bias;
+  uintptr_t map_base = 0, map_end = 0;
+  char      map_path[PATH_MAX] = "";
+  int       maps = 0, n;
+
+  modules_reset();
+
+  char* p = strstr(line, "guest_base ");
+  if (p) guest_base = strtoull(p + 11, NULL, 16);
+
+  // the guest modules replace the host mappings that they overlap
+  char* guest = NULL;
+
+  while ((line = strchr(line, '\n')) && *++line) {
+
+    if (is_marker(line, "END")) break;
+    if (is_marker(line, "MAPS")) {
+
+      maps = 1;
+      continue;
+
+    }
+
+    if (!maps) {
+
+      if (!guest) guest = line;
+      continue;
+
+    }
+
+    char perms[8];
+    if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " %7s %" SCNxPTR " %*s %*s%n",
+               &start, &end, perms, &offset, &n) < 4)
+      continue;
+
+    char* path = line + n;
+    while (*path == ' ')
+      ++path;
+    char*  eol = strchr(path, '\n');
+    size_t len = eol ? (size_t)(eol - path) : strlen(path);
+    if (len >= sizeof(map_path)) continue;
+
+    if (len && !strncmp(path, map_path, len) && !map_path[len] && offset) {
+
+      map_end = end;
+      continue;
+
+    }
+
+    if (map_path[0]) map_add(map_base, map_end, guest_base, map_path);
+    memcpy(map_path, path, len);
+    map_path[len] = 0;
+    map_base = start;
+    map_end = end;
+
+  }
+
+  if (map_path[0]) map_add(map_base, map_end, guest_base, map_path);
+
+  for (line = guest; line && !is_marker(line, "MAPS");) {
+
+    char path[PATH_MAX];
+    if (sscanf(line, "%" SCNxPTR " %" SCNxPTR " %" SCNxPTR " %4095[^\n]",
+               &start, &end, &load_bias, path) == 4)
+      module_add(start, end, load_bias, path);
+
+    line = strchr(line, '\n');
+    if (line) ++line;
+
+  }
+
+}
+
+// write the lines of text, a frame that falls in a module gets its symbol
+static void symbolize_lines(char* line, FILE* out) {
+
+  while (*line) {
+
+    char*         eol = strchr(line, '\n');
+    size_t        len = eol ? (size_t)(eol - line) : strlen(line);
+    uintptr_t     addr;
+    unsigned long frame;
+    int           n = 0;
+
+    fwrite(line, 1, len, out);
+
+    if (sscanf(line, "    #%lu 0x%" SCNxPTR "%n", &frame, &addr, &n) == 2 &&
+        (size_t)n == len &&
+        asan_giovese_guest_module_lookup(addr, NULL, 0, NULL)) {
+
+      const char* printable = asan_giovese_printaddr(addr);
+      if (printable) fputs(printable, out);
+
+    }
+
+    if (!eol) break;
+    fputc('\n', out);
+    line = eol + 1;
+
+  }
+
+}
+
+// A stream of continue mode holds many reports, each followed by its own
+// snapshot. The text up to a snapshot is symbolized against it and the
+// snapshot is dropped, the text after the last one keeps its modules.
+static void symbolize_report(const char* name, char* report, FILE* out) {
+
+  char* text = report;
+  int   snapshots = 0;
+
+  while (*text) {
+
+    char* snapshot = strstr(text, "==MODULES guest_base ");
+    if (!snapshot) break;
+
+    while (snapshot > text && snapshot[-1] != '\n')
+      --snapshot;
+    snapshot_load(snapshot);
+    ++snapshots;
+
+    char* rest = strstr(snapshot, "==END\n");
+    *snapshot = 0;
+    symbolize_lines(text, out);
+
+    // a snapshot cut short ends the stream
+    if (!rest) return;
+    text = rest + 6;
+
+  }
+
+  if (!snapshots)
+    fprintf(stderr, "%s: no module snapshot, not a raw report\n", name);
+  symbolize_lines(text, out);
+
+}
+
+static void symbolize_file(const char* path, const char* outdir) {
+
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+
+    perror(path);
+    return;
+
+  }
+
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  char* report = malloc(size + 1);
+  size = fread(report, 1, size, f);
+  report[size] = 0;
+  fclose(f);
+
+  FILE* out = stdout;
+  if (outdir) {
+
+    char        out_path[PATH_MAX];
+    const char* base = strrchr(path, '/');
+    snprintf(out_path, sizeof(out_path), "%s/%s", outdir,
+             base ? base + 1 : path);
+    if (!(out = fopen(out_path, "w"))) {
+
+      perror(out_path);
+      free(report);
+      return;
+
+    }
+
+  }
+
+  symbolize_report(path, report, out);
+
+  if (out != stdout) fclose(out);
+  free(report);
+
+}
+
+int main(int argc, char** argv) {
+
+  const char* outdir = NULL;
+  int         i = 1;
+
+  if (argc > 2 && !strcmp(argv[1], "-o")) {
+
+    outdir = argv[2];
+    i = 3;
+
+  }
+
+  if (i >= argc) {
+
+    fprintf(stderr, "usage: %s [-o outdir] report|dir...\n", argv[0]);
+    return 1;
+
+  }
+
+  for (; i < argc; ++i) {
+
+    struct stat st;
+    if (stat(argv[i], &st) < 0) {
+
+      perror(argv[i]);
+      continue;
+
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+
+      symbolize_file(argv[i], outdir);
+      continue;
+
+    }
+
+    DIR* dir = opendir(argv[i]);
+    if (!dir) continue;
+
+    struct dirent* e;
+    while ((e = readdir(dir))) {
+
+      char path[PATH_MAX];
+      if (e->d_name[0] == '.') continue;
+      snprintf(path, sizeof(path), "%s/%s", argv[i], e->d_name);
+      if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+        symbolize_file(path, outdir);
+
+    }
+
+    closedir(dir);
+
+  }
+
+  return 0;
+
+}
@@ -77,11 +77,24 @@ enum {
 
 };
 
+// call_context flags
+#define ASAN_CTX_PACKED 1  // frames are stored delta/varint encoded in packed
+#define ASAN_CTX_SAMPLED 2  // stack sampled out, only the pc was recorded
+
 struct call_context {
 
-  target_ulong* addresses;
-  uint32_t      tid;
-  uint32_t      size;
+  union {
+
+    target_ulong* addresses;
+    uint8_t*      packed;
+
+  };
+
+  uint32_t tid;
+  uint32_t size;  // number of frames
+  uint32_t flags;
+  uint32_t packed_size;
+  uint32_t stack_id;  // shadow call stack frames that follow, 0 if none
 
 };
 
@@ -101,6 +114,14 @@ extern void* __ag_low_shadow;
 // Virtual functions, you have to implement them
 // ------------------------------------------------------------------------- //
 
+// A weak asan_giovese_printaddr that looks up the registered guest modules
+// and then the module map is provided, define
+// ASAN_GIOVESE_NO_DEFAULT_PRINTADDR to implement it in the same unit.
+
+// Both are called while a report is rendered, possibly from a signal handler,
+// so they must not call malloc or take locks. asan_giovese_unwind_context,
+// asan_giovese_shadow_context and the default printaddr are safe there.
+
 ///////////////////////////////////////////////////////////////////////////////
 void  asan_giovese_populate_context(struct call_context* ctx, target_ulong pc);
 char* asan_giovese_printaddr(target_ulong addr);
@@ -142,14 +163,324 @@ int asan_giovese_report_and_crash(int access_type, target_ulong addr, size_t n,
                                   target_ulong pc, target_ulong bp,
                                   target_ulong sp);
 
+// returns signum, or 0 for a fault on a guard page (see guard page mode) that
+// is suppressed or, in continue mode, already reported
 int asan_giovese_deadly_signal(int signum, target_ulong addr, target_ulong pc,
                                target_ulong bp, target_ulong sp);
 
 int asan_giovese_badfree(target_ulong addr, target_ulong pc);
 
+// reports are colored by default, pass 0 to emit plain text
+void asan_giovese_set_colors(int enabled);
+
+// raw reports print only addresses followed by a snapshot of the modules,
+// asan-giovese-symbolize symbolizes them offline
+void asan_giovese_set_raw_reports(int enabled);
+
+// Continue-after-error mode. Errors are deduplicated by type, pc and the hash
+// of the top_frames innermost frames (0 for the default), only the first of
+// each is reported and report_and_crash / badfree return 1 instead of
+// aborting. The count of each distinct error is printed at exit. With
+// top_frames 1 the key is the pc alone and repeats skip the stack unwind.
+void asan_giovese_set_continue(int enabled, uint32_t top_frames);
+
+// Rate limits of the reports in continue mode, token buckets that refill at
+// rate reports per second up to burst, per pc and for the whole process. A
+// rate of 0 disables the limit, a burst of 0 is taken as burst = rate (at
+// least 1). An error dropped by the global limit does not use a token of its
+// pc. Dropped errors are only counted.
+void asan_giovese_set_rate_limit(uint32_t site_rate, uint32_t site_burst,
+                                 uint32_t global_rate, uint32_t global_burst);
+void asan_giovese_rate_dropped(uint64_t* site, uint64_t* global);
+
+// Crash records. Once a record fd is set, each error is written there as one
+// struct asan_giovese_record instead of the text report, with no formatting
+// or symbolization. Stack ids are hashes of the frames, 0 for no stack.
+
+enum {
+
+  ASAN_ERROR_HEAP_BUFFER_OVERFLOW,
+  ASAN_ERROR_HEAP_USE_AFTER_FREE,
+  ASAN_ERROR_USE_AFTER_POISON,
+  ASAN_ERROR_DEADLY_SIGNAL,
+  ASAN_ERROR_BAD_FREE,
+  ASAN_ERROR_MEMORY_LEAK,
+
+};
+
+#define ASAN_RECORD_MAGIC 0x31524741  // "AGR1"
+#define ASAN_RECORD_SHADOW_LINES 11
+
+struct asan_giovese_record {
+
+  uint32_t magic;
+  uint16_t size;  // of the whole record
+  uint16_t error;
+  uint32_t access_type;
+  uint32_t tid;
+  int32_t  signum;  // only for ASAN_ERROR_DEADLY_SIGNAL
+  uint32_t reserved;
+  uint64_t access_size;
+  uint64_t addr;
+  uint64_t fault_addr;
+  uint64_t pc;
+  uint64_t bp;
+  uint64_t sp;
+  uint64_t chunk_start;  // chunk near the fault, 0 if none
+  uint64_t chunk_end;
+  uint64_t stack_id;
+  uint64_t alloc_stack_id;
+  uint64_t free_stack_id;
+  uint64_t bucket;  // asan_giovese_bucket_hash
+  uint64_t shadow_addr;  // guest address shadowed by shadow[0], 0 if none
+  uint8_t  shadow[ASAN_RECORD_SHADOW_LINES * 16];
+
+};
+
+// fd -1 restores the text report, the file is opened in append mode and
+// closed when the record fd is set again
+void asan_giovese_set_record_fd(int fd);
+int  asan_giovese_set_record_file(const char* path);
+
+// Crash bucket, stable under ASLR: a hash of the error, the access kind
+// (the signal number for ASAN_ERROR_DEADLY_SIGNAL) and the module and ELF
+// vaddr of the innermost frames of ctx. Reports print it as BUCKET. The vaddr
+// is addr - load_bias for a registered module and the offset from the first
+// mapping plus the lowest PT_LOAD vaddr for a module of the maps, so both
+// give the same bucket and match the addresses of nm and readelf.
+uint64_t asan_giovese_bucket_hash(int error, int access_type,
+                                  struct call_context* ctx);
+
+// Share the reported buckets with other processes through a file mapped in
+// memory, created if missing. An error whose bucket is already there is not
+// reported, only a line naming the bucket is printed. Returns 0 on failure,
+// also when the file is not a store of this version (magic, slots or size).
+int asan_giovese_set_bucket_store(const char* path);
+
+// Suppressions, one rule per line ('#' starts a comment), '*' for any type:
+//   heap-use-after-free                 every error of the type
+//   heap-buffer-overflow:libfoo.so      any frame in the module
+//   *:libfoo.so+0x1000-0x2000           any frame in the module vaddrs
+//   use-after-poison:fun:png_read_*     any frame in a matching function
+// report_and_crash and badfree return 0 for a suppressed error. add returns 0
+// for an invalid rule, load the number of rules added or -1. Rules can be
+// added while the guest runs, they wait for the report in progress.
+int asan_giovese_add_suppression(const char* rule);
+int asan_giovese_load_suppressions(const char* path);
+
 struct chunk_info* asan_giovese_alloc_search(target_ulong query);
 void asan_giovese_alloc_insert(target_ulong start, target_ulong end,
                                struct call_context* alloc_ctx);
 
+// compress the frames of a context populated by asan_giovese_populate_context,
+// alloc_ctx is packed by asan_giovese_alloc_insert, free_ctx must be packed
+// by the caller after populating it
+
+void asan_giovese_pack_context(struct call_context* ctx);
+
+// Mark the chunk allocated at start as freed by free_ctx (packed here) and
+// poison it, returns 0 if start is not an allocated chunk (a bad or double
+// free). With a quarantine the chunk keeps its chunk_info until it is evicted.
+
+int asan_giovese_alloc_free(target_ulong start, struct call_context* free_ctx);
+
+// Quarantine of the chunks freed by asan_giovese_alloc_free, up to max_bytes
+// (0 disables it, the default). Each thread batches up to thread_bytes (0 for
+// 256K) of frees before moving them to the global FIFO. The oldest chunks over
+// the limit are evicted, their chunk_info and stacks are freed and recycle is
+// called, from then the embedder can reuse the memory. Without a quarantine
+// recycle is called as soon as the chunk is freed. The batch of a thread is
+// flushed when the thread exits, flush does it earlier.
+
+void asan_giovese_set_quarantine(size_t max_bytes, size_t thread_bytes,
+                                 void (*recycle)(target_ulong start,
+                                                 target_ulong end));
+void asan_giovese_quarantine_flush(void);
+void asan_giovese_quarantine_stats(size_t* bytes, size_t* chunks,
+                                   uint64_t* evicted, uint64_t* evicted_bytes);
+
+// Memory budget for the allocation metadata (chunk_info and stacks), 0 for no
+// limit (the default). Freed chunks out of the quarantine are kept only as
+// history for the reports, when the metadata is over the budget the oldest
+// freed chunks are forgotten first. stats returns the metadata in use and the
+// number and metadata bytes of the records evicted so far.
+
+void asan_giovese_set_metadata_budget(size_t bytes);
+void asan_giovese_metadata_stats(size_t* bytes, uint64_t* evicted,
+                                 uint64_t* evicted_bytes);
+
+// Guest heap. heap_init hands the guest range [base, base + size), already
+// mapped, to a size class allocator with redzones and per-thread caches.
+// The chunk_info of a chunk is kept with its slot instead of the alloc tree,
+// after a free it stays as history until the slot is reused and it is not
+// counted in the metadata budget. Freed chunks go through the quarantine, the
+// arena must not be given to asan_giovese_alloc_insert. The functions return
+// 0 when the arena is exhausted, free and realloc report a bad free and
+// return 0 for a pointer that is not a live chunk. The slots cached by a
+// thread go back to the arena when it exits, heap_thread_exit does it earlier.
+
+int          asan_giovese_heap_init(target_ulong base, size_t size);
+target_ulong asan_giovese_malloc(size_t size, target_ulong pc);
+target_ulong asan_giovese_calloc(size_t nmemb, size_t size, target_ulong pc);
+target_ulong asan_giovese_realloc(target_ulong ptr, size_t size,
+                                  target_ulong pc);
+target_ulong asan_giovese_memalign(size_t align, size_t size, target_ulong pc);
+int          asan_giovese_free(target_ulong ptr, target_ulong pc);
+size_t       asan_giovese_malloc_usable_size(target_ulong ptr);
+void         asan_giovese_heap_thread_exit(void);
+
+// Guard page mode for chunks of at least min_size bytes (0 disables it, the
+// default). Their redzones are PROT_NONE pages instead of shadow and a freed
+// chunk is protected, so overflows and uses after free fault.
+// asan_giovese_deadly_signal reports such faults as heap errors of the chunk.
+// Uses after free are told apart only while the chunk is in the quarantine,
+// without one its run is recycled at once and a fault there is reported as a
+// plain deadly signal. When mprotect fails (ENOMEM once max_map_count is
+// reached) the chunk falls back to shadow redzones and poisoning.
+
+void asan_giovese_set_heap_guard_pages(size_t min_size);
+
+// Leak detection. The roots are the guest ranges that can hold pointers to
+// the heap: thread stacks, writable data of the modules, saved registers.
+// leak_check scans them with a pool of threads (0 for one per CPU, up to 8)
+// for pointers to the live chunks, reports the unreachable ones grouped by
+// allocation stack and returns their number. The guest must not run during
+// the check. With at_exit the check runs at exit and a leak makes the process
+// exit with 23, after the summary of continue mode and a flush of stdio.
+// Leaks can be suppressed as memory-leak.
+
+void   asan_giovese_leak_add_root(target_ulong start, size_t size);
+void   asan_giovese_leak_remove_root(target_ulong start);
+size_t asan_giovese_leak_check(void);
+void   asan_giovese_set_leak_check(int at_exit, uint32_t threads);
+
+// Heap profile. When enabled each allocation is counted on its allocation
+// stack: live bytes and chunks, allocations, frees and a histogram of the
+// sizes. heap_profile_dump prints the max_sites sites with the most live bytes
+// (0 for all). With a dump_signum the profile of the 32 largest sites is also
+// printed when the process gets that signal.
+
+void asan_giovese_set_heap_profile(int enabled, int dump_signum);
+void asan_giovese_heap_profile_dump(size_t max_sites);
+
+// Runtime statistics, counted per thread and summed when read. checks is
+// indexed by access type, size (1, 2, 4, 8 and N bytes) and outcome (clean,
+// poisoned), reports by error type. The checks are counted only in a build
+// with ASAN_GIOVESE_STATS defined. alloc_tree_depth is the bound on the depth
+// of the tree of the foreign chunks given by alloc_tree_nodes. shadow_pages
+// are the resident pages of the shadow. print_stats writes them out like a
+// report, set_stats_dump does so every interval_ms from a thread of its own
+// (0 to stop).
+
+#define ASAN_STATS_CHECK_SIZES 5
+#define ASAN_STATS_ERRORS (ASAN_ERROR_MEMORY_LEAK + 1)
+
+struct asan_giovese_stats {
+
+  uint64_t checks[2][ASAN_STATS_CHECK_SIZES][2];
+  uint64_t poisoned_bytes;
+  uint64_t unpoisoned_bytes;
+  uint64_t alloc_tree_nodes;
+  uint64_t alloc_tree_depth;
+  uint64_t metadata_bytes;
+  uint64_t shadow_pages;
+  uint64_t reports[ASAN_STATS_ERRORS];
+
+};
+
+void asan_giovese_get_stats(struct asan_giovese_stats* stats);
+void asan_giovese_print_stats(void);
+void asan_giovese_set_stats_dump(uint32_t interval_ms);
+
+// Allocation stack sampling. asan_giovese_alloc_context populates ctx with a
+// full stack (asan_giovese_populate_context) or only with pc, according to
+// the sampling policy. A full stack is taken for the first site_first_k
+// allocations at each pc and then for 1 every rate allocations. A rate set for
+// a size class (the power of two class of size) overrides the default rate.
+// rate <= 1 means always, which is the default.
+
+void asan_giovese_set_alloc_sampling(uint32_t rate, uint32_t site_first_k);
+void asan_giovese_set_size_class_sampling(size_t size, uint32_t rate);
+void asan_giovese_alloc_context(struct call_context* ctx, target_ulong pc,
+                                size_t size);
+
+// Shadow call stack. The emulator calls push with the return address on each
+// guest call and pop on each guest return, then asan_giovese_shadow_context
+// can be used in asan_giovese_populate_context to capture the stack of the
+// current thread in O(1), as an id in a trie of the stack prefixes.
+
+void asan_giovese_shadow_push(target_ulong ret_addr);
+void asan_giovese_shadow_pop(void);
+void asan_giovese_shadow_context(struct call_context* ctx, target_ulong pc);
+
+// Frame pointer unwinder for guest stacks, asan_giovese_unwind_context can be
+// used in asan_giovese_populate_context. Guest memory is read with read_fn
+// (returns 0 if addr is not readable), pages that were read once are cached
+// until asan_giovese_maps_changed is called. Without read_fn only the stack
+// range registered for the thread is read. MIPS has no frame chain, its
+// frames are recovered from the function prologues starting from sp.
+
+enum {
+
+  ASAN_ARCH_X86_64,
+  ASAN_ARCH_I386,
+  ASAN_ARCH_AARCH64,
+  ASAN_ARCH_ARM,
+  ASAN_ARCH_MIPS,
+  ASAN_ARCH_MIPSEL,
+
+};
+
+typedef int (*asan_giovese_read_fn)(target_ulong addr, void* buf, size_t n);
+
+void asan_giovese_set_unwinder(int arch, asan_giovese_read_fn read_fn);
+void asan_giovese_set_stack_range(target_ulong lo, target_ulong hi);
+void asan_giovese_unwind_context(struct call_context* ctx, target_ulong pc,
+                                 target_ulong bp, target_ulong sp);
+
+// Module map, /proc/self/maps is parsed on the first lookup after a change
+// into a sorted index. Copies the path of the module containing addr and
+// sets offset to the offset from its load address, returns 0 if addr is not
+// in a module.
+
+int asan_giovese_module_lookup(target_ulong addr, char* path, size_t path_size,
+                               target_ulong* offset);
+
+// mapping containing addr in the module map, returns 0 if addr is not mapped
+int asan_giovese_maps_region(target_ulong addr, target_ulong* start,
+                             target_ulong* end, int* prot);
+
+// the guest mapped or unmapped memory, drop the cached views of the maps
+void asan_giovese_maps_changed(void);
+
+// Guest module registry, for the ELF loader and the mmap hooks of user-mode
+// emulators. Registering a module replaces the modules it overlaps. Lookups
+// are lock free, they copy the path of the module containing addr and set
+// offset to addr - load_bias, returning 0 if addr is not in a module.
+
+void asan_giovese_module_register(target_ulong base, target_ulong size,
+                                  const char* path, target_ulong load_bias);
+void asan_giovese_module_unregister(target_ulong base);
+int  asan_giovese_guest_module_lookup(target_ulong addr, char* path,
+                                      size_t path_size, target_ulong* offset);
+
+// ELF symbolizer, the symbol tables (.symtab or .dynsym) of a module are
+// indexed on the first lookup in it and cached. Copies the name of the
+// function containing addr and sets offset to the offset in the function,
+// returns 0 if addr can not be symbolized. Only the closest symbol below addr
+// is considered, addr past its size (4 KiB if unsized) is not symbolized.
+
+int asan_giovese_symbolize(target_ulong addr, char* name, size_t name_size,
+                           target_ulong* offset);
+
+// DWARF line tables, the .debug_line program of a compilation unit is
+// decoded the first time an address in it is looked up. Copies the source
+// file of addr and sets its line, returns 0 if addr has no line info. Without
+// .debug_aranges every line program of the module is decoded on a miss.
+// Define ASAN_GIOVESE_NO_DWARF to leave the decoder out.
+
+int asan_giovese_symbolize_line(target_ulong addr, char* file,
+                                size_t file_size, uint32_t* line);
+
 #endif
 
@@ -0,0 +1,175 @@
+// Required definitions
+#include <stdint.h>
+typedef uintptr_t target_ulong;
+#define h2g(x) (x)
+#define g2h(x) (x)
+
+// Include the impl
+#include "asan-giovese-inl.h"
+
+// Bench-only headers
+#include <stdio.h>
+#include <time.h>
+
+// Guest heap throughput against the naive allocator that every embedder
+// writes: bump allocation, fixed redzones poisoned per call, no reuse. The
+// heap runs once without and once with a quarantine.
+//
+//   bench.bin [threads] [ops per thread]
+
+#define ARENA_SIZE ((size_t)1 << 32)
+#define LIVE_SLOTS 1024
+#define NAIVE_REDZONE 128
+#define QUARANTINE_BYTES (16 << 20)
+
+static size_t       ops = 1000000;
+static target_ulong naive_arena;
+static size_t       naive_arena_size;
+
+void asan_giovese_populate_context(struct call_context* ctx, target_ulong pc) {
+
+  ctx->addresses = malloc(sizeof(target_ulong));
+  ctx->addresses[0] = pc;
+  ctx->size = 1;
+  ctx->tid = current_tid();
+
+}
+
+static size_t rand_size(uint32_t* seed) {
+
+  *seed = *seed * 1103515245 + 12345;
+  uint32_t r = *seed >> 8;
+  // mostly small, some medium, a few large
+  if (r % 100 < 80) return 1 + r % 128;
+  if (r % 100 < 98) return 1 + r % 4096;
+  return 1 + r % 200000;
+
+}
+
+static target_ulong naive_malloc(target_ulong* top, target_ulong end,
+                                 target_ulong begin, size_t size,
+                                 target_ulong pc) {
+
+  size_t total = NAIVE_REDZONE + ((size + 15) & ~15) + NAIVE_REDZONE;
+  if (*top + total > end) *top = begin;
+
+  target_ulong user = *top + NAIVE_REDZONE;
+  asan_giovese_poison_guest_region(*top, NAIVE_REDZONE, ASAN_HEAP_LEFT_RZ);
+  asan_giovese_unpoison_guest_region(user, size);
+  asan_giovese_poison_guest_region(user + size, total - NAIVE_REDZONE - size,
+                                   ASAN_HEAP_RIGHT_RZ);
+  *top += total;
+
+  struct call_context* ctx = calloc(sizeof(struct call_context), 1);
+  asan_giovese_populate_context(ctx, pc);
+  asan_giovese_alloc_insert(user, user + size, ctx);
+  return user;
+
+}
+
+static void naive_free(target_ulong ptr, target_ulong pc) {
+
+  struct call_context* ctx = calloc(sizeof(struct call_context), 1);
+  asan_giovese_populate_context(ctx, pc);
+  if (!asan_giovese_alloc_free(ptr, ctx)) free_context(ctx);
+
+}
+
+static void* naive_worker(void* arg) {
+
+  size_t       id = (size_t)arg;
+  size_t       per_thread = naive_arena_size / 64;
+  target_ulong begin = naive_arena + id * per_thread;
+  target_ulong top = begin;
+  target_ulong live[LIVE_SLOTS] = {0};
+  uint32_t     seed = id;
+  size_t       i;
+
+  for (i = 0; i < ops; ++i) {
+
+    size_t k = i % LIVE_SLOTS;
+    if (live[k]) naive_free(live[k], i);
+    live[k] = naive_malloc(&top, begin + per_thread, begin,
+                           rand_size(&seed), i);
+
+  }
+
+  for (i = 0; i < LIVE_SLOTS; ++i)
+    if (live[i]) naive_free(live[i], i);
+
+  return NULL;
+
+}
+
+static void* heap_worker(void* arg) {
+
+  size_t       id = (size_t)arg;
+  target_ulong live[LIVE_SLOTS] = {0};
+  uint32_t     seed = id;
+  size_t       i;
+
+  for (i = 0; i < ops; ++i) {
+
+    size_t k = i % LIVE_SLOTS;
+    if (live[k]) asan_giovese_free(live[k], i);
+    live[k] = asan_giovese_malloc(rand_size(&seed), i);
+
+  }
+
+  for (i = 0; i < LIVE_SLOTS; ++i)
+    if (live[i]) asan_giovese_free(live[i], i);
+
+  asan_giovese_heap_thread_exit();
+  return NULL;
+
+}
+
+static double run(void* (*worker)(void*), size_t threads) {
+
+  pthread_t       t[64];
+  struct timespec a, b;
+  size_t          i;
+
+  clock_gettime(CLOCK_MONOTONIC, &a);
+  for (i = 0; i < threads; ++i)
+    pthread_create(&t[i], NULL, worker, (void*)i);
+  for (i = 0; i < threads; ++i)
+    pthread_join(t[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &b);
+
+  return (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9;
+
+}
+
+int main(int argc, char** argv) {
+
+  size_t threads = argc > 1 ? strtoul(argv[1], NULL, 0) : 1;
+  if (argc > 2) ops = strtoul(argv[2], NULL, 0);
+  if (!threads || threads > 64) threads = 1;
+
+  asan_giovese_init();
+
+  void* arena = mmap(NULL, 2 * ARENA_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (arena == MAP_FAILED) return 1;
+
+  naive_arena = (target_ulong)arena;
+  naive_arena_size = ARENA_SIZE;
+  asan_giovese_heap_init((target_ulong)arena + ARENA_SIZE, ARENA_SIZE);
+
+  double naive = run(naive_worker, threads);
+  double heap = run(heap_worker, threads);
+  asan_giovese_set_quarantine(QUARANTINE_BYTES, 0, NULL);
+  double quarantine = run(heap_worker, threads);
+
+  printf("%zu threads, %zu malloc/free pairs per thread\n", threads, ops);
+  printf("naive:           %8.3fs %10.0f ops/s\n", naive,
+         threads * ops / naive);
+  printf("heap:            %8.3fs %10.0f ops/s\n", heap,
+         threads * ops / heap);
+  printf("heap+quarantine: %8.3fs %10.0f ops/s\n", quarantine,
+         threads * ops / quarantine);
+
+  return 0;
+
+}
@@ -8,7 +8,6 @@ typedef uintptr_t target_ulong;
 #include "asan-giovese-inl.h"
 
 // Test-only headers
-#include "pmparser.h"
 #include <stdio.h>
 
 target_ulong get_pc() {
@@ -19,86 +18,236 @@ target_ulong get_pc() {
 
 void asan_giovese_populate_context(struct call_context* ctx, target_ulong pc) {
 
-  ctx->addresses = calloc(sizeof(void*), 16);
-  int i;
-  ctx->size = 1;
-  ctx->tid = 0;
-  ctx->addresses[0] = pc;
-
-  for (i = 1; i < 16; ++i) {
-
-    switch (i - 1) {
-\
-#define _RA_CASE(x) \
-  case x: ctx->addresses[i] = (target_ulong)__builtin_return_address(x); break;
-      _RA_CASE(0)
-      _RA_CASE(1)
-      _RA_CASE(2)
-      _RA_CASE(3)
-      _RA_CASE(4)
-      _RA_CASE(5)
-      _RA_CASE(6)
-      _RA_CASE(7)
-      _RA_CASE(8)
-      _RA_CASE(9)
-      _RA_CASE(10)
-      _RA_CASE(11)
-      _RA_CASE(12)
-      _RA_CASE(13)
-      _RA_CASE(14)
-
-    }
-
-    if (ctx->addresses[i] && (uintptr_t)ctx->addresses[i] < 0x7fffffffffff)
-      ++ctx->size;
-    else
-      break;
+  asan_giovese_unwind_context(ctx, pc,
+                              (target_ulong)__builtin_frame_address(0), 0);
+
+}
+
+char data[1000];
+
+// report the access [addr, addr + n) and check the record written to fd
+static void test_report(int fd, target_ulong addr, size_t n, int error,
+                        target_ulong chunk) {
+
+  struct asan_giovese_record r;
+
+  if (!asan_giovese_report_and_crash(ACCESS_TYPE_LOAD, addr, n, get_pc(),
+                                     (target_ulong)__builtin_frame_address(0),
+                                     0) ||
+      read(fd, &r, sizeof(r)) != sizeof(r) || r.error != error ||
+      r.chunk_start != chunk) {
+
+    printf("<test> error %d at %p not reported\n", error, (void*)addr);
+    exit(1);
 
   }
 
 }
 
-char* asan_giovese_printaddr(target_ulong guest_addr) {
+// overflow and use after free of a chunk of the heap
+static void test_heap(void) {
+
+  const size_t arena_size = 1 << 20;
+  int          fds[2];
+
+  void* arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (arena == MAP_FAILED || pipe(fds) ||
+      !asan_giovese_heap_init((target_ulong)arena, arena_size))
+    return;
+
+  asan_giovese_set_record_fd(fds[1]);
+  asan_giovese_set_continue(1, 0);
+
+  target_ulong p = asan_giovese_malloc(10, get_pc());
+  printf("<test> heap chunk at %p\n", (void*)p);
+
+  if (asan_giovese_loadN((void*)p, 10)) {
+
+    printf("<test> heap chunk is poisoned\n");
+    exit(1);
+
+  }
+
+  test_report(fds[0], p + 10, 1, ASAN_ERROR_HEAP_BUFFER_OVERFLOW, p);
+  asan_giovese_free(p, get_pc());
+  test_report(fds[0], p + 4, 1, ASAN_ERROR_HEAP_USE_AFTER_FREE, p);
 
-  procmaps_iterator* maps = pmparser_parse(-1);
-  procmaps_struct*   maps_tmp = NULL;
+  asan_giovese_set_continue(0, 0);
+  asan_giovese_set_record_fd(-1);
+  close(fds[0]);
+  close(fds[1]);
+
+}
 
-  uintptr_t a = (uintptr_t)guest_addr;
+// a fault on a guard page goes through the suppressions like a shadow error
+__attribute__((noinline)) static void test_guard_pages(void) {
 
-  while ((maps_tmp = pmparser_next(maps)) != NULL) {
+  const size_t size = 4096;
 
-    if (a >= (uintptr_t)maps_tmp->addr_start &&
-        a < (uintptr_t)maps_tmp->addr_end) {
+  asan_giovese_set_heap_guard_pages(size);
+  target_ulong p = asan_giovese_malloc(size, get_pc());
+  if (!p || !asan_giovese_add_suppression(
+                "heap-buffer-overflow:fun:test_guard_pages"))
+    return;
 
-      size_t l = strlen(maps_tmp->pathname) + 32;
-      char*  s = malloc(l);
-      snprintf(s, l, " (%s+0x%lx)", maps_tmp->pathname,
-               a - (uintptr_t)maps_tmp->addr_start);
+  printf("<test> guard page chunk at %p\n", (void*)p);
 
-      pmparser_free(maps);
-      return s;
+  // the page after a chunk of a page is protected
+  if (asan_giovese_deadly_signal(SIGSEGV, p + size, get_pc(),
+                                 (target_ulong)__builtin_frame_address(0),
+                                 0)) {
 
-    }
+    printf("<test> guard page overflow not suppressed\n");
+    exit(1);
 
   }
 
-  pmparser_free(maps);
-  return NULL;
+  asan_giovese_set_heap_guard_pages(0);
 
 }
 
-char data[1000];
+// two raw reports written to one stream in continue mode are both symbolized
+// by asan-giovese-symbolize, each against the module snapshot that follows it
+static void test_symbolize(void) {
+
+  char  path[] = "/tmp/asan-giovese-test-XXXXXX";
+  char  cmd[64 + sizeof(path)];
+  char  line[1024];
+  int   fd, err, symbolized = 0;
+  FILE* out;
+
+  if (access("./asan-giovese-symbolize", X_OK)) {
+
+    printf("<test> asan-giovese-symbolize not built, skipped\n");
+    return;
+
+  }
+
+  if ((fd = mkstemp(path)) < 0) return;
+  err = dup(2);
+  dup2(fd, 2);
+
+  // two granules, each report at another pc so that both are distinct
+  target_ulong p = ((target_ulong)&data[900] + 7) & ~(target_ulong)7;
+  asan_giovese_set_raw_reports(1);
+  asan_giovese_set_continue(1, 0);
+  asan_giovese_poison_region((void*)p, 16, ASAN_USER);
+  asan_giovese_report_and_crash(ACCESS_TYPE_LOAD, p, 1, get_pc(),
+                                (target_ulong)__builtin_frame_address(0), 0);
+  asan_giovese_report_and_crash(ACCESS_TYPE_LOAD, p + 8, 1, get_pc(),
+                                (target_ulong)__builtin_frame_address(0), 0);
+  asan_giovese_unpoison_region((void*)p, 16);
+  asan_giovese_set_continue(0, 0);
+  asan_giovese_set_raw_reports(0);
+
+  dup2(err, 2);
+  close(err);
+  close(fd);
+
+  snprintf(cmd, sizeof(cmd), "./asan-giovese-symbolize %s", path);
+  if ((out = popen(cmd, "r"))) {
+
+    while (fgets(line, sizeof(line), out))
+      if (!strncmp(line, "    #0 0x", 9) && strstr(line, " in test_symbolize"))
+        ++symbolized;
+    pclose(out);
+
+  }
+
+  unlink(path);
+  if (symbolized != 2) {
+
+    printf("<test> %d of 2 raw reports symbolized\n", symbolized);
+    exit(1);
+
+  }
+
+}
+
+// each rule form is accepted and the malformed rules are rejected
+static void test_suppressions(void) {
+
+  static const char* valid[] = {
+
+      "use-after-poison:test.bin",
+      "heap-buffer-overflow:libnotloaded.so",
+      "*:libnotloaded.so+0x1000-0x2000",
+      "*:libnotloaded.so+0x3000",
+      "heap-use-after-free:fun:not_a_function_*",
+      "bad-free",
+
+  };
+
+  static const char* invalid[] = {
+
+      "",
+      "not-an-error",
+      "not-an-error:libnotloaded.so",
+      "*:",
+      "*:fun:",
+      "*:libnotloaded.so+",
+      "*:libnotloaded.so+0x2000-0x1000",
+      "*:libnotloaded.so+0x1000-0x1000",
+      "*:libnotloaded.so+0x1000-",
+      "*:libnotloaded.so+0x1000x",
+
+  };
+
+  size_t i;
+
+  for (i = 0; i < sizeof(valid) / sizeof(valid[0]); ++i) {
+
+    if (asan_giovese_add_suppression(valid[i])) continue;
+    printf("<test> rule \"%s\" rejected\n", valid[i]);
+    exit(1);
+
+  }
+
+  for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+
+    if (!asan_giovese_add_suppression(invalid[i])) continue;
+    printf("<test> rule \"%s\" accepted\n", invalid[i]);
+    exit(1);
+
+  }
+
+  // the first rule covers the frames of this program
+  asan_giovese_poison_region(&data[900], 16, ASAN_USER);
+  if (asan_giovese_report_and_crash(ACCESS_TYPE_LOAD, (target_ulong)&data[900],
+                                    1, get_pc(),
+                                    (target_ulong)__builtin_frame_address(0),
+                                    0)) {
+
+    printf("<test> use-after-poison not suppressed\n");
+    exit(1);
+
+  }
+
+  asan_giovese_unpoison_region(&data[900], 16);
+
+}
 
 int main() {
 
   asan_giovese_init();
 
+  test_heap();
+  test_guard_pages();
+  test_symbolize();
+  test_suppressions();
+
+  target_ulong stack_start, stack_end;
+  if (asan_giovese_maps_region((target_ulong)__builtin_frame_address(0),
+                               &stack_start, &stack_end, NULL))
+    asan_giovese_set_stack_range(stack_start, stack_end);
+
   asan_giovese_poison_region((target_ulong)data, 16, ASAN_HEAP_LEFT_RZ);
   asan_giovese_poison_region((target_ulong)&data[16 + 10], 16 + 6,
                              ASAN_HEAP_RIGHT_RZ);
 
   struct call_context* ctx = calloc(sizeof(struct call_context), 1);
-  asan_giovese_populate_context(ctx, get_pc());
+  asan_giovese_alloc_context(ctx, get_pc(), 10);
   asan_giovese_alloc_insert((target_ulong)&data[16],
                             (target_ulong)&data[16 + 10], ctx);
 
@@ -109,6 +258,7 @@ int main() {
 
     ckinfo->free_ctx = calloc(sizeof(struct call_context), 1);
     asan_giovese_populate_context(ckinfo->free_ctx, get_pc());
+    asan_giovese_pack_context(ckinfo->free_ctx);
 
   }
 